@@ -3,7 +3,7 @@
 set -eu
 
 CC="cc"
-CFLAGS="-std=c17 -Wall -Wextra -Wpedantic -O2"
+CFLAGS="-std=c17 -Wall -Wextra -Wpedantic -O2 -pthread"
 SOURCE="write_gpt.c"
 TARGET="write_gpt"
 
@@ -0,0 +1,181 @@
+// =============================================================================
+// data_index.h: Reader for the data partition index written by write_gpt
+//
+// Finds a file added with -ad/--add-data-files by name, e.g. from an EFI
+//   application, without finding and parsing FILE.TXT in the ESP. Freestanding;
+//   only needs <stdbool.h> & <stdint.h>, no libc and no allocation. Assumes a
+//   little endian CPU, as with UEFI.
+//
+// Format version 1, all fields little endian:
+//   - The header is at the start of the last lba of the basic data partition,
+//     e.g. LastBlock of the partition's EFI_BLOCK_IO_PROTOCOL media
+//   - Right before it, table_lbas lbas hold a hash table of num_slots records,
+//     starting at disk lba table_lba. num_slots is a power of 2 and at least
+//     twice the # of records, so a lookup usually reads 1 lba of records
+//   - A file's record is in slot (name_hash & (num_slots - 1)), or the next
+//     free slot after it, wrapping around. Empty slots are all 0s
+//   - name_hash is the low 32 bits of the 64-bit FNV-1a hash of the name
+//   - CRC32s are the same as in GPT headers; the header CRC32 is of the header
+//     with header_crc32 as 0, and table_crc32 is of all slots. The header CRC32
+//     is checked when the header is read; data_index_check_table() checks the
+//     table, before records from it are trusted
+//
+// Example, with read_lba() reading 1 lba of the disk into a buffer:
+//   uint8_t sector[4096];
+//   Data_Index_Header header;
+//   Data_Index_Record record;
+//   if (read_lba(disk, data_partition_last_lba, sector) &&
+//       data_index_read_header(sector, &header) &&
+//       data_index_check_table(&header, read_lba, disk, lba_size, sector) &&
+//       data_index_find(&header, "kernel.bin", read_lba, disk, lba_size, sector, &record)) {
+//       // Kernel is record.size bytes at disk lba record.lba
+//   }
+// =============================================================================
+#ifndef DATA_INDEX_H
+#define DATA_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DATA_INDEX_SIGNATURE "WGPTINDX"
+#define DATA_INDEX_VERSION 1
+
+// Data partition index header; all fields are naturally aligned
+typedef struct {
+    uint8_t signature[8];               // "WGPTINDX"
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t header_crc32;              // CRC32 of the header, with this field as 0
+    uint32_t record_size;
+    uint32_t num_records;               // # of files in the index
+    uint32_t num_slots;                 // Power of 2, at least 2x the # of files
+    uint64_t table_lba;                 // Disk lba of the 1st slot, right before the header
+    uint32_t table_lbas;
+    uint32_t table_crc32;               // CRC32 of all slots
+} Data_Index_Header;
+
+// Data partition index record
+typedef struct {
+    uint32_t name_hash;                 // Low 32 bits of the 64-bit FNV-1a hash of the name
+    uint32_t crc32;                     // CRC32 of the file data
+    uint64_t size;                      // File size in bytes
+    uint64_t lba;                       // Disk lba of the file
+    char name[104];                     // File name, 0 terminated
+} Data_Index_Record;
+
+_Static_assert(sizeof(Data_Index_Header) == 48, "Data_Index_Header must be 48 bytes");
+_Static_assert(sizeof(Data_Index_Record) == 128, "Data_Index_Record must be 128 bytes");
+
+// Read 1 lba at a disk lba into buffer; returns false on error
+typedef bool (*Data_Index_Read_Lba)(void *context, uint64_t lba, void *buffer);
+
+// =============================
+// Update a CRC32 with more data; start with a crc of 0. Bitwise, as it is only
+//   used on the index; use a table or CPU instructions to check large files
+// =============================
+static inline uint32_t data_index_crc32(uint32_t crc, const void *buf, uint64_t len) {
+    const uint8_t *bufp = buf;
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *bufp++;
+        for (uint8_t i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+// =============================
+// Get hash of a 0 terminated file name, as in each record
+// =============================
+static inline uint32_t data_index_name_hash(const char *name) {
+    uint64_t hash = 0xCBF29CE484222325;     // 64-bit FNV-1a offset basis & prime
+
+    while (*name) hash = (hash ^ (uint8_t)*name++) * 0x100000001B3;
+    return (uint32_t)hash;
+}
+
+// =============================
+// Copy & check the header from the last lba of the data partition; returns false
+//   if there is no index, or it is not a version this reader knows
+// =============================
+static inline bool data_index_read_header(const void *sector, Data_Index_Header *header) {
+    const uint8_t *src = sector;
+    uint8_t *dst = (uint8_t *)header;
+    for (uint32_t i = 0; i < sizeof *header; i++) dst[i] = src[i];
+
+    for (uint32_t i = 0; i < sizeof header->signature; i++)
+        if (header->signature[i] != (uint8_t)DATA_INDEX_SIGNATURE[i]) return false;
+
+    if (header->version != DATA_INDEX_VERSION || header->header_size != sizeof *header ||
+        header->record_size != sizeof(Data_Index_Record) || header->num_slots == 0 ||
+        (header->num_slots & (header->num_slots - 1)) != 0)
+        return false;
+
+    Data_Index_Header copy = *header;
+    copy.header_crc32 = 0;
+    return data_index_crc32(0, &copy, sizeof copy) == header->header_crc32;
+}
+
+// =============================
+// Check the CRC32 of the whole slot table against the header, reading each lba
+//   of it into sector, a buffer of 1 lba. Returns false if the table doesn't fit
+//   in its lbas, an lba could not be read, or the CRC32 is wrong, e.g. for a
+//   corrupt or stale table
+// =============================
+static inline bool data_index_check_table(const Data_Index_Header *header,
+                                          Data_Index_Read_Lba read_lba, void *context,
+                                          uint32_t lba_size, void *sector) {
+    uint64_t left = (uint64_t)header->num_slots * header->record_size;
+    if (lba_size == 0 || left > (uint64_t)header->table_lbas * lba_size) return false;
+
+    uint32_t crc = 0;
+    for (uint64_t lba = header->table_lba; left > 0; lba++) {
+        if (!read_lba(context, lba, sector)) return false;
+
+        const uint64_t len = left < lba_size ? left : lba_size;
+        crc = data_index_crc32(crc, sector, len);
+        left -= len;
+    }
+
+    return crc == header->table_crc32;
+}
+
+// =============================
+// Find the record of a file by name; sector is a buffer of 1 lba, which may be
+//   the one the header was read into. Check the table first with
+//   data_index_check_table(), as records are used as read. Returns false if the file is not in the
+//   index, or an lba could not be read
+// =============================
+static inline bool data_index_find(const Data_Index_Header *header, const char *name,
+                                   Data_Index_Read_Lba read_lba, void *context,
+                                   uint32_t lba_size, void *sector, Data_Index_Record *record) {
+    const uint32_t hash = data_index_name_hash(name);
+    const uint32_t records_per_lba = lba_size / header->record_size;
+    uint64_t sector_lba = UINT64_MAX;
+
+    for (uint32_t i = 0; i < header->num_slots; i++) {
+        const uint32_t slot = (hash + i) & (header->num_slots - 1);
+        const uint64_t lba = header->table_lba + (slot / records_per_lba);
+        if (lba != sector_lba) {
+            if (!read_lba(context, lba, sector)) return false;
+            sector_lba = lba;
+        }
+
+        const uint8_t *src = (const uint8_t *)sector + ((slot % records_per_lba) * header->record_size);
+        uint8_t *dst = (uint8_t *)record;
+        for (uint32_t j = 0; j < sizeof *record; j++) dst[j] = src[j];
+
+        if (!record->name[0]) return false;     // Empty slot ends the probe
+
+        if (record->name_hash == hash) {
+            uint32_t j = 0;
+            while (j < sizeof record->name && record->name[j] == name[j] && name[j]) j++;
+            if (j < sizeof record->name && record->name[j] == name[j]) return true;
+        }
+    }
+
+    return false;
+}
+
+#endif // DATA_INDEX_H
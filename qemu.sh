@@ -13,6 +13,9 @@ qemu-system-x86_64 \
 -rtc base=localtime \
 -net none
 
+# For a qcow2 image from 'write_gpt -q', use this -drive line instead
+#-drive format=qcow2,file=test.qcow2 \
+
 # For testing other drive physical/logical sizes. Although this did not work for me for lba size > 512
 #qemu-system-x86_64 \
 #-bios bios64.bin \
@@ -1,3 +1,11 @@
+#if defined(__linux__)
+#define _GNU_SOURCE     // fallocate(), SEEK_DATA/SEEK_HOLE, O_DIRECT
+#endif
+
+#if !defined(_WIN32)
+#define _FILE_OFFSET_BITS 64    // 64-bit off_t for fseeko(), pread() etc. on 32-bit hosts
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -5,8 +13,51 @@
 #include <time.h>
 #include <uchar.h> 
 #include <string.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#endif
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/uio.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Data partition index format, shared with its reader
+#include "data_index.h"
 
 // -------------------------------------
 // Global Typedefs
@@ -159,7 +210,7 @@ typedef struct {
     uint8_t cookie[8];
     uint8_t features[4];
     uint8_t version[4];
-    uint64_t data_offset;
+    uint8_t data_offset[8];
     uint8_t timestamp[4];
     uint8_t creator_app[4];
     uint8_t creator_ver[4];
@@ -174,18 +225,315 @@ typedef struct {
     uint8_t reserved[427];
 } __attribute__ ((packed)) Vhd;
 
+// In-memory FAT32 directory, a chain of clusters of directory entries, with a hash 
+//   table of its entries' short names for lookups
+typedef struct {
+    uint32_t cluster;       // First cluster # for this directory's entries
+    uint32_t num_clusters;  // # of clusters in this directory's cluster chain
+    uint8_t *data;          // Directory entries, num_clusters * cluster size bytes
+    uint32_t num_entries;   // # of directory entries that fit in data
+    uint32_t first_free;    // Index of first unused or deleted entry; num_entries if full
+    uint32_t *names;        // Hash table of (entry index + 1) by short name; 0 = empty slot
+    uint32_t names_size;    // # of hash table slots, power of 2
+    bool dirty;             // Changed since read from or last written to image
+} Esp_Dir;
+
+// In-memory FAT32 metadata for the ESP; FAT, FSInfo and directories are held
+//   here while adding files, and written to the image once at the end
+typedef struct {
+    Vbr vbr;
+    FSInfo fsinfo;
+    uint32_t *fat;          // Single FAT copy, mirrored to all FATs when written
+    uint32_t fat_entries;   // # of entries in 1 FAT
+    uint32_t max_cluster;   // Last valid data cluster #
+    uint32_t dirty_lo;      // Range of FAT entries changed since last write
+    uint32_t dirty_hi;
+    uint64_t *free_map;     // Bitmap of free clusters, 1 bit per cluster; set = free
+    uint32_t free_count;    // # of free clusters
+    uint32_t next_free;     // Hint for next free cluster to check
+    uint64_t cluster_size;  // Bytes per cluster
+    Esp_Dir **dirs;
+    uint32_t num_dirs;
+    Esp_Dir **dir_table;    // Hash table of directories by cluster #; NULL = empty slot
+    uint32_t dir_table_size;
+} Esp_Staging;
+
+// File data copy planned while adding files, done after all files are laid out
+typedef struct {
+    const char *file_path;  // Local file to copy from
+    uint64_t size;          // File size in bytes
+    uint32_t cluster;       // First cluster of an ESP file's chain; 0 for a data partition file
+    uint64_t offset;        // Image byte offset of the file's first byte
+    uint32_t index_entry;   // Data partition index entry # + 1, if its CRC32 is got while copying
+    uint32_t crc32;         // CRC32 register of the data copied so far, see add_copy_job_crc32()
+    bool result;            // Copied successfully
+} Copy_Job;
+
+// Range of lbas in the image, for printing the layout of a dry run
+typedef struct {
+    uint64_t lba;
+    uint64_t num_lbas;
+    const char *name;       // What is in this range
+    const char *file_path;  // Local file copied to this range, or NULL
+} Plan_Extent;
+
+// Range of the image written from a file in a previous build, for patching it in place
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t fingerprint;   // Identity of the file copied here; 0 = not a file, always rewritten
+    uint32_t crc32;         // CRC32 of a data partition file's data, if has_crc32
+    bool has_crc32;
+    uint32_t index_entry;   // Data partition index entry # + 1 of the file, 0 if none; not saved
+} Cache_Extent;
+
+// Build cache state of an image; what it was built from, and where each file went
+typedef struct {
+    uint64_t key;           // Hash of all options and inputs
+    uint64_t layout;        // Hash of partition & ESP layout values
+    uint64_t image;         // Fingerprint of the image file right after it was written
+    Cache_Extent *extents;  // Copied files, in copy job order, then ESP directory clusters
+    uint32_t num_extents;
+} Cache_State;
+
+// Range of an image written directly to a device, rounded out to whole device blocks
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t crc;           // CRC32 of the data written, checked when it is read back
+} Device_Range;
+
+// Position in the saved ranges of a streamed image, for reading its data back
+typedef struct {
+    uint32_t next_extent;   // First range not wholly before the last read
+    FILE *file;             // Local file of the last file data range read
+    const char *file_path;
+} Stream_Reader;
+
+// qcow2 image header, version 2; all fields are big endian
+typedef struct {
+    uint8_t magic[4];                   // "QFI\xFB"
+    uint8_t version[4];
+    uint8_t backing_file_offset[8];
+    uint8_t backing_file_size[4];
+    uint8_t cluster_bits[4];
+    uint8_t size[8];                    // Virtual disk size in bytes
+    uint8_t crypt_method[4];
+    uint8_t l1_size[4];                 // # of L1 table entries
+    uint8_t l1_table_offset[8];
+    uint8_t refcount_table_offset[8];
+    uint8_t refcount_table_clusters[4];
+    uint8_t nb_snapshots[4];
+    uint8_t snapshots_offset[8];
+} __attribute__ ((packed)) Qcow2_Header;
+
+// Dynamic Virtual Hard Disk header, after the copy of the footer at the start 
+//   of a dynamic vhd; all fields are big endian
+typedef struct {
+    uint8_t cookie[8];                  // "cxsparse"
+    uint8_t data_offset[8];             // Unused, all 1s
+    uint8_t table_offset[8];            // Byte offset of the Block Allocation Table (BAT)
+    uint8_t header_version[4];
+    uint8_t max_table_entries[4];       // # of blocks in the disk
+    uint8_t block_size[4];
+    uint8_t checksum[4];
+    uint8_t parent_unique_id[16];       // Parent fields are only for differencing disks
+    uint8_t parent_timestamp[4];
+    uint8_t reserved_1[4];
+    uint8_t parent_unicode_name[512];
+    uint8_t parent_locator_entries[8 * 24];
+    uint8_t reserved_2[256];
+} __attribute__ ((packed)) Vhd_Dynamic_Header;
+
+// VHDX header, 2 copies at 64KiB & 128KiB; all VHDX fields are little endian
+typedef struct {
+    uint8_t signature[4];               // "head"
+    uint32_t checksum;                  // CRC-32C of the whole 4KiB header
+    uint64_t sequence_number;           // Header with the higher # is the current one
+    Guid file_write_guid;
+    Guid data_write_guid;
+    Guid log_guid;                      // 0 = no log entries to replay
+    uint16_t log_version;
+    uint16_t version;
+    uint32_t log_length;
+    uint64_t log_offset;
+    uint8_t reserved[4016];
+} __attribute__ ((packed)) Vhdx_Header;
+
+// VHDX region table entry, for the BAT & metadata regions
+typedef struct {
+    Guid guid;
+    uint64_t file_offset;
+    uint32_t length;
+    uint32_t required;
+} __attribute__ ((packed)) Vhdx_Region_Entry;
+
+// VHDX region table, 2 copies at 192KiB & 256KiB
+typedef struct {
+    uint8_t signature[4];               // "regi"
+    uint32_t checksum;                  // CRC-32C of the whole 64KiB region table
+    uint32_t entry_count;
+    uint32_t reserved;
+    Vhdx_Region_Entry entries[2];
+} __attribute__ ((packed)) Vhdx_Region_Table;
+
+// VHDX metadata table entry; offsets are from the start of the metadata region
+typedef struct {
+    Guid item_id;
+    uint32_t offset;
+    uint32_t length;
+    uint32_t flags;                     // Bit 0 = user, 1 = virtual disk, 2 = required
+    uint32_t reserved;
+} __attribute__ ((packed)) Vhdx_Metadata_Entry;
+
+// VHDX metadata table, at the start of the metadata region
+typedef struct {
+    uint8_t signature[8];               // "metadata"
+    uint16_t reserved;
+    uint16_t entry_count;
+    uint32_t reserved_2[5];
+    Vhdx_Metadata_Entry entries[5];
+} __attribute__ ((packed)) Vhdx_Metadata_Table;
+
+// Range of the image to write when streaming it front to back; data is either
+//   a copy in memory, or read from a local file when it is written
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint8_t *data;          // Copy of metadata written here, or NULL
+    const char *file_path;  // Local file to read from if data is NULL
+    uint64_t file_offset;   // Byte offset in the local file
+} Stream_Extent;
+
+// Data partition file, from its record in FILE.TXT
+typedef struct {
+    char name[256];
+    uint64_t size;
+    uint64_t lba;
+} Data_File_Record;
+
+// Data partition file added to the image, for its data partition index record
+typedef struct {
+    const char *file_path;  // Local file, to get the CRC32 of its data
+    Data_Index_Record record;
+    bool has_crc32;         // CRC32 is got while copying, or from the build cache
+} Data_Index_Entry;
+
+// Count of FAT entries pointing to a cluster, updated by verify threads
+#if !defined(_WIN32)
+typedef atomic_uchar Ref_Count;
+#else
+typedef uint8_t Ref_Count;
+#endif
+
+// Memory-mapped image being verified, and what was found in it
+typedef struct {
+    const uint8_t *image;   // Image file contents
+    uint64_t file_size;     // Size of image file
+    uint64_t image_size;    // Size of disk image, without any VHD footer
+    const Vbr *vbr;
+    const FSInfo *fsinfo;
+    const uint32_t *fat;    // First FAT copy
+    uint32_t fat_entries;   // # of entries in 1 FAT
+    uint32_t max_cluster;   // Last valid data cluster #
+    uint64_t fat_lba;
+    uint64_t data_offset;   // Image byte offset of cluster 2
+    uint64_t cluster_size;
+    Ref_Count *refs;        // # of FAT entries pointing to each cluster, up to 2
+    uint8_t *reachable;     // Set for clusters in a file or directory's chain
+    uint32_t info_cluster;  // First cluster of FILE.TXT; 0 = not found
+    uint32_t info_size;
+    uint64_t num_files;
+    uint64_t num_dirs;
+    uint64_t file_bytes;
+    uint64_t file_extents;      // # of contiguous runs of clusters in all files
+    uint64_t fragmented_files;  // # of files with more than 1 run of clusters
+    uint64_t errors;
+} Verify_State;
+
+// Range of FAT entries checked by 1 verify thread, and what was found in it
+typedef struct Verify_Range {
+    Verify_State *state;
+    void (*pass)(struct Verify_Range *range);
+    uint32_t first;         // First & last FAT entry #s in range
+    uint32_t last;
+    uint64_t fat_mismatches;
+    uint64_t invalid_entries;
+    uint64_t bad_clusters;
+    uint64_t free_clusters;
+    uint64_t chain_breaks;  // Entries pointing to a cluster other than the next one
+    uint64_t lost_clusters;
+    uint64_t cross_links;
+    uint64_t max_free_run;  // Longest run of free clusters
+    uint64_t free_prefix;   // Free clusters at start & end of range, for runs across ranges
+    uint64_t free_suffix;
+    bool all_free;
+} Verify_Range;
+
+// File to add to the ESP
+typedef struct {
+    char *esp_path;     // Full path in the ESP, e.g. "/EFI/BOOT/FILE1.TXT"
+    char *file_path;    // Local file to add, opened only when it is added
+    uint32_t index;     // Order given on the command line or in a manifest
+} Esp_File;
+
+// Partition added after the ESP & basic data partition, from a -p spec
+typedef struct {
+    Guid type_guid;
+    char name[37];          // ASCII, stored as UCS-2 in the GPT entry
+    uint64_t size_mib;      // 0 = from the content file's size, or fill
+    bool fill;              // Take the rest of the image; only the last partition
+    uint64_t align_mib;
+    uint64_t attributes;
+    char *file_path;        // Raw content copied to the start of the partition, or NULL
+    uint64_t file_size;     // Set when laid out, as are the lba values
+    uint64_t lba;
+    uint64_t num_lbas;
+} Partition;
+
+// Named partition type GUID, for -p specs
+typedef struct {
+    const char *name;
+    Guid guid;
+} Partition_Type;
+
 // Internal Options object for commandline args
 typedef struct {
     char *image_name;
     uint32_t lba_size;
     uint32_t esp_size;
     uint32_t data_size;
-    char **esp_file_paths;
-    uint32_t num_esp_file_paths;
-    FILE **esp_files;
+    uint32_t cluster_size;
+    Esp_File *esp_files;
+    uint32_t num_esp_files;
+    char **esp_remove_paths;
+    uint32_t num_esp_remove_paths;
     char **data_files;
     uint32_t num_data_files;
+    uint32_t jobs;
+    char *seed;
+    char *cache_dir;
     bool vhd;
+    bool vhd_dynamic;
+    bool vhdx;
+    bool qcow2;
+    bool sparse;
+    bool stream;
+    bool device;
+    bool preallocate;
+    bool reflink;
+    bool update;
+    bool dry_run;
+    bool reproducible;
+    bool benchmark_crc32;
+    bool verify;
+    bool list;
+    char *extract_dir;
+    char **extract_paths;
+    uint32_t num_extract_paths;
+    Partition *partitions;
+    uint32_t num_partitions;
+    uint32_t image_size;
     bool help;
     bool error;
 } Options;
@@ -201,11 +549,82 @@ const Guid ESP_GUID = { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B,
 const Guid BASIC_DATA_GUID = { 0xEBD0A0A2, 0xB9E5, 0x4433, 0x87, 0xC0,
                                 { 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 } };
 
+// VHDX region & metadata item GUIDs
+const Guid VHDX_BAT_GUID = { 0x2DC27766, 0xF623, 0x4200, 0x9D, 0x64,
+                             { 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } };
+const Guid VHDX_METADATA_GUID = { 0x8B7CA206, 0x4790, 0x4B9A, 0xB8, 0xFE,
+                                  { 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } };
+const Guid VHDX_FILE_PARAMETERS_GUID = { 0xCAA16737, 0xFA36, 0x4D43, 0xB3, 0xB6,
+                                         { 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } };
+const Guid VHDX_VIRTUAL_DISK_SIZE_GUID = { 0x2FA54224, 0xCD1B, 0x4876, 0xB2, 0x11,
+                                           { 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } };
+const Guid VHDX_PAGE_83_DATA_GUID = { 0xBECA12AB, 0xB2E6, 0x4523, 0x93, 0xEF,
+                                      { 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46 } };
+const Guid VHDX_LOGICAL_SECTOR_SIZE_GUID = { 0x8141BF1D, 0xA96F, 0x4709, 0xBA, 0x47,
+                                             { 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } };
+const Guid VHDX_PHYSICAL_SECTOR_SIZE_GUID = { 0xCDA348C7, 0x445D, 0x4471, 0x9C, 0xC9,
+                                              { 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 } };
+
+// Partition types that can be given by name in a -p spec, instead of a GUID
+const Partition_Type PARTITION_TYPES[] = {
+    { "linux",       { 0x0FC63DAF, 0x8483, 0x4772, 0x8E, 0x79, { 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4 } } },
+    { "root-x86-64", { 0x4F68BCE3, 0xE8CD, 0x4DB1, 0x96, 0xE7, { 0xFB, 0xCA, 0xF9, 0x84, 0xB7, 0x09 } } },
+    { "root-arm64",  { 0xB921B045, 0x1DF0, 0x41C3, 0xAF, 0x44, { 0x4C, 0x6F, 0x28, 0x0D, 0x3F, 0xAE } } },
+    { "home",        { 0x933AC7E1, 0x2EB4, 0x4F13, 0xB8, 0x44, { 0x0E, 0x14, 0xE2, 0xAE, 0xF9, 0x15 } } },
+    { "swap",        { 0x0657FD6D, 0xA4AB, 0x43C4, 0x84, 0xE5, { 0x09, 0x33, 0xC8, 0x4B, 0x4F, 0x4F } } },
+    { "lvm",         { 0xE6D6D379, 0xF507, 0x44C2, 0xA2, 0x3C, { 0x23, 0x8F, 0x2A, 0x3D, 0xF9, 0x28 } } },
+    { "raid",        { 0xA19D880F, 0x05FC, 0x4D3B, 0xA0, 0x06, { 0x74, 0x3F, 0x0F, 0x84, 0x91, 0x1E } } },
+    { "recovery",    { 0xDE94BBA4, 0x06D1, 0x4D40, 0xA1, 0x6A, { 0xBF, 0xD5, 0x01, 0x79, 0xD6, 0xAC } } },
+    { "basic",       { 0xEBD0A0A2, 0xB9E5, 0x4433, 0x87, 0xC0, { 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7 } } },
+    { "esp",         { 0xC12A7328, 0xF81F, 0x11D2, 0xBA, 0x4B, { 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B } } },
+};
+
+// 64-bit FNV-1a hash values
+const uint64_t FNV_OFFSET_BASIS = 0xCBF29CE484222325;
+const uint64_t FNV_PRIME = 0x00000100000001B3;
+
+// Largest image sizes for the VHD & VHDX formats
+const uint64_t VHD_MAX_SIZE = 2040ULL * 1024 * 1024 * 1024;         // 2040 GiB
+const uint64_t VHDX_MAX_SIZE = 64ULL * 1024 * 1024 * 1024 * 1024;   // 64 TiB
+
+// Latest FAT32 date, 12/31/2107 23:59:59 UTC; the year is 7 bits from 1980
+const int64_t FAT32_LAST_TIME = 4354819199;
+
+// qcow2 L1/L2 table entry flag for clusters with a refcount of exactly 1
+const uint64_t QCOW2_OFLAG_COPIED = 0x8000000000000000;
+
 enum {
     GPT_TABLE_ENTRY_SIZE = 128,
     NUMBER_OF_GPT_TABLE_ENTRIES = 128,
     GPT_TABLE_SIZE = 16384,             // Minimum size per UEFI spec 2.10
     ALIGNMENT = 1048576,                // 1 MiB alignment value
+    COPY_BUFFER_SIZE = 4194304,         // 4 MiB buffer for copying file data in user space
+    MAX_DIR_ENTRIES = 65536,            // FAT32 limit of entries per directory
+    FAT32_RESERVED_SECTORS = 32,        // Reserved sectors before the FATs, including the VBR
+    FAT32_MIN_CLUSTERS = 65525,         // Fewer clusters than this would make it FAT16
+    FAT32_MAX_CLUSTERS = 0x0FFFFFF4,    // Cluster #s above this + 1 are reserved values
+    MAX_CLUSTER_SIZE = 32768,           // Largest cluster size in bytes per fatgen103.doc
+    MAX_MANIFEST_LINE = 4096,           // Longest line in a manifest file, including newline
+    MAX_JOBS = 256,                     // Most worker threads for copying file data
+    MAX_VERIFY_PATH = 1024,             // Longest ESP path shown when verifying an image
+    FAT32_EPOCH = 315532800,            // 01/01/1980 00:00:00 UTC, earliest FAT32 date
+    VHD_EPOCH = 946684800,              // 01/01/2000 00:00:00 UTC, VHD timestamps start here
+    QCOW2_CLUSTER_BITS = 16,            // qcow2 cluster size as a power of 2, qemu's default
+    QCOW2_CLUSTER_SIZE = 65536,
+    VHD_FIXED = 2,                      // VHD disk types
+    VHD_DYNAMIC = 3,
+    VHD_BLOCK_SIZE = 2097152,           // Dynamic VHD block size, 2 MiB
+    VHDX_BLOCK_SIZE = 2097152,          // VHDX block size, 2 MiB
+    VHDX_ALIGNMENT = 1048576,           // VHDX regions & blocks are 1 MiB aligned
+    VHDX_HEADER_OFFSET = 65536,         // 1st of 2 VHDX headers, after the file identifier
+    VHDX_HEADER_SIZE = 65536,
+    VHDX_REGION_TABLE_OFFSET = 196608,  // 1st of 2 VHDX region tables
+    VHDX_REGION_TABLE_SIZE = 65536,
+    VHDX_METADATA_ITEMS_OFFSET = 65536, // Metadata items, after the metadata table
+    VHDX_BLOCK_FULLY_PRESENT = 6,       // VHDX BAT entry state
+    DEVICE_ZERO_MIN = 1048576,          // Smallest gap zeroed separately when writing to a device
+    URING_QUEUE_DEPTH = 32,             // Reads & writes of file data in flight with io_uring
+    URING_BUFFER_SIZE = 1048576,        // 1 MiB buffer per io_uring read & write
 };
 
 // -------------------------------------
@@ -219,8 +638,35 @@ uint64_t esp_size_lbas = 0, data_size_lbas = 0, image_size_lbas = 0,
          gpt_table_lbas = 0;                              // Sizes in lbas
 uint64_t align_lba = 0, esp_lba = 0, data_lba = 0,
          fat32_fats_lba = 0, fat32_data_lba = 0;          // Starting LBA values
-
-bool opened_info_file = false;
+uint32_t esp_dir_hint = 0;  // # of entries expected in the directory of next ESP file added
+uint8_t esp_sec_per_clus = 0;   // Sectors per ESP cluster for a new image; 0 = based on ESP size
+
+FILE *info_file = NULL;     // Disk image info file, FILE.TXT
+bool dry_run = false;       // Only lay out the image and print where everything goes
+bool sparse = false;        // Leave zero filled regions of the image as holes
+bool preallocate = false;   // Preallocate data ranges of the image on the host filesystem
+bool reflink = false;       // Clone data partition files into the image instead of copying
+uint64_t host_block_size = 0;   // Block size of the host filesystem holding the image
+bool update = false;        // Updating files in an existing image, instead of a new image
+const char *cache_dir = NULL;   // Build cache directory; NULL = always build the whole image
+bool reproducible = false;  // Same inputs give a byte-identical image; GUIDs come from guid_seed
+uint64_t guid_seed = 0;     // State of the seeded GUID generator for reproducible images
+int64_t source_date_epoch = -1; // Fixed UTC time for all timestamps, -1 = current local time
+bool streaming = false;     // Write the image front to back in 1 pass, e.g. to a pipe
+Stream_Extent *stream_extents = NULL;   // Everything to write when streaming, in any order
+uint32_t num_stream_extents = 0;
+const char *copy_source_path = NULL;    // Local path of the ESP file being added, for its copy job
+Copy_Job *copy_jobs = NULL;
+uint32_t num_copy_jobs = 0;
+
+Esp_Staging esp = { 0 };    // ESP FAT32 metadata, written out by write_esp_metadata()
+
+Partition *partitions = NULL;   // Partitions after the ESP & basic data partition
+uint32_t num_partitions = 0;
+
+Data_Index_Entry *data_index = NULL;    // Data partition files, in the order added
+uint32_t num_data_index_entries = 0;
+Data_Index_Header data_index_header = { 0 };    // Set when the data partition is laid out
 
 // =====================================
 // Convert bytes to LBAs
@@ -233,11 +679,368 @@ uint64_t bytes_to_lbas(const uint64_t bytes) {
 // Pad out 0s to full lba size
 // =====================================
 void write_full_lba_size(FILE *image) {
-    uint8_t zero_sector[512];
+    uint8_t zero_sector[512] = { 0 };
+
+    // Streamed image; padding is written with everything else at the end
+    if (streaming) return;
+
+    // Sparse image; skip over padding instead, leaving a hole
+    if (sparse) {
+        fseek(image, lba_size - sizeof zero_sector, SEEK_CUR);
+        return;
+    }
+
     for (uint8_t i = 0; i < (lba_size - sizeof zero_sector) / sizeof zero_sector; i++)
         fwrite(zero_sector, sizeof zero_sector, 1, image);
 }
 
+// =====================================
+// Check if buffer is all zeros
+// =====================================
+bool is_zero(const void *buf, const uint64_t size) {
+    const uint8_t *p = buf;
+    return size == 0 || (p[0] == 0 && !memcmp(p, p + 1, size - 1));
+}
+
+// =====================================
+// Grow an array by 1 element; capacity doubles, so it is only reallocated when
+//   its count is 0 or a power of 2. Returns NULL if out of memory
+// =====================================
+void *grow_array(void *array, const uint32_t count, const size_t element_size) {
+    if (count != 0 && (count & (count - 1)) != 0) return array;     // Still has room
+
+    void *new_array = realloc(array, (count ? (size_t)count * 2 : 1) * element_size);
+    if (!new_array) fprintf(stderr, "Error: Could not allocate memory for file list\n");
+    return new_array;
+}
+
+// =====================================
+// Get a new copy of 2 strings joined together
+// =====================================
+char *join_strings(const char *str1, const char *str2) {
+    const size_t len1 = strlen(str1), len2 = strlen(str2);
+    char *result = malloc(len1 + len2 + 1);
+    if (!result) {
+        fprintf(stderr, "Error: Could not allocate memory for file path\n");
+        return NULL;
+    }
+
+    memcpy(result, str1, len1);
+    memcpy(result + len1, str2, len2 + 1);
+    return result;
+}
+
+// =====================================
+// Preallocate a range of the image file on the host filesystem, to avoid
+//   fragmenting it
+// =====================================
+void preallocate_range(FILE *image, const uint64_t offset, const uint64_t size) {
+    if (!preallocate || size == 0) return;
+
+#if defined(__linux__)
+    if (fallocate(fileno(image), 0, offset, size) == 0) return;
+#endif
+
+    // Not supported on this platform or host filesystem, don't try again
+    fprintf(stderr, "WARNING: Could not preallocate image file, continuing without it\n");
+    preallocate = false;
+}
+
+// =====================================
+// Add a range of the image to write when streaming it; metadata is copied, and
+//   file data is read from the local file later
+// =====================================
+bool add_stream_extent(const uint64_t offset, const uint64_t size, const void *data, 
+                       const char *file_path, const uint64_t file_offset) {
+    if (size == 0) return true;
+
+    Stream_Extent *extents = grow_array(stream_extents, num_stream_extents, sizeof *extents);
+    if (!extents) return false;
+    stream_extents = extents;
+
+    uint8_t *data_copy = NULL;
+    if (data) {
+        data_copy = malloc(size);
+        if (!data_copy) {
+            fprintf(stderr, "Error: Could not allocate memory for streamed image data\n");
+            return false;
+        }
+        memcpy(data_copy, data, size);
+    }
+
+    stream_extents[num_stream_extents++] = (Stream_Extent){
+        .offset = offset,
+        .size = size,
+        .data = data_copy,
+        .file_path = file_path,
+        .file_offset = file_offset,
+    };
+    return true;
+}
+
+// =====================================
+// Seek to a byte offset in a file; fseek() takes a long, which is only 32 bits
+//   on Windows and 32-bit hosts
+// =====================================
+bool seek_to(FILE *file, const uint64_t offset) {
+#if defined(_WIN32)
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+// =====================================
+// Get the size of an open file, and go back to its start; 0 if unknown
+// =====================================
+uint64_t get_file_size(FILE *file) {
+#if defined(_WIN32)
+    const int64_t size = _fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1;
+#else
+    const off_t size = fseeko(file, 0, SEEK_END) == 0 ? ftello(file) : -1;
+#endif
+    rewind(file);
+    return size > 0 ? (uint64_t)size : 0;
+}
+
+// =====================================
+// Write buffer to image at a given byte offset; for a sparse image, zero filled
+//   lbas are not written, and for a streamed image it is only saved for later
+// =====================================
+bool write_at(FILE *image, const void *buf, const uint64_t size, const uint64_t offset) {
+    if (streaming) return add_stream_extent(offset, size, buf, NULL, 0);
+
+    if (!sparse) {
+        if (!seek_to(image, offset)) return false;
+        return fwrite(buf, 1, size, image) == size;
+    }
+
+    // Write each run of non-zero lbas
+    const uint8_t *bufp = buf;
+    uint64_t pos = 0;
+    while (pos < size) {
+        uint64_t len = size - pos < lba_size ? size - pos : lba_size;
+        if (is_zero(bufp + pos, len)) {
+            pos += len;
+            continue;
+        }
+
+        const uint64_t start = pos;
+        while (pos < size && !is_zero(bufp + pos, len)) {
+            pos += len;
+            len = size - pos < lba_size ? size - pos : lba_size;
+        }
+
+        if (!seek_to(image, offset + start) ||
+            fwrite(bufp + start, 1, pos - start, image) != pos - start)
+            return false;
+    }
+
+    return true;
+}
+
+// =====================================
+// Read from a file at a given byte offset
+// =====================================
+uint64_t read_at(FILE *file, void *buf, const uint64_t size, const uint64_t offset) {
+#if defined(_WIN32)
+    if (!seek_to(file, offset)) return 0;
+    return fread(buf, 1, size, file);
+#else
+    // Use positional reads on the file descriptor, which leave the stream position alone
+    uint8_t *bufp = buf;
+    uint64_t total = 0;
+    while (total < size) {
+        const ssize_t bytes_read = pread(fileno(file), bufp + total, size - total, offset + total);
+        if (bytes_read <= 0) break;
+        total += bytes_read;
+    }
+    return total;
+#endif
+}
+
+#if !defined(_WIN32)
+// =====================================
+// Copy a range of a file into the image with copy_file_range(), which can share 
+//   or offload the copy on filesystems that support it. Returns # of bytes 
+//   copied, which can be less than requested (or 0) if not supported for these files
+// =====================================
+uint64_t share_range_in_kernel(const int in_fd, const uint64_t in_offset, 
+                               const int out_fd, const uint64_t out_offset,
+                               const uint64_t size) {
+    uint64_t total = 0;
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    static atomic_bool have_copy_file_range = true;    // Shared by all copy threads
+
+    while (have_copy_file_range && total < size) {
+        loff_t off_in = in_offset + total, off_out = out_offset + total;
+        const ssize_t bytes = syscall(SYS_copy_file_range, in_fd, &off_in, out_fd, &off_out, 
+                                      size - total, 0);
+        if (bytes > 0) {
+            total += bytes;
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0 && errno == ENOSYS) have_copy_file_range = false;    // Kernel too old
+        break;  // End of input file, or e.g. EXDEV for files on different filesystems
+    }
+#else
+    (void)in_fd, (void)in_offset, (void)out_fd, (void)out_offset, (void)size;
+#endif
+
+    return total;
+}
+
+// =====================================
+// Copy a range of a file into the image kernel-side, without going through
+//   a user space buffer. Returns # of bytes copied, which can be less than
+//   requested (or 0) if not supported for these files
+// =====================================
+uint64_t copy_range_in_kernel(const int in_fd, const uint64_t in_offset, 
+                              const int out_fd, const uint64_t out_offset,
+                              const uint64_t size) {
+    uint64_t total = share_range_in_kernel(in_fd, in_offset, out_fd, out_offset, size);
+
+#if defined(__linux__)
+    // Otherwise try sendfile(), which writes at the current file offset of the output file
+    if (total < size && lseek(out_fd, out_offset + total, SEEK_SET) < 0)
+        return total;
+
+    while (total < size) {
+        off_t off_in = in_offset + total;
+        const ssize_t bytes = sendfile(out_fd, in_fd, &off_in, size - total);
+        if (bytes > 0) {
+            total += bytes;
+            continue;
+        }
+        if (bytes < 0 && errno == EINTR) continue;
+        break;
+    }
+#endif
+
+    return total;
+}
+#endif
+
+void add_copy_job_crc32(Copy_Job *job, const void *buf, const uint64_t pos, const uint64_t len);
+
+// Reusable buffer for copies that can't be done kernel-side, 1 per worker thread
+_Thread_local uint8_t *copy_buf = NULL;
+
+// =====================================
+// Copy file data in range [start, end) into image, where the file starts at a 
+//   given image byte offset; for a sparse image, holes in the file and zero
+//   filled lbas are skipped over. A data partition file's copy job gets the 
+//   CRC32 of its data as it is copied; that data goes through a buffer, not
+//   kernel-side, so it is only read once
+// =====================================
+bool copy_file_to_image(FILE *file, const uint64_t start, const uint64_t end, 
+                        FILE *image, const uint64_t offset, Copy_Job *job) {
+    // Kernel-side copies write to the image file descriptor directly
+    fflush(image);
+
+    uint64_t pos = start;
+    while (pos < end) {
+        uint64_t data_end = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+        if (sparse) {
+            // Find next range of actual data in the file, skipping holes
+            const off_t data = lseek(fileno(file), pos, SEEK_DATA);
+            if (data < 0) break;    // Rest of file is a hole
+
+            const off_t hole = lseek(fileno(file), data, SEEK_HOLE);
+            pos = data;
+            if (hole > data && (uint64_t)hole < end) data_end = hole;
+            if (pos >= end) break;
+        }
+#endif
+
+        preallocate_range(image, offset + pos, data_end - pos);
+
+#if !defined(_WIN32)
+        // Data range is contiguous in the image, try to copy it kernel-side first
+        if (!job || !job->index_entry)
+            pos += copy_range_in_kernel(fileno(file), pos, fileno(image), offset + pos, data_end - pos);
+#endif
+
+        // Copy anything left through a large buffer
+        if (pos < data_end && !copy_buf) {
+            copy_buf = malloc(COPY_BUFFER_SIZE);
+            if (!copy_buf) return false;
+        }
+
+        while (pos < data_end) {
+            const uint64_t len = data_end - pos < COPY_BUFFER_SIZE ? data_end - pos : COPY_BUFFER_SIZE;
+            const uint64_t bytes_read = read_at(file, copy_buf, len, pos);
+            if (bytes_read == 0 || !write_at(image, copy_buf, bytes_read, offset + pos)) 
+                return false;
+
+            if (job) add_copy_job_crc32(job, copy_buf, pos, bytes_read);
+            pos += bytes_read;
+        }
+    }
+
+    return true;
+}
+
+// =====================================
+// Clone file data into image at a given byte offset, sharing the file's data 
+//   blocks on host filesystems with reflink support e.g. btrfs or XFS. Only
+//   whole host filesystem blocks are cloned; returns # of bytes cloned, or 0
+//   if cloning is not possible
+// =====================================
+uint64_t clone_file_to_image(FILE *file, const uint64_t file_size, FILE *image, 
+                             const uint64_t offset) {
+    if (host_block_size == 0 || offset % host_block_size != 0) return 0;
+
+    const uint64_t size = file_size - (file_size % host_block_size);
+    if (size == 0) return 0;
+
+#if defined(__linux__) && defined(FICLONERANGE)
+    struct file_clone_range range = {
+        .src_fd = fileno(file),
+        .src_offset = 0,
+        .src_length = size,
+        .dest_offset = offset,
+    };
+
+    fflush(image);
+    if (ioctl(fileno(image), FICLONERANGE, &range) == 0) return size;
+#else
+    (void)file, (void)image;
+#endif
+
+    return 0;
+}
+
+// =====================================
+// Set final size of image file, e.g. for a sparse image ending in a hole
+// =====================================
+bool set_image_size(FILE *image, const uint64_t size) {
+    fflush(image);
+#if defined(_WIN32)
+    return _chsize_s(_fileno(image), size) == 0;
+#else
+    return ftruncate(fileno(image), size) == 0;
+#endif
+}
+
+// =====================================
+// Convert bytes to ESP clusters
+// =====================================
+uint64_t bytes_to_clusters(const uint64_t bytes) {
+    return (bytes + (esp.cluster_size - 1)) / esp.cluster_size;
+}
+
+// =====================================
+// Get starting lba of an ESP data region cluster
+// =====================================
+uint64_t cluster_to_lba(const uint32_t cluster) {
+    return fat32_data_lba + ((uint64_t)(cluster - 2) * esp.vbr.BPB_SecPerClus);
+}
+
 // =====================================
 // Get next highest aligned lba value after input lba
 // =====================================
@@ -245,14 +1048,93 @@ uint64_t next_aligned_lba(const uint64_t lba) {
     return lba - (lba % align_lba) + align_lba;
 }
 
+// =====================================
+// Lay out the partitions after the data partition in the order given, each 
+//   starting at its alignment; sizes come from content files if not given. A 
+//   fill partition takes the rest of the image, up to the last usable lba 
+//   rounded down to its alignment. Gets the 1st lba after the last partition
+// =====================================
+bool layout_partitions(uint64_t *end_lba) {
+    uint64_t lba = *end_lba;
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        Partition *partition = &partitions[i];
+        const uint64_t partition_align = partition->align_mib * ALIGNMENT / lba_size;
+        partition->lba = ((lba + partition_align - 1) / partition_align) * partition_align;
+
+        if (partition->file_path) {
+            FILE *fp = fopen(partition->file_path, "rb");
+            if (!fp) {
+                fprintf(stderr, "Error: Could not open file '%s'\n", partition->file_path);
+                return false;
+            }
+            partition->file_size = get_file_size(fp);
+            fclose(fp);
+        }
+
+        if (partition->fill) {
+            const uint64_t last_usable_lba = image_size_lbas - 1 - gpt_table_lbas - 1;
+            const uint64_t end = ((last_usable_lba + 1) / partition_align) * partition_align;
+            if (end <= partition->lba) {
+                fprintf(stderr, "Error: No room left in the image for fill partition %u\n", i + 3);
+                return false;
+            }
+            partition->num_lbas = end - partition->lba;
+        } else {
+            if (!partition->size_mib) 
+                partition->size_mib = (partition->file_size + ALIGNMENT - 1) / ALIGNMENT;
+            if (!partition->size_mib) partition->size_mib = 1;
+            partition->num_lbas = partition->size_mib * ALIGNMENT / lba_size;
+        }
+
+        if (partition->file_size > partition->num_lbas * lba_size) {
+            fprintf(stderr, "Error: File '%s' is larger than partition %u\n", 
+                    partition->file_path, i + 3);
+            return false;
+        }
+        lba = partition->lba + partition->num_lbas;
+    }
+
+    *end_lba = lba;
+    return true;
+}
+
+// =====================================
+// Hash a range of data with 64-bit FNV-1a, continuing from a previous hash value
+// =====================================
+uint64_t fnv1a_64(uint64_t hash, const void *buf, const size_t len) {
+    const uint8_t *bufp = buf;
+
+    for (size_t i = 0; i < len; i++) 
+        hash = (hash ^ bufp[i]) * FNV_PRIME;
+
+    return hash;
+}
+
+// =====================================
+// Get next 64 bits from the seeded GUID generator (splitmix64)
+// =====================================
+uint64_t next_seeded_random(void) {
+    uint64_t z = (guid_seed += 0x9E3779B97F4A7C15);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
 // =====================================
 // Create a new Version 4 Variant 2 GUID
 // =====================================
 Guid new_guid(void) {
     uint8_t rand_arr[16] = { 0 };
 
-    for (uint8_t i = 0; i < sizeof rand_arr; i++)
-        rand_arr[i] = rand() & 0xFF;    // Equivalent to modulo 256
+    if (reproducible) {
+        // Same seed gives the same sequence of GUIDs
+        const uint64_t rand_lo = next_seeded_random(), rand_hi = next_seeded_random();
+        memcpy(&rand_arr[0], &rand_lo, sizeof rand_lo);
+        memcpy(&rand_arr[8], &rand_hi, sizeof rand_hi);
+    } else {
+        for (uint8_t i = 0; i < sizeof rand_arr; i++)
+            rand_arr[i] = rand() & 0xFF;    // Equivalent to modulo 256
+    }
 
     // Fill out GUID
     Guid result = {
@@ -280,9 +1162,14 @@ Guid new_guid(void) {
 }
 
 // =====================================
-// Create CRC32 table values
+// CRC32 tables for slicing-by-8; crc_table[0] is the byte at a time table, and 
+//   crc_table[k] advances a byte's CRC by k more zero bytes
 // =====================================
-uint32_t crc_table[256];
+uint32_t crc_table[8][256];
+
+// CRC32 function picked for this CPU by init_crc32(); takes and returns the 
+//   CRC register value, without the initial/final bit inversion
+uint32_t (*crc32_impl)(uint32_t c, const uint8_t *buf, uint64_t len) = NULL;
 
 void create_crc32_table(void) {
     uint32_t c = 0;
@@ -295,86 +1182,334 @@ void create_crc32_table(void) {
             else
                 c = c >> 1;
         }
-        crc_table[n] = c;
+        crc_table[0][n] = c;
+    }
+
+    for (int32_t n = 0; n < 256; n++) {
+        for (uint8_t k = 1; k < 8; k++) 
+            crc_table[k][n] = (crc_table[k-1][n] >> 8) ^ crc_table[0][crc_table[k-1][n] & 0xFF];
     }
 }
 
 // =====================================
-// Calculate CRC32 value for range of data
+// CRC32 of a range of data, 1 byte at a time
 // =====================================
-uint32_t calculate_crc32(void *buf, int32_t len) {
-    static bool made_crc_table = false;
+uint32_t crc32_bytewise(uint32_t c, const uint8_t *buf, uint64_t len) {
+    for (uint64_t n = 0; n < len; n++) 
+        c = crc_table[0][(c ^ buf[n]) & 0xFF] ^ (c >> 8);
 
-    uint8_t *bufp = buf;
-    uint32_t c = 0xFFFFFFFFL;
+    return c;
+}
+
+// =====================================
+// CRC32 of a range of data, 8 bytes at a time with slicing-by-8 tables
+// =====================================
+uint32_t crc32_slice8(uint32_t c, const uint8_t *buf, uint64_t len) {
+    // Byte at a time up to 8 byte alignment
+    for (; len > 0 && ((uintptr_t)buf & 7); len--) 
+        c = crc_table[0][(c ^ *buf++) & 0xFF] ^ (c >> 8);
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, buf, sizeof lo);
+        memcpy(&hi, buf + 4, sizeof hi);
+        lo ^= c;
+        c = crc_table[7][lo & 0xFF]         ^ crc_table[6][(lo >> 8) & 0xFF] ^
+            crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24]         ^
+            crc_table[3][hi & 0xFF]         ^ crc_table[2][(hi >> 8) & 0xFF] ^
+            crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+
+    return crc32_bytewise(c, buf, len);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// =====================================
+// CRC32 of a range of data with carry-less multiplies (PCLMULQDQ), folding 64 
+//   bytes at a time, per Intel's "Fast CRC Computation for Generic Polynomials 
+//   Using PCLMULQDQ Instruction"; less than 64 bytes and any tail use slicing-by-8
+// =====================================
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint32_t c, const uint8_t *buf, uint64_t len) {
+    if (len < 64) return crc32_slice8(c, buf, len);
+
+    // Fold constants for the reflected CRC32 polynomial
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    const uint64_t tail = len & 15;
+    len -= tail;
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+    buf += 64;
+    len -= 64;
+
+    // Fold 4 blocks of 16 bytes in parallel
+    for (; len >= 64; len -= 64, buf += 64) {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        const __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        const __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        const __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    }
 
-    if (!made_crc_table) {
-        create_crc32_table();
-        made_crc_table = true;
+    // Fold the 4 blocks into 1, then any blocks of 16 bytes left
+    const __m128i next[3] = { x2, x3, x4 };
+    for (uint8_t i = 0; i < 3; i++) {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, next[i]), x5);
     }
 
-    for (int32_t n = 0; n < len; n++) 
-        c = crc_table[(c ^ bufp[n]) & 0xFF] ^ (c >> 8);
+    for (; len >= 16; len -= 16, buf += 16) {
+        const __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)buf)), x5);
+    }
 
-    // Invert bits for return value
-    return c ^ 0xFFFFFFFFL;
+    // Fold 128 bits to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k5k0, 0x00), x2);
+
+    // Barrett reduce to 32 bits
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return crc32_slice8((uint32_t)_mm_extract_epi32(x1, 1), buf, tail);
 }
+#endif
 
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
 // =====================================
-// Get new date/time values for FAT32 directory entries
-// ===================================== 
-void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date) {
-    time_t curr_time;
-    curr_time = time(NULL);
-    struct tm tm = *localtime(&curr_time);
+// CRC32 of a range of data with ARMv8 CRC32 instructions, 8 bytes at a time
+// =====================================
+#if defined(__clang__)
+__attribute__((target("crc")))
+#else
+__attribute__((target("+crc")))
+#endif
+uint32_t crc32_armv8(uint32_t c, const uint8_t *buf, uint64_t len) {
+    for (; len > 0 && ((uintptr_t)buf & 7); len--) 
+        c = __crc32b(c, *buf++);
+
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t data;
+        memcpy(&data, buf, sizeof data);
+        c = __crc32d(c, data);
+    }
 
-    // FAT32 needs # of years since 1980, localtime returns tm_year as # years since 1900,
-    //   subtract 80 years for correct year value. Also convert month of year from 0-11 to 1-12
-    //   by adding 1
-    *in_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    for (; len > 0; len--) 
+        c = __crc32b(c, *buf++);
 
-    // Seconds is # 2-second count, 0-29
-    if (tm.tm_sec == 60) tm.tm_sec = 59;
-    *in_time = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
+    return c;
 }
+#endif
 
 // =====================================
-// Write protective MBR
-// ===================================== 
-bool write_mbr(FILE *image) {
-    uint64_t mbr_image_lbas = image_size_lbas;
-    if (mbr_image_lbas > 0xFFFFFFFF) mbr_image_lbas = 0x100000000;
+// Set up CRC32 tables, and pick the fastest CRC32 function for this CPU; called
+//   at startup, before any threads
+// =====================================
+void init_crc32(void) {
+    create_crc32_table();
+    crc32_impl = crc32_slice8;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) 
+        crc32_impl = crc32_pclmul;
+#endif
+
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) 
+        crc32_impl = crc32_armv8;
+#endif
+}
 
-    Mbr mbr = {
-        .boot_code = { 0 },
-        .mbr_signature = 0,
-        .unknown = 0,
-        .partition[0] = {
-            .boot_indicator = 0,
-            .starting_chs = { 0x00, 0x02, 0x00 },
-            .os_type = 0xEE,        // Protective GPT
-            .ending_chs = { 0xFF, 0xFF, 0xFF },
-            .starting_lba = 0x00000001,
-            .size_lba = mbr_image_lbas - 1,
-        },
-        .boot_signature = 0xAA55,
-    };
+// =====================================
+// Update a CRC32 value with more data; start with crc = 0, and pass each range 
+//   of data in order
+// =====================================
+uint32_t update_crc32(const uint32_t crc, const void *buf, const uint64_t len) {
+    if (!crc32_impl) init_crc32();
 
-    if (fwrite(&mbr, 1, sizeof mbr, image) != sizeof mbr)
-        return false;
-    write_full_lba_size(image);
+    return crc32_impl(crc ^ 0xFFFFFFFF, buf, len) ^ 0xFFFFFFFF;
+}
 
-    return true;
+// =====================================
+// Calculate CRC32 value for range of data
+// =====================================
+uint32_t calculate_crc32(const void *buf, const uint64_t len) {
+    return update_crc32(0, buf, len);
 }
+
 // =====================================
-// Write GPT headers & tables, primary & secondary
+// Multiply 2 polynomials modulo the CRC32 polynomial, in reflected bit order
 // =====================================
-bool write_gpts(FILE *image) {
-    // Fill out primary GPT header
-    Gpt_Header primary_gpt = {
-        .signature = { 'E','F','I',' ','P','A','R','T' },
-        .revision = 0x00010000,   // Version 1.0
-        .header_size = 92,
+uint32_t crc32_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) product ^= b;
+        b = (b & 1) ? (b >> 1) ^ 0xEDB88320 : b >> 1;
+    }
+    return product;
+}
+
+// =====================================
+// Advance a CRC32 register value over len zero bytes, without reading them; 
+//   multiplies by x^(8 * len) with 1 step per bit of len, as zlib's 
+//   crc32_combine() does
+// =====================================
+uint32_t crc32_zeros(uint32_t c, uint64_t len) {
+    uint32_t x2n = 1u << 23;    // x^8, 1 byte
+
+    for (; len > 0 && c != 0; len >>= 1) {
+        if (len & 1) c = crc32_multiply(x2n, c);
+        x2n = crc32_multiply(x2n, x2n);
+    }
+    return c;
+}
+
+// =====================================
+// Add a range of a copy job's file data to the file's CRC32, as it passes 
+//   through a buffer. Each range is shifted over the # of file bytes after it,
+//   so ranges can be added in any order, and holes add nothing; the CRC32 is
+//   finished by get_copy_job_crc32()
+// =====================================
+void add_copy_job_crc32(Copy_Job *job, const void *buf, const uint64_t pos, const uint64_t len) {
+    if (!job->index_entry || len == 0) return;
+
+    job->crc32 ^= crc32_zeros(crc32_impl(0, buf, len), job->size - pos - len);
+}
+
+// =====================================
+// Get the CRC32 of a copy job's whole file, from all the ranges added to it; 
+//   the initial all 1s register is shifted over the whole file, then inverted
+// =====================================
+uint32_t get_copy_job_crc32(const Copy_Job *job) {
+    return crc32_zeros(0xFFFFFFFF, job->size) ^ job->crc32 ^ 0xFFFFFFFF;
+}
+
+// =====================================
+// Read the first len bytes of a copy job's file for its CRC32, for data that
+//   was cloned into the image without passing through a buffer
+// =====================================
+bool read_copy_job_crc32(Copy_Job *job, FILE *file, const uint64_t len) {
+    uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+    if (!buf) return false;
+
+    uint64_t pos = 0;
+    while (pos < len) {
+        const uint64_t chunk = len - pos < COPY_BUFFER_SIZE ? len - pos : COPY_BUFFER_SIZE;
+        const uint64_t bytes_read = read_at(file, buf, chunk, pos);
+        if (bytes_read == 0) break;
+
+        add_copy_job_crc32(job, buf, pos, bytes_read);
+        pos += bytes_read;
+    }
+
+    free(buf);
+    return pos == len;
+}
+
+// =====================================
+// Calculate CRC-32C (Castagnoli) value for range of data, as used by VHDX; only
+//   small VHDX structures use it, so it is done 1 bit at a time
+// =====================================
+uint32_t calculate_crc32c(const void *buf, const uint64_t len) {
+    const uint8_t *bufp = buf;
+    uint32_t crc = 0xFFFFFFFF;
+    for (uint64_t i = 0; i < len; i++) {
+        crc ^= bufp[i];
+        for (uint8_t bit = 0; bit < 8; bit++) 
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// =====================================
+// Get new date/time values for FAT32 directory entries
+// ===================================== 
+void get_fat_dir_entry_time_date(uint16_t *in_time, uint16_t *in_date) {
+    // SOURCE_DATE_EPOCH is a fixed time in UTC, so the image doesn't depend on the time zone
+    const time_t curr_time = source_date_epoch >= 0 ? (time_t)source_date_epoch : time(NULL);
+    const struct tm *time_tm = source_date_epoch >= 0 ? gmtime(&curr_time) : localtime(&curr_time);
+    struct tm tm = time_tm ? *time_tm : (struct tm){ .tm_year = 80, .tm_mday = 1 };
+
+    // FAT32 dates can't be before 1980 or after 2107
+    if (tm.tm_year < 80) tm = (struct tm){ .tm_year = 80, .tm_mday = 1 };
+    if (tm.tm_year > 207) 
+        tm = (struct tm){ .tm_year = 207, .tm_mon = 11, .tm_mday = 31, 
+                          .tm_hour = 23, .tm_min = 59, .tm_sec = 59 };
+
+    // FAT32 needs # of years since 1980, localtime returns tm_year as # years since 1900,
+    //   subtract 80 years for correct year value. Also convert month of year from 0-11 to 1-12
+    //   by adding 1
+    *in_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+
+    // Seconds is # 2-second count, 0-29
+    if (tm.tm_sec == 60) tm.tm_sec = 59;
+    *in_time = tm.tm_hour << 11 | tm.tm_min << 5 | (tm.tm_sec / 2);
+}
+
+// =====================================
+// Write protective MBR
+// ===================================== 
+bool write_mbr(FILE *image) {
+    uint64_t mbr_image_lbas = image_size_lbas;
+    if (mbr_image_lbas > 0xFFFFFFFF) mbr_image_lbas = 0x100000000;
+
+    Mbr mbr = {
+        .boot_code = { 0 },
+        .mbr_signature = 0,
+        .unknown = 0,
+        .partition[0] = {
+            .boot_indicator = 0,
+            .starting_chs = { 0x00, 0x02, 0x00 },
+            .os_type = 0xEE,        // Protective GPT
+            .ending_chs = { 0xFF, 0xFF, 0xFF },
+            .starting_lba = 0x00000001,
+            .size_lba = mbr_image_lbas - 1,
+        },
+        .boot_signature = 0xAA55,
+    };
+
+    if (!write_at(image, &mbr, sizeof mbr, 0))
+        return false;
+    write_full_lba_size(image);
+
+    return true;
+}
+// =====================================
+// Write GPT headers & tables, primary & secondary
+// =====================================
+bool write_gpts(FILE *image) {
+    // Fill out primary GPT header
+    Gpt_Header primary_gpt = {
+        .signature = { 'E','F','I',' ','P','A','R','T' },
+        .revision = 0x00010000,   // Version 1.0
+        .header_size = 92,
         .header_crc32 = 0,      // Will calculate later
         .reserved_1 = 0,
         .my_lba = 1,            // LBA 1 is right after MBR
@@ -412,17 +1547,30 @@ bool write_gpts(FILE *image) {
         },
     };
 
+    // Partitions after those, in the order given
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        const Partition *partition = &partitions[i];
+        Gpt_Partition_Entry *entry = &gpt_table[2 + i];
+        entry->partition_type_guid = partition->type_guid;
+        entry->unique_guid = new_guid();
+        entry->starting_lba = partition->lba;
+        entry->ending_lba = partition->lba + partition->num_lbas - 1;
+        entry->attributes = partition->attributes;
+        for (uint8_t j = 0; partition->name[j]; j++) 
+            entry->name[j] = partition->name[j];
+    }
+
     // Fill out primary header CRC values
     primary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
     primary_gpt.header_crc32 = calculate_crc32(&primary_gpt, primary_gpt.header_size);
 
     // Write primary gpt header to file
-    if (fwrite(&primary_gpt, 1, sizeof primary_gpt, image) != sizeof primary_gpt)
+    if (!write_at(image, &primary_gpt, sizeof primary_gpt, primary_gpt.my_lba * lba_size))
         return false;
     write_full_lba_size(image);
 
     // Write primary gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table)
+    if (!write_at(image, &gpt_table, sizeof gpt_table, primary_gpt.partition_table_lba * lba_size))
         return false;
 
     // Fill out secondary GPT header
@@ -438,15 +1586,12 @@ bool write_gpts(FILE *image) {
     secondary_gpt.partition_table_crc32 = calculate_crc32(gpt_table, sizeof gpt_table);
     secondary_gpt.header_crc32 = calculate_crc32(&secondary_gpt, secondary_gpt.header_size);
 
-    // Go to position of secondary table
-    fseek(image, secondary_gpt.partition_table_lba * lba_size, SEEK_SET);
-    
     // Write secondary gpt table to file
-    if (fwrite(&gpt_table, 1, sizeof gpt_table, image) != sizeof gpt_table)
+    if (!write_at(image, &gpt_table, sizeof gpt_table, secondary_gpt.partition_table_lba * lba_size))
         return false;
 
     // Write secondary gpt header to file
-    if (fwrite(&secondary_gpt, 1, sizeof secondary_gpt, image) != sizeof secondary_gpt)
+    if (!write_at(image, &secondary_gpt, sizeof secondary_gpt, secondary_gpt.my_lba * lba_size))
         return false;
     write_full_lba_size(image);
 
@@ -454,861 +1599,5565 @@ bool write_gpts(FILE *image) {
 }
 
 // =====================================
-// Write EFI System Partition (ESP) w/FAT32 filesystem
+// Hash an 8.3 short name, FNV-1a
 // =====================================
-bool write_esp(FILE *image) {
-    // Reserved sectors region --------------------------
-    // Fill out Volume Boot Record (VBR)
-    const uint8_t reserved_sectors = 32;    // FAT32
-    Vbr vbr = {
-        .BS_jmpBoot      = { 0xEB, 0x00, 0x90 },
-        .BS_OEMName      = { 'T','H','I','S','D','I','S','K' },
-        .BPB_BytesPerSec = lba_size,         // This is limited to only 512/1024/2048/4096
-        .BPB_SecPerClus  = 1,
-        .BPB_RsvdSecCnt  = reserved_sectors,
-        .BPB_NumFATs     = 2,                // 2 FAT tables
-        .BPB_RootEntCnt  = 0,
-        .BPB_TotSec16    = 0,
-        .BPB_Media       = 0xF8,             // "Fixed" non-removable media; Could also be 0xF0 for e.g. flash drive
-        .BPB_FATSz16     = 0,
-        .BPB_SecPerTrk   = 0,  
-        .BPB_NumHeads    = 0,    
-        .BPB_HiddSec     = esp_lba - 1,      // # of sectors before this partition/volume
-        .BPB_TotSec32    = esp_size_lbas,    // Size of this partition
-        .BPB_FATSz32     = 0,                // Filled out below
-        .BPB_ExtFlags    = 0,                // Mirrored FATs
-        .BPB_FSVer       = 0,
-        .BPB_RootClus    = 2,                // Clusters 0 & 1 are reserved; root dir cluster starts at 2
-        .BPB_FSInfo      = 1,                // Sector 0 = this VBR; FS Info sector follows it
-        .BPB_BkBootSec   = 6,                // 6 seems to be common for backup boot sector #
-        .BPB_Reserved    = { 0 },
-        .BS_DrvNum       = 0x80,             // 1st hard drive
-        .BS_Reserved1    = 0,
-        .BS_BootSig      = 0x29,
-        .BS_VolID        = { 0 }, 
-        .BS_VolLab       = { 'N','O',' ','N','A','M','E',' ',' ',' ',' ' },	// No volume label 
-        .BS_FilSysType   = { 'F','A','T','3','2',' ',' ',' ' },
-
-        // Not in fatgen103.doc tables
-        .boot_code       = { 0 },
-        .bootsect_sig    = 0xAA55,     
-    };
-
-    //.BPB_FATSz32 = From FAT docs: TMP1 = disk_size_sectors - reserved sector count;
-    //                              TMP2 = (256 * sectors per cluster) + number of FATs;
-    //                              For FAT32 => TMP2 = TMP2 / 2;
-    //                              FATSz32 = (TMP1 + (TMP2 - 1)) / TMP2;
-    // This should get the # of sectors (LBAs) required to hold all of the clusters for the ESP size,
-    //   for 1 FAT table.
-    uint32_t temp = ((256 * vbr.BPB_SecPerClus) + vbr.BPB_NumFATs) / 2;
-    vbr.BPB_FATSz32 = ((esp_size_lbas - reserved_sectors) + (temp-1)) / temp;
-
-    // Fill out file system info sector
-    FSInfo fsinfo = {
-        .FSI_LeadSig    = 0x41615252,
-        .FSI_Reserved1  = { 0 },
-        .FSI_StrucSig   = 0x61417272,
-        .FSI_Free_Count = 0xFFFFFFFF,
-        .FSI_Nxt_Free   = 5,            // First available cluster (value = 0) after /EFI/BOOT
-        .FSI_Reserved2  = { 0 },
-        .FSI_TrailSig   = 0xAA550000,
-    };
+uint32_t hash_short_name(const uint8_t *name) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < 11; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    fat32_fats_lba = esp_lba + vbr.BPB_RsvdSecCnt;
-    fat32_data_lba = fat32_fats_lba + (vbr.BPB_NumFATs * vbr.BPB_FATSz32);
+// =====================================
+// Add a directory entry to its directory's name hash table
+// =====================================
+void index_dir_entry(Esp_Dir *dir, const uint32_t index) {
+    const FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data + index;
+    const uint32_t mask = dir->names_size - 1;
 
-    // Write VBR and FSInfo sector
-    fseek(image, esp_lba * lba_size, SEEK_SET);
-    if (fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr) {
-        fprintf(stderr, "Error: Could not write ESP VBR to image\n");
-        return false;
-    }
-    write_full_lba_size(image);
+    uint32_t slot = hash_short_name(dir_entry->DIR_Name) & mask;
+    while (dir->names[slot] != 0) slot = (slot + 1) & mask;
+    dir->names[slot] = index + 1;
+}
 
-    if (fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo) {
-        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
-        return false;
+// =====================================
+// (Re)build a directory's name hash table and first free entry from its entries
+// =====================================
+bool index_esp_dir(Esp_Dir *dir) {
+    dir->num_entries = dir->num_clusters * esp.cluster_size / sizeof(FAT32_Dir_Entry_Short);
+
+    // Keep hash table at most half full
+    uint32_t names_size = 16;
+    while (names_size < dir->num_entries * 2) names_size *= 2;
+    if (names_size != dir->names_size) {
+        uint32_t *names = realloc(dir->names, names_size * sizeof *names);
+        if (!names) {
+            fprintf(stderr, "Error: Could not allocate memory for ESP directory index\n");
+            return false;
+        }
+        dir->names = names;
+        dir->names_size = names_size;
     }
-    write_full_lba_size(image);
+    memset(dir->names, 0, dir->names_size * sizeof *dir->names);
+
+    FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data;
+    dir->first_free = dir->num_entries;
+    for (uint32_t i = 0; i < dir->num_entries; i++) {
+        if (dir_entry[i].DIR_Name[0] == '\0') {
+            // End of directory, all following entries are free
+            memset(&dir_entry[i], 0, (dir->num_entries - i) * sizeof *dir_entry);
+            if (dir->first_free == dir->num_entries) dir->first_free = i;
+            break;
+        }
 
-    // Go to backup boot sector location
-    fseek(image, (esp_lba + vbr.BPB_BkBootSec) * lba_size, SEEK_SET);
+        if (dir_entry[i].DIR_Name[0] == 0xE5) {     // Deleted entry
+            if (dir->first_free == dir->num_entries) dir->first_free = i;
+            continue;
+        }
 
-    // Write VBR and FSInfo at backup location
-    fseek(image, esp_lba * lba_size, SEEK_SET);
-    if (fwrite(&vbr, 1, sizeof vbr, image) != sizeof vbr) {
-        fprintf(stderr, "Error: Could not write VBR to image\n");
-        return false;
-    }
-    write_full_lba_size(image);
+        if (dir_entry[i].DIR_Name[0] == '.' ||      // "." or ".."
+            (dir_entry[i].DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME)
+            continue;
 
-    if (fwrite(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo) {
-        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
-        return false;
+        index_dir_entry(dir, i);
     }
-    write_full_lba_size(image);
-
-    // FAT region --------------------------
-    // Write FATs (NOTE: FATs will be mirrored)
-    for (uint8_t i = 0; i < vbr.BPB_NumFATs; i++) {
-        fseek(image, 
-              (fat32_fats_lba + (i*vbr.BPB_FATSz32)) * lba_size, 
-              SEEK_SET);
 
-        uint32_t cluster = 0;
+    return true;
+}
 
-        // Cluster 0; FAT identifier, lowest 8 bits are the media type/byte
-        cluster = 0xFFFFFF00 | vbr.BPB_Media;
-        fwrite(&cluster, sizeof cluster, 1, image);
+// =====================================
+// Find a directory entry by its 8.3 short name, e.g. "FOO     BAR"
+// =====================================
+FAT32_Dir_Entry_Short *find_dir_entry(const Esp_Dir *dir, const uint8_t *name) {
+    const uint32_t mask = dir->names_size - 1;
 
-        // Cluster 1; End of Chain (EOC) marker
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+    for (uint32_t slot = hash_short_name(name) & mask; dir->names[slot] != 0; slot = (slot + 1) & mask) {
+        FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data + dir->names[slot] - 1;
+        if (!memcmp(dir_entry->DIR_Name, name, 11)) return dir_entry;
+    }
 
-        // Cluster 2; Root dir '/' cluster start, if end of file/dir data then write EOC marker
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+    return NULL;
+}
 
-        // Cluster 3; '/EFI' dir cluster
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+// =====================================
+// Add a directory to the table of directories by cluster #
+// =====================================
+void index_esp_dir_cluster(Esp_Dir *dir) {
+    const uint32_t mask = esp.dir_table_size - 1;
 
-        // Cluster 4; '/EFI/BOOT' dir cluster
-        cluster = 0xFFFFFFFF;
-        fwrite(&cluster, sizeof cluster, 1, image);
+    uint32_t slot = (dir->cluster * 2654435761u) & mask;
+    while (esp.dir_table[slot]) slot = (slot + 1) & mask;
+    esp.dir_table[slot] = dir;
+}
 
-        // Cluster 5+; Other files/directories...
-        // e.g. if adding a file with a size = 5 sectors/clusters
-        //cluster = 6;    // Point to next cluster containing file data
-        //cluster = 7;    // Point to next cluster containing file data
-        //cluster = 8;    // Point to next cluster containing file data
-        //cluster = 9;    // Point to next cluster containing file data
-        //cluster = 0xFFFFFFFF; // EOC marker, no more file data after this cluster
+// =====================================
+// (Re)build the table of directories by cluster #, growing it if needed
+// =====================================
+bool index_esp_dirs(void) {
+    uint32_t table_size = esp.dir_table_size ? esp.dir_table_size : 64;
+    while (table_size < esp.num_dirs * 2) table_size *= 2;
+
+    if (table_size != esp.dir_table_size) {
+        Esp_Dir **table = realloc(esp.dir_table, table_size * sizeof *table);
+        if (!table) return false;
+        esp.dir_table = table;
+        esp.dir_table_size = table_size;
     }
+    memset(esp.dir_table, 0, esp.dir_table_size * sizeof *esp.dir_table);
 
-    // Data region --------------------------
-    // Write File/Dir data...
-    fseek(image, fat32_data_lba * lba_size, SEEK_SET);
-
-    // Root '/' Directory entries
-    // "/EFI" dir entry 
-    FAT32_Dir_Entry_Short dir_ent = {
-        .DIR_Name = { 'E','F','I',' ',' ',' ',' ',' ',' ',' ',' ' },
-        .DIR_Attr = ATTR_DIRECTORY,
-        .DIR_NTRes = 0,
-        .DIR_CrtTimeTenth = 0,
-        .DIR_CrtTime = 0,
-        .DIR_CrtDate = 0,
-        .DIR_LstAccDate = 0,
-        .DIR_FstClusHI = 0,
-        .DIR_WrtTime = 0,
-        .DIR_WrtDate = 0,
-        .DIR_FstClusLO = 3,
-        .DIR_FileSize = 0,  // Directories have 0 file size
-    };
+    for (uint32_t i = 0; i < esp.num_dirs; i++) 
+        index_esp_dir_cluster(esp.dirs[i]);
 
-    uint16_t create_time = 0, create_date = 0;
-    get_fat_dir_entry_time_date(&create_time, &create_date);
+    return true;
+}
 
-    dir_ent.DIR_CrtTime = create_time;
-    dir_ent.DIR_CrtDate = create_date;
-    dir_ent.DIR_WrtTime = create_time;
-    dir_ent.DIR_WrtDate = create_date;
+// =====================================
+// Add a new in-memory ESP directory with empty entries
+// =====================================
+Esp_Dir *new_esp_dir(const uint32_t cluster, const uint32_t num_clusters) {
+    Esp_Dir **dirs = realloc(esp.dirs, (esp.num_dirs + 1) * sizeof *esp.dirs);
+    if (!dirs) return NULL;
+    esp.dirs = dirs;
+
+    Esp_Dir *dir = calloc(1, sizeof *dir);
+    if (!dir) return NULL;
+
+    dir->cluster = cluster;
+    dir->num_clusters = num_clusters;
+    dir->dirty = true;
+    dir->data = calloc(num_clusters, esp.cluster_size);
+    if (!dir->data || !index_esp_dir(dir)) {
+        free(dir->data);
+        free(dir);
+        return NULL;
+    }
 
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+    esp.dirs[esp.num_dirs++] = dir;
 
-    // /EFI Directory entries
-    fseek(image, (fat32_data_lba + 1) * lba_size, SEEK_SET);
+    // Grow table of directories when over half full
+    if (esp.num_dirs * 2 > esp.dir_table_size) {
+        if (!index_esp_dirs()) return NULL;
+    } else {
+        index_esp_dir_cluster(dir);
+    }
 
-    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+    return dir;
+}
 
-    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (ROOT dir)
-    dir_ent.DIR_FstClusLO = 0;                      // Root directory does not have a cluster value
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+// =====================================
+// Find in-memory ESP directory by its cluster #
+// =====================================
+Esp_Dir *find_esp_dir(const uint32_t cluster) {
+    if (esp.dir_table_size == 0) return NULL;
 
-    memcpy(dir_ent.DIR_Name, "BOOT       ", 11);    // /EFI/BOOT directory
-    dir_ent.DIR_FstClusLO = 4;                      // /EFI/BOOT cluster
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+    const uint32_t mask = esp.dir_table_size - 1;
+    for (uint32_t slot = (cluster * 2654435761u) & mask; esp.dir_table[slot]; slot = (slot + 1) & mask)
+        if (esp.dir_table[slot]->cluster == cluster) return esp.dir_table[slot];
 
-    // /EFI/BOOT Directory entries
-    fseek(image, (fat32_data_lba + 2) * lba_size, SEEK_SET);
+    return NULL;
+}
 
-    memcpy(dir_ent.DIR_Name, ".          ", 11);    // "." dir entry, this directory itself
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+// =====================================
+// Remove in-memory ESP directory by its cluster #
+// =====================================
+void free_esp_dir(const uint32_t cluster) {
+    for (uint32_t i = 0; i < esp.num_dirs; i++) {
+        if (esp.dirs[i]->cluster != cluster) continue;
+
+        free(esp.dirs[i]->data);
+        free(esp.dirs[i]->names);
+        free(esp.dirs[i]);
+        esp.dirs[i] = esp.dirs[--esp.num_dirs];
+        index_esp_dirs();
+        return;
+    }
+}
 
-    memcpy(dir_ent.DIR_Name, "..         ", 11);    // ".." dir entry, parent dir (/EFI dir)
-    dir_ent.DIR_FstClusLO = 3;                      // /EFI directory cluster
-    fwrite(&dir_ent, sizeof dir_ent, 1, image);
+// =====================================
+// Set up in-memory ESP metadata from VBR & FSInfo sector values
+// =====================================
+bool init_esp_staging(const Vbr *vbr, const FSInfo *fsinfo) {
+    fat32_fats_lba = esp_lba + vbr->BPB_RsvdSecCnt;
+    fat32_data_lba = fat32_fats_lba + (vbr->BPB_NumFATs * vbr->BPB_FATSz32);
+
+    esp.vbr = *vbr;
+    esp.fsinfo = *fsinfo;
+    esp.cluster_size = lba_size * vbr->BPB_SecPerClus;
+    esp.fat_entries = (vbr->BPB_FATSz32 * lba_size) / sizeof *esp.fat;
+    esp.max_cluster = 1 + ((esp_size_lbas - (fat32_data_lba - esp_lba)) / vbr->BPB_SecPerClus);
+    if (esp.max_cluster >= esp.fat_entries) esp.max_cluster = esp.fat_entries - 1;
+    esp.dirty_lo = UINT32_MAX;
+    esp.dirty_hi = 0;
+    esp.fat = calloc(esp.fat_entries, sizeof *esp.fat);
+    if (!esp.fat) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP FAT\n");
+        return false;
+    }
 
     return true;
 }
 
-// =============================
-// Add a new directory or file to a given parent directory
-// =============================
-bool add_file_to_esp(char *file_name, FILE *file, FILE *image, File_Type type, uint32_t *parent_dir_cluster) {
-    // First grab FAT32 filesystem info for VBR and File System info
-    Vbr vbr = { 0 };
-    fseek(image, esp_lba * lba_size, SEEK_SET);
-    if (fread(&vbr, 1, sizeof vbr, image) != sizeof vbr) {
-        fprintf(stderr, "Error: Could not fead vbr.\n");
-        return false;
+// =====================================
+// Set a FAT entry, keeping the free cluster bitmap and count in sync
+// =====================================
+void set_fat_entry(const uint32_t cluster, const uint32_t value) {
+    const bool was_free = (esp.fat[cluster] & 0x0FFFFFFF) == 0;
+    const bool is_free  = (value & 0x0FFFFFFF) == 0;
+    const uint64_t bit  = UINT64_C(1) << (cluster % 64);
+
+    esp.fat[cluster] = value;
+
+    if (was_free && !is_free) {
+        esp.free_map[cluster / 64] &= ~bit;
+        esp.free_count--;
+    } else if (!was_free && is_free) {
+        esp.free_map[cluster / 64] |= bit;
+        esp.free_count++;
     }
 
-    FSInfo fsinfo = { 0 };
-    fseek(image, (esp_lba + 1) * lba_size, SEEK_SET);
-    if (fread(&fsinfo, 1, sizeof fsinfo, image) != sizeof fsinfo) {
-        fprintf(stderr, "Error: Could not fead fsinfo.\n");
+    if (cluster < esp.dirty_lo) esp.dirty_lo = cluster;
+    if (cluster > esp.dirty_hi) esp.dirty_hi = cluster;
+}
+
+// =====================================
+// Build free cluster bitmap from the FAT
+// =====================================
+bool build_free_map(void) {
+    free(esp.free_map);
+    esp.free_map = calloc((esp.max_cluster / 64) + 1, sizeof *esp.free_map);
+    if (!esp.free_map) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP free cluster bitmap\n");
         return false;
     }
 
-    // Get file size of file
-    uint64_t file_size_bytes = 0, file_size_lbas = 0;
-    if (type == TYPE_FILE) {
-        fseek(file, 0, SEEK_END);
-        file_size_bytes = ftell(file);
-        file_size_lbas = bytes_to_lbas(file_size_bytes);
-        rewind(file);
+    esp.free_count = 0;
+    for (uint32_t cluster = 2; cluster <= esp.max_cluster; cluster++) {
+        if ((esp.fat[cluster] & 0x0FFFFFFF) == 0) {
+            esp.free_map[cluster / 64] |= UINT64_C(1) << (cluster % 64);
+            esp.free_count++;
+        }
     }
+    esp.next_free = 2;
 
-    // Get next free cluster in FATs
-    uint32_t next_free_cluster = fsinfo.FSI_Nxt_Free;
-    const uint32_t starting_cluster = next_free_cluster;  // Starting cluster for new dir/file
+    return true;
+}
 
-    // Add new clusters to FATs
-    for (uint8_t i = 0; i < vbr.BPB_NumFATs; i++) {
-        uint32_t cluster = fsinfo.FSI_Nxt_Free;
-        next_free_cluster = cluster;
+// =====================================
+// Find next free (or used) cluster at or after a given cluster, skipping 
+//   over 64 clusters at a time; returns max_cluster + 1 if none found
+// =====================================
+uint32_t find_next_cluster(uint32_t cluster, const bool find_free) {
+    while (cluster <= esp.max_cluster) {
+        uint64_t word = esp.free_map[cluster / 64];
+        if (!find_free) word = ~word;
+        word &= ~UINT64_C(0) << (cluster % 64);     // Ignore clusters before this one
+
+        if (word) {
+            // Lowest set bit is the next cluster
+            uint32_t bit = 0;
+            while (!(word & (UINT64_C(1) << bit))) bit++;
+            cluster = cluster - (cluster % 64) + bit;
+            break;
+        }
+        cluster = cluster - (cluster % 64) + 64;
+    }
 
-        // Go to cluster location in FATs region
-        fseek(image, (fat32_fats_lba + (i * vbr.BPB_FATSz32)) * lba_size, SEEK_SET);
-        fseek(image, next_free_cluster * sizeof next_free_cluster, SEEK_CUR);
+    return cluster <= esp.max_cluster ? cluster : esp.max_cluster + 1;
+}
 
-        if (type == TYPE_FILE && file_size_bytes != 0) {
-            // Final cluster holds the end of chain (EOC) marker for final lba, can write until
-            //   size -1 lbas first.
-            for (uint64_t lba = 0; lba < file_size_lbas - 1; lba++) {
-                cluster++;  // Each cluster points to next cluster of file data
-                next_free_cluster++;
-                fwrite(&cluster, sizeof cluster, 1, image);
-            }
+// =====================================
+// Allocate a chain of new clusters in the FAT; returns starting cluster, or 0
+//   if there is not enough free space. Uses the smallest run of free clusters
+//   that fits the whole chain, or if none, fills free runs in order
+// =====================================
+uint32_t allocate_clusters(const uint64_t count) {
+    if (count == 0 || count > esp.free_count) return 0;
+
+    // Best fit; find smallest free run that will hold all clusters
+    uint32_t best_cluster = 0;
+    uint64_t best_size = UINT64_MAX;
+    uint32_t cluster = find_next_cluster(2, true);
+    while (cluster <= esp.max_cluster) {
+        const uint32_t run_end = find_next_cluster(cluster, false);
+        const uint64_t run_size = run_end - cluster;
+        if (run_size >= count && run_size < best_size) {
+            best_cluster = cluster;
+            best_size = run_size;
+            if (run_size == count) break;   // Can't do better than exact fit
         }
-
-        // Write EOC marker cluster for final file lba; this would be the only cluster added 
-        //   for a directory (type == TYPE_DIR)
-        cluster = 0xFFFFFFFF;
-        next_free_cluster++;
-        fwrite(&cluster, sizeof cluster, 1, image);
+        cluster = find_next_cluster(run_end, true);
     }
 
-    // Update next free cluster in FS Info
-    fsinfo.FSI_Nxt_Free = next_free_cluster;
-    fseek(image, (esp_lba + 1) * lba_size, SEEK_SET);
-    fwrite(&fsinfo, sizeof fsinfo, 1, image); 
+    // Add new clusters to FAT; each cluster points to next cluster of file data, and
+    //   final cluster holds the end of chain (EOC) marker. The EOC would be the only 
+    //   cluster added for a directory
+    uint32_t starting_cluster = 0, prev_cluster = 0;
+    cluster = best_cluster ? best_cluster : find_next_cluster(2, true);
+    for (uint64_t i = 0; i < count; i++) {
+        if (i > 0) cluster = find_next_cluster(cluster + 1, true);
+        if (prev_cluster) set_fat_entry(prev_cluster, cluster);
+        else              starting_cluster = cluster;
+        prev_cluster = cluster;
+    }
+    set_fat_entry(prev_cluster, 0xFFFFFFFF);
 
-    // Go to Parent Directory's data location in data region
-    fseek(image, (fat32_data_lba + *parent_dir_cluster - 2) * lba_size, SEEK_SET);
+    // Next free cluster is likely after this chain
+    esp.next_free = prev_cluster + 1;
 
-    // Add new directory entry for this new dir/file at end of current dir_entrys 
-    FAT32_Dir_Entry_Short dir_entry = { 0 };
+    return starting_cluster;
+}
 
-    while (fread(&dir_entry, 1, sizeof dir_entry, image) == sizeof dir_entry &&
-           dir_entry.DIR_Name[0] != '\0')
-        ;
+// =====================================
+// Free a chain of clusters in the FAT
+// =====================================
+void free_cluster_chain(uint32_t cluster) {
+    // Limit # of clusters freed, in case of a looping chain
+    for (uint32_t i = 0; i < esp.max_cluster && cluster >= 2 && cluster <= esp.max_cluster; i++) {
+        const uint32_t next_cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        if (next_cluster == 0) break;   // Already free
 
-    // sizeof dir_entry = 32, back up to overwrite this empty spot
-    fseek(image, -32, SEEK_CUR);    
+        set_fat_entry(cluster, 0);
+        if (cluster < esp.next_free) esp.next_free = cluster;
 
-    // Set 8.3 file name
-    memcpy(dir_entry.DIR_Name, file_name, 11);
+        cluster = next_cluster;
+    }
+}
 
-    if (type == TYPE_DIR) dir_entry.DIR_Attr = ATTR_DIRECTORY;
+// =====================================
+// Copy file data to its cluster chain in the ESP, one run of contiguous 
+//   clusters at a time
+// =====================================
+bool copy_file_to_clusters(FILE *file, const uint64_t file_size, FILE *image, uint32_t cluster) {
+    uint64_t pos = 0;
+    while (pos < file_size) {
+        if (cluster < 2 || cluster > esp.max_cluster) return false;
+
+        const uint32_t run_start = cluster;
+        uint64_t run_size = esp.cluster_size;
+        cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        while (cluster == run_start + (run_size / esp.cluster_size) && pos + run_size < file_size) {
+            run_size += esp.cluster_size;
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        }
+        if (run_size > file_size - pos) run_size = file_size - pos;
 
-    uint16_t fat_time, fat_date;
-    get_fat_dir_entry_time_date(&fat_time, &fat_date);
-    dir_entry.DIR_CrtTime = fat_time;
-    dir_entry.DIR_CrtDate = fat_date;
-    dir_entry.DIR_WrtTime = fat_time;
-    dir_entry.DIR_WrtDate = fat_date;
+        // Image offset where file byte 0 would be, for this run (unsigned wraparound
+        //   is fine, only offset + pos is used)
+        const uint64_t offset = (cluster_to_lba(run_start) * lba_size) - pos;
+        if (!copy_file_to_image(file, pos, pos + run_size, image, offset, NULL)) return false;
 
-    dir_entry.DIR_FstClusHI = (starting_cluster >> 16) & 0xFFFF;
-    dir_entry.DIR_FstClusLO = starting_cluster & 0xFFFF;
+        pos += run_size;
+    }
 
-    if (type == TYPE_FILE)
-        dir_entry.DIR_FileSize = file_size_bytes;
+    return true;
+}
 
-    fwrite(&dir_entry, 1, sizeof dir_entry, image);
+// =====================================
+// Queue a file data copy, to be done after all files are laid out; the file's
+//   clusters or data partition range must already be set aside for it
+// =====================================
+bool queue_copy_job(const char *file_path, const uint64_t size, const uint32_t cluster, 
+                    const uint64_t offset) {
+    Copy_Job *jobs = grow_array(copy_jobs, num_copy_jobs, sizeof *jobs);
+    if (!jobs) return false;
+    copy_jobs = jobs;
+
+    copy_jobs[num_copy_jobs++] = (Copy_Job){
+        .file_path = file_path,
+        .size = size,
+        .cluster = cluster,
+        .offset = cluster ? cluster_to_lba(cluster) * lba_size : offset,
+        .index_entry = 0,
+        .crc32 = 0,
+        .result = false,
+    };
+    return true;
+}
+
+// =====================================
+// Add a queued copy job's file data to the ranges of a streamed image; 1 range per
+//   run of contiguous clusters for an ESP file
+// =====================================
+bool add_copy_job_stream_extents(const Copy_Job *job) {
+    if (!job->cluster) 
+        return add_stream_extent(job->offset, job->size, NULL, job->file_path, 0);
+
+    uint32_t cluster = job->cluster;
+    uint64_t pos = 0;
+    while (pos < job->size) {
+        if (cluster < 2 || cluster > esp.max_cluster) return false;
+
+        const uint32_t run_start = cluster;
+        uint64_t run_size = esp.cluster_size;
+        cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        while (cluster == run_start + (run_size / esp.cluster_size) && pos + run_size < job->size) {
+            run_size += esp.cluster_size;
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        }
+        if (run_size > job->size - pos) run_size = job->size - pos;
 
-    // Go to this new file's cluster's data location in data region
-    fseek(image, (fat32_data_lba + starting_cluster - 2) * lba_size, SEEK_SET);
+        if (!add_stream_extent(cluster_to_lba(run_start) * lba_size, run_size, NULL, 
+                               job->file_path, pos)) 
+            return false;
+        pos += run_size;
+    }
 
-    // Add new file data
-    // For directory add dir_entrys for "." and ".."
-    if (type == TYPE_DIR) {
-        memcpy(dir_entry.DIR_Name, ".          ", 11);  // "." dir_entry; this directory itself
-        fwrite(&dir_entry, 1, sizeof dir_entry, image);
+    return true;
+}
+
+// =====================================
+// Do a queued copy job; copies an ESP file to its cluster chain, or clones/copies 
+//   a data partition file to its range of the data partition
+// =====================================
+void do_copy_job(Copy_Job *job, FILE *image) {
+    if (streaming) {
+        // File data is read when the image is written out
+        job->result = add_copy_job_stream_extents(job);
+        return;
+    }
+
+    FILE *file = fopen(job->file_path, "rb");
+    if (!file) return;
 
-        memcpy(dir_entry.DIR_Name, "..         ", 11);  // ".." dir_entry; parent directory
-        dir_entry.DIR_FstClusHI = (*parent_dir_cluster >> 16) & 0xFFFF;
-        dir_entry.DIR_FstClusLO = *parent_dir_cluster & 0xFFFF;
-        fwrite(&dir_entry, 1, sizeof dir_entry, image);
+    if (job->cluster) {
+        job->result = copy_file_to_clusters(file, job->size, image, job->cluster);
     } else {
-        // For file, add file data
-        uint8_t *file_buf = calloc(1, lba_size);
-        for (uint64_t i = 0; i < file_size_lbas; i++) {
-            // In case last lba is less than a full lba in size, use actual bytes read
-            //   to write file to disk image
-            size_t bytes_read = fread(file_buf, 1, lba_size, file);
-            fwrite(file_buf, 1, bytes_read, image);
+        // Clone as much of the file as possible, and copy the rest
+        uint64_t cloned_bytes = 0;
+        if (reflink) {
+            cloned_bytes = clone_file_to_image(file, job->size, image, job->offset);
+            if (cloned_bytes == 0 && job->size >= host_block_size)
+                fprintf(stderr, "WARNING: Could not clone file '%s', copying it instead\n", 
+                        job->file_path);
         }
-        free(file_buf);
+
+        // Cloned data isn't read, so it is read for the CRC32 if needed
+        job->result = (!job->index_entry || read_copy_job_crc32(job, file, cloned_bytes)) &&
+                      copy_file_to_image(file, cloned_bytes, job->size, image, job->offset, job);
     }
+    fclose(file);
+}
 
-    // Set dir_cluster for new parent dir, if a directory was just added
-    if (type == TYPE_DIR)
-        *parent_dir_cluster = starting_cluster;
+#if !defined(_WIN32)
+// Shared state for copy worker threads
+typedef struct {
+    const char *image_name;
+    atomic_uint next_job;
+} Copy_Pool;
+
+// =====================================
+// Copy worker thread; takes the next queued job until none are left. Each worker 
+//   has its own stream for the image, and writes at explicit offsets
+// =====================================
+void *copy_worker(void *arg) {
+    Copy_Pool *pool = arg;
+
+    FILE *image = fopen(pool->image_name, "rb+");
+    if (!image) return NULL;
+
+    for (uint32_t i = atomic_fetch_add(&pool->next_job, 1); i < num_copy_jobs; 
+         i = atomic_fetch_add(&pool->next_job, 1))
+        do_copy_job(&copy_jobs[i], image);
+
+    free(copy_buf);
+    copy_buf = NULL;
+    fclose(image);
+    return NULL;
+}
+#endif
+
+// =====================================
+// Compare 2 copy jobs for sorting by largest size first
+// =====================================
+int compare_copy_jobs(const void *a, const void *b) {
+    const uint64_t size_a = ((const Copy_Job *)a)->size, size_b = ((const Copy_Job *)b)->size;
+    return (size_a < size_b) - (size_a > size_b);
+}
+
+// =====================================
+// Compare 2 copy jobs for sorting by image offset
+// =====================================
+int compare_copy_job_offsets(const void *a, const void *b) {
+    const uint64_t offset_a = ((const Copy_Job *)a)->offset, offset_b = ((const Copy_Job *)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+#if defined(__linux__) && defined(SYS_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+// io_uring submission & completion queues, shared with the kernel
+typedef struct {
+    int fd;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    uint32_t to_submit;     // Queued entries not yet submitted to the kernel
+} Uring;
+
+// Chunk of a copy job in flight; read from the file into its buffer, then written 
+//   to the image
+typedef struct {
+    uint8_t *buf;
+    uint32_t job;           // Index of the copy job
+    uint64_t file_offset;
+    uint64_t image_offset;
+    uint64_t size;
+    uint64_t done;          // Bytes read, or written, so far
+    bool writing;
+    bool busy;
+} Uring_Slot;
+
+// Open file of a copy job, and # of its chunks in flight
+typedef struct {
+    int fd;
+    uint32_t in_flight;
+} Uring_Job;
+
+// Next chunk of file data to read, in copy job order
+typedef struct {
+    uint32_t job;
+    uint64_t pos;           // Offset in the job's file
+    uint32_t cluster;       // ESP cluster at that offset
+    bool started;           // Job's file has been opened
+} Uring_Cursor;
 
+// =====================================
+// Unmap and close an io_uring
+// =====================================
+void free_uring(Uring *ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+// =====================================
+// Set up an io_uring with at least this many entries, and map its queues. 
+//   Needs Linux 5.6+ for plain reads & writes; fails if io_uring isn't 
+//   available, e.g. disabled by sysctl or a seccomp filter
+// =====================================
+bool init_uring(Uring *ring, const uint32_t entries) {
+    struct io_uring_params params = { 0 };
+    *ring = (Uring){ .fd = syscall(SYS_io_uring_setup, entries, &params) };
+    if (ring->fd < 0) return false;
+
+    ring->sq_ring_size = params.sq_off.array + (params.sq_entries * sizeof(uint32_t));
+    ring->cq_ring_size = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+    if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+
+    if (!ring->sq_ring || !ring->cq_ring || !ring->sqes || 
+        !(params.features & IORING_FEAT_RW_CUR_POS) || params.sq_entries < entries) {
+        free_uring(ring);
+        return false;
+    }
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head  = (uint32_t *)(sq + params.sq_off.head);
+    ring->sq_tail  = (uint32_t *)(sq + params.sq_off.tail);
+    ring->sq_mask  = (uint32_t *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    ring->cq_head  = (uint32_t *)(cq + params.cq_off.head);
+    ring->cq_tail  = (uint32_t *)(cq + params.cq_off.tail);
+    ring->cq_mask  = (uint32_t *)(cq + params.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
     return true;
 }
 
-// =============================
-// Add a file path to the EFI System Partition;
-//   will add new directories if not found, and
-//   new file at end of path
-// =============================
-bool add_path_to_esp(char *path, FILE *file, FILE *image) {
-    // Parse input path for each name
-    if (*path != '/') return false; // Path must begin with root '/'
+// =====================================
+// Queue a read or write of a slot's buffer; the rest of it, after a short read
+//   or write. Registered buffers are used by index when available
+// =====================================
+void queue_uring_slot(Uring *ring, const Uring_Slot *slot, const uint32_t index, const int fd,
+                      const bool fixed) {
+    const uint32_t tail = *ring->sq_tail;
+    const uint32_t sqe_index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[sqe_index];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = slot->writing ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) : 
+                                  (fixed ? IORING_OP_READ_FIXED  : IORING_OP_READ);
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)(slot->buf + slot->done);
+    sqe->len = slot->size - slot->done;
+    sqe->off = (slot->writing ? slot->image_offset : slot->file_offset) + slot->done;
+    sqe->buf_index = fixed ? index : 0;
+    sqe->user_data = index;
+
+    ring->sq_array[sqe_index] = sqe_index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
 
-    // Uppercase path for that smooth DOS feel, but probably doesn't matter for any modern UEFI
-    //   or FAT implementations
-    for (size_t i = 0; i < strlen(path); i++) 
-        path[i] = toupper(path[i]);
+// =====================================
+// Get the next chunk of file data to copy, in copy job order, opening each job's
+//   file as it is reached. ESP file chunks end at the end of a run of contiguous
+//   clusters. Returns false when there are no chunks left
+// =====================================
+bool next_uring_chunk(Uring_Cursor *cursor, Uring_Job *jobs, Uring_Slot *slot, FILE *image) {
+    while (cursor->job < num_copy_jobs) {
+        Copy_Job *job = &copy_jobs[cursor->job];
+        if (!cursor->started) {
+            cursor->started = true;
+            cursor->pos = 0;
+            cursor->cluster = job->cluster;
+            jobs[cursor->job].fd = open(job->file_path, O_RDONLY);
+            job->result = jobs[cursor->job].fd >= 0;
+
+            // Data partition files are contiguous in the image, so they can be shared
+            //   or offloaded kernel-side first, as without io_uring; only what is 
+            //   left goes through the queue. Files needing a CRC32 all go through it
+            if (job->result && !job->cluster && !job->index_entry) {
+                preallocate_range(image, job->offset, job->size);
+                cursor->pos = share_range_in_kernel(jobs[cursor->job].fd, 0, fileno(image), 
+                                                    job->offset, job->size);
+            }
+        }
 
-    File_Type type = TYPE_DIR;
-    char *start = path + 1; // Skip initial slash
-    char *end = start;
-    uint32_t dir_cluster = 2;   // Next directory's cluster location; start at root
-    bool any_files_added = false;
+        if (job->cluster && cursor->pos < job->size && 
+            (cursor->cluster < 2 || cursor->cluster > esp.max_cluster))
+            job->result = false;
+
+        if (job->result && cursor->pos < job->size) {
+            uint64_t len = job->size - cursor->pos < URING_BUFFER_SIZE ? 
+                           job->size - cursor->pos : URING_BUFFER_SIZE;
+            uint64_t image_offset = job->offset + cursor->pos;
+
+            if (job->cluster) {
+                image_offset = cluster_to_lba(cursor->cluster) * lba_size;
+                uint64_t run_size = esp.cluster_size;
+                uint32_t next = esp.fat[cursor->cluster] & 0x0FFFFFFF;
+                while (run_size < len && next == cursor->cluster + (run_size / esp.cluster_size)) {
+                    run_size += esp.cluster_size;
+                    next = esp.fat[next] & 0x0FFFFFFF;
+                }
+                if (len > run_size) len = run_size;
+                cursor->cluster = next;
+            }
 
-    // Get next name from path, until reached end of path for file to add
-    while (type == TYPE_DIR) {
-        while (*end != '/' && *end != '\0') end++;
+            *slot = (Uring_Slot){
+                .buf = slot->buf,
+                .job = cursor->job,
+                .file_offset = cursor->pos,
+                .image_offset = image_offset,
+                .size = len,
+                .busy = true,
+            };
+            cursor->pos += len;
+            return true;
+        }
 
-        if (*end == '/') type = TYPE_DIR;
-        else             type = TYPE_FILE;  // Reached end of path
+        // Job is done or failed; its file is closed once its last chunk is written
+        if (jobs[cursor->job].in_flight == 0 && jobs[cursor->job].fd >= 0) {
+            close(jobs[cursor->job].fd);
+            jobs[cursor->job].fd = -1;
+        }
+        cursor->job++;
+        cursor->started = false;
+    }
 
-        *end = '\0';    // Null terminate next name in case of directory
+    return false;
+}
+#endif
 
+// =====================================
+// Do all queued copy jobs with io_uring in 1 thread, keeping a deep queue of 
+//   reads from the files and writes to the image in flight, so the next files 
+//   are read while earlier ones are written. Returns false without copying
+//   anything if io_uring can't be used here, to copy synchronously instead
+// =====================================
+bool run_copy_jobs_uring(FILE *image) {
+#if defined(__linux__) && defined(SYS_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+    Uring ring;
+    if (!init_uring(&ring, URING_QUEUE_DEPTH)) return false;
+
+    uint8_t *buffers = NULL;
+    Uring_Job *jobs = malloc(num_copy_jobs * sizeof *jobs);
+    if (posix_memalign((void **)&buffers, 4096, (size_t)URING_QUEUE_DEPTH * URING_BUFFER_SIZE) != 0)
+        buffers = NULL;
+    if (!jobs || !buffers) {
+        free(jobs);
+        free(buffers);
+        free_uring(&ring);
+        return false;
+    }
 
-        char *dot_pos = strchr(start, '.');
-        if ((type == TYPE_DIR  && strlen(start) > 11) ||
-            (type == TYPE_FILE && strlen(start) > 12) || 
-            (dot_pos && ((dot_pos - start > 8) ||           // Name 8 too long
-                         (end - dot_pos) > 4))) {           // Ext 3 too long
-            // Name is too long or invalid 8.3 naming
-            fprintf(stderr, "WARNING: Name '%s' is too long for 8.3 naming. Truncating to fit.\n",
-                    start);
+    // Register buffers once, so they aren't mapped for every read & write; 
+    //   this can fail e.g. over the locked memory limit of older kernels
+    Uring_Slot slots[URING_QUEUE_DEPTH] = { 0 };
+    struct iovec iovecs[URING_QUEUE_DEPTH];
+    for (uint32_t i = 0; i < URING_QUEUE_DEPTH; i++) {
+        slots[i].buf = buffers + ((size_t)i * URING_BUFFER_SIZE);
+        iovecs[i] = (struct iovec){ .iov_base = slots[i].buf, .iov_len = URING_BUFFER_SIZE };
+    }
+    const bool fixed = syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, 
+                               iovecs, URING_QUEUE_DEPTH) == 0;
+
+    for (uint32_t i = 0; i < num_copy_jobs; i++) 
+        jobs[i] = (Uring_Job){ .fd = -1 };
+
+    // Writes go to the image file descriptor directly
+    fflush(image);
+    const int image_fd = fileno(image);
+
+    Uring_Cursor cursor = { 0 };
+    uint32_t in_flight = 0;
+    while (true) {
+        // Start reading the next chunks into all idle slots
+        for (uint32_t i = 0; i < URING_QUEUE_DEPTH; i++) {
+            if (slots[i].busy) continue;
+            if (!next_uring_chunk(&cursor, jobs, &slots[i], image)) break;
+
+            jobs[slots[i].job].in_flight++;
+            in_flight++;
+            preallocate_range(image, slots[i].image_offset, slots[i].size);
+            queue_uring_slot(&ring, &slots[i], i, jobs[slots[i].job].fd, fixed);
+        }
+        if (in_flight == 0) break;
+
+        // Submit everything queued, and wait for at least 1 read or write to finish
+        const int submitted = syscall(SYS_io_uring_enter, ring.fd, ring.to_submit, 1, 
+                                      IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: io_uring failed while copying file data\n");
+            break;
+        }
+        ring.to_submit -= submitted;
+
+        // A finished read is written to the image; short reads & writes are 
+        //   continued where they stopped
+        uint32_t head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            const uint32_t index = cqe->user_data;
+            const int res = cqe->res;
+            Uring_Slot *slot = &slots[index];
+            head++;
+
+            if (res > 0) slot->done += res;
+            if (res == -EINTR || res == -EAGAIN || (res > 0 && slot->done < slot->size)) {
+                queue_uring_slot(&ring, slot, index, 
+                                 slot->writing ? image_fd : jobs[slot->job].fd, fixed);
+                continue;
+            }
 
-            if (dot_pos) dot_pos[4] = '\0';  // Truncate file name
-            else {
-                // Directory
-                size_t diff = strlen(start) - 11;   // Get name overlength amount
+            if (res > 0 && !slot->writing) {
+                add_copy_job_crc32(&copy_jobs[slot->job], slot->buf, slot->file_offset, slot->size);
+                slot->writing = true;
+                slot->done = 0;
+                queue_uring_slot(&ring, slot, index, image_fd, fixed);
+                continue;
+            }
 
-                *end = '/';                 // End new name
-                char *next_start = end+1;   // Start of next name in path
+            // Chunk is written, or failed; e.g. a read of 0 bytes if the file shrank
+            if (res <= 0) copy_jobs[slot->job].result = false;
+            slot->busy = false;
+            in_flight--;
+            Uring_Job *job = &jobs[slot->job];
+            if (--job->in_flight == 0 && slot->job < cursor.job && job->fd >= 0) {
+                close(job->fd);
+                job->fd = -1;
+            }
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
 
-                // Truncate directory name by shifting rest of path back
-                memmove(start+12, next_start, strlen(next_start));
+    // Anything not copied after an io_uring failure
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        if (jobs[i].fd >= 0) close(jobs[i].fd);
+        if (i >= cursor.job || jobs[i].in_flight > 0) copy_jobs[i].result = false;
+    }
 
-                // Set new end of full path by shortened amount
-                *(path + strlen(path) - diff) = '\0';   
+    // Buffers the kernel may still be reading into after a failure are not freed
+    free_uring(&ring);
+    if (in_flight == 0) free(buffers);
+    free(jobs);
+    return true;
+#else
+    (void)image;
+    return false;
+#endif
+}
 
-                end = start+11;
-                *end = '\0';    // End new name
+// =====================================
+// Do all queued copy jobs; with 1 thread, in increasing image offset order, 
+//   otherwise with a pool of worker threads. All FAT and directory changes are
+//   already made in memory, so only file data is written here
+// =====================================
+bool run_copy_jobs(FILE *image, const char *image_name, uint32_t num_threads) {
+    if (num_copy_jobs == 0) return true;
+
+    // Streamed file data is only read when the image is written out, and CRC32s 
+    //   from the build cache aren't needed again
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        Copy_Job *job = &copy_jobs[i];
+        if (job->index_entry && (streaming || data_index[job->index_entry - 1].has_crc32)) 
+            job->index_entry = 0;
+    }
+
+#if defined(_WIN32)
+    (void)image_name;
+    num_threads = 1;
+#endif
+
+    if (num_threads <= 1) {
+        // Write file data front to back; pipelined through io_uring if available, 
+        //   unless files are cloned or holes skipped, which is done synchronously
+        qsort(copy_jobs, num_copy_jobs, sizeof *copy_jobs, compare_copy_job_offsets);
+        const bool pipelined = !streaming && !sparse && !reflink && run_copy_jobs_uring(image);
+        for (uint32_t i = 0; !pipelined && i < num_copy_jobs; i++) 
+            do_copy_job(&copy_jobs[i], image);
+    }
+#if !defined(_WIN32)
+    else {
+        // Start largest files first, so one large file doesn't finish last by itself
+        qsort(copy_jobs, num_copy_jobs, sizeof *copy_jobs, compare_copy_jobs);
+        if (num_threads > num_copy_jobs) num_threads = num_copy_jobs;
+
+        // Workers write through their own streams
+        fflush(image);
+
+        Copy_Pool pool = { .image_name = image_name };
+        atomic_init(&pool.next_job, 0);
+
+        pthread_t threads[MAX_JOBS];
+        uint32_t num_started = 0;
+        while (num_started < num_threads && 
+               pthread_create(&threads[num_started], NULL, copy_worker, &pool) == 0)
+            num_started++;
+
+        // Copy in this thread if no workers could be started
+        if (num_started == 0) copy_worker(&pool);
+
+        for (uint32_t i = 0; i < num_started; i++) 
+            pthread_join(threads[i], NULL);
+    }
+#endif
+
+    bool result = true;
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        if (!copy_jobs[i].result) {
+            fprintf(stderr, "Error: Could not write file data for '%s'\n", copy_jobs[i].file_path);
+            result = false;
+        } else if (copy_jobs[i].index_entry) {
+            Data_Index_Entry *entry = &data_index[copy_jobs[i].index_entry - 1];
+            entry->record.crc32 = get_copy_job_crc32(&copy_jobs[i]);
+            entry->has_crc32 = true;
+        }
+    }
+
+    free(copy_jobs);
+    copy_jobs = NULL;
+    num_copy_jobs = 0;
+    return result;
+}
+
+// =====================================
+// Compare 2 streamed image ranges for sorting by image offset
+// =====================================
+int compare_stream_extents(const void *a, const void *b) {
+    const uint64_t offset_a = ((const Stream_Extent *)a)->offset;
+    const uint64_t offset_b = ((const Stream_Extent *)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// =====================================
+// Sort the saved ranges of a streamed image by offset, and check that none 
+//   overlap or go past the end of the image
+// =====================================
+bool sort_stream_extents(const uint64_t image_size) {
+    qsort(stream_extents, num_stream_extents, sizeof *stream_extents, compare_stream_extents);
+
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < num_stream_extents; i++) {
+        const Stream_Extent *extent = &stream_extents[i];
+        if (extent->offset < pos || extent->offset + extent->size > image_size) {
+            fprintf(stderr, "Error: Overlapping or out of range data at image offset %"PRIu64"\n",
+                    extent->offset);
+            return false;
+        }
+        pos = extent->offset + extent->size;
+    }
+
+    return true;
+}
+
+// =====================================
+// Free the saved ranges of a streamed image
+// =====================================
+void free_stream_extents(void) {
+    for (uint32_t i = 0; i < num_stream_extents; i++) 
+        free(stream_extents[i].data);
+    free(stream_extents);
+    stream_extents = NULL;
+    num_stream_extents = 0;
+}
+
+// =====================================
+// Read data of a streamed image back from its saved ranges, with zeros where 
+//   nothing was written; ranges must be sorted, and reads must be in increasing
+//   offset order
+// =====================================
+bool read_stream_data(Stream_Reader *reader, uint8_t *buf, const uint64_t offset, 
+                      const uint64_t size) {
+    memset(buf, 0, size);
+
+    while (reader->next_extent < num_stream_extents && 
+           stream_extents[reader->next_extent].offset + stream_extents[reader->next_extent].size <= offset)
+        reader->next_extent++;
+
+    for (uint32_t i = reader->next_extent; 
+         i < num_stream_extents && stream_extents[i].offset < offset + size; i++) {
+        const Stream_Extent *extent = &stream_extents[i];
+        const uint64_t start = extent->offset > offset ? extent->offset : offset;
+        const uint64_t end = extent->offset + extent->size < offset + size ? 
+                             extent->offset + extent->size : offset + size;
+
+        if (extent->data) {
+            memcpy(buf + (start - offset), extent->data + (start - extent->offset), end - start);
+            continue;
+        }
+
+        // ESP files are in 1 range per run of clusters, so keep the last file open
+        if (!reader->file_path || strcmp(reader->file_path, extent->file_path)) {
+            if (reader->file) fclose(reader->file);
+            reader->file_path = extent->file_path;
+            reader->file = fopen(reader->file_path, "rb");
+            if (!reader->file) {
+                fprintf(stderr, "Error: Could not fopen file '%s'\n", reader->file_path);
+                return false;
             }
         }
 
-        // Convert file name to 8.3 name before checking if exists
-        // e.g. "FOO.BAR"  -> "FOO     BAR" 
-        //      "BA.Z"     -> "BA      Z  " 
-        //      "ELEPHANT" -> "ELEPHANT   "
-        char short_name[12] = {0};
-        memset(short_name, ' ', 11);
-        if (type == TYPE_DIR || !dot_pos)  {
-            memcpy(short_name, start, strlen(start));  // No '.', copy full name
-        } else {
-            memcpy(short_name, start, dot_pos - start); // Name 8 in 8.3
-            strncpy(&short_name[8], dot_pos+1, 3);      // Extension 3 in 8.3
+        if (read_at(reader->file, buf + (start - offset), end - start, 
+                    extent->file_offset + (start - extent->offset)) != end - start) {
+            fprintf(stderr, "Error: Could not read file data for '%s'\n", reader->file_path);
+            return false;
         }
+    }
 
-        // Search for name in current directory's file data (dir_entrys)
-        FAT32_Dir_Entry_Short dir_entry = { 0 };
-        bool found = false;
-        fseek(image, (fat32_data_lba + dir_cluster - 2) * lba_size, SEEK_SET);
-        do {
-            if (fread(&dir_entry, 1, sizeof dir_entry, image) == sizeof dir_entry &&
-                !memcmp(dir_entry.DIR_Name, short_name, 11)) {
-                // Found name in directory, save cluster for last directory found
-                dir_cluster = (dir_entry.DIR_FstClusHI << 16) | dir_entry.DIR_FstClusLO;
-                found = true;
+    return true;
+}
+
+// =====================================
+// Write zeros to a streamed image between 2 image offsets, from a zero filled 
+//   buffer; when only clusters holding data are written (cluster size not 0),
+//   clusters in between are skipped
+// =====================================
+bool write_stream_zeros(FILE *image, const uint8_t *zeros, const uint64_t pos, const uint64_t next,
+                        const uint64_t cluster_size) {
+    uint64_t size = next - pos;
+    if (cluster_size && pos / cluster_size != next / cluster_size) {
+        // Rest of this cluster if it has data, then the start of the next one
+        const uint64_t rest = pos % cluster_size ? cluster_size - (pos % cluster_size) : 0;
+        if (!write_stream_zeros(image, zeros, pos, pos + rest, 0)) return false;
+        size = next % cluster_size;
+    }
+
+    while (size > 0) {
+        const uint64_t len = size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE;
+        if (fwrite(zeros, 1, len, image) != len) return false;
+        size -= len;
+    }
+    return true;
+}
+
+// =====================================
+// Write a streamed image front to back in a single pass with no seeking, so it 
+//   can go to a pipe: every saved range in offset order, with zeros in between
+//   and after the last range up to the image size. With a cluster size, only 
+//   whole clusters holding data are written, e.g. for qcow2
+// =====================================
+bool write_stream(FILE *image, const uint64_t image_size, const uint64_t cluster_size) {
+    uint8_t *zeros = calloc(1, COPY_BUFFER_SIZE), *copy_buf = malloc(COPY_BUFFER_SIZE);
+    if (!zeros || !copy_buf) {
+        fprintf(stderr, "Error: Could not allocate memory for streaming image\n");
+        free(zeros);
+        free(copy_buf);
+        return false;
+    }
+
+    FILE *file = NULL;
+    const char *file_path = NULL;
+    uint64_t pos = 0;
+    bool result = sort_stream_extents(image_size);
+    for (uint32_t i = 0; result && i < num_stream_extents; i++) {
+        const Stream_Extent *extent = &stream_extents[i];
+        if (!write_stream_zeros(image, zeros, pos, extent->offset, cluster_size)) {
+            result = false;
+            break;
+        }
+        pos = extent->offset;
+
+        if (extent->data) {
+            result = fwrite(extent->data, 1, extent->size, image) == extent->size;
+            pos += extent->size;
+            continue;
+        }
+
+        // File data; ESP files are in 1 range per run of clusters, so keep the 
+        //   last file open
+        if (!file_path || strcmp(file_path, extent->file_path)) {
+            if (file) fclose(file);
+            file_path = extent->file_path;
+            file = fopen(file_path, "rb");
+            if (!file) {
+                fprintf(stderr, "Error: Could not fopen file '%s'\n", file_path);
+                result = false;
                 break;
             }
-        } while (dir_entry.DIR_Name[0] != '\0');
+        }
 
-        if (!found) {
-            // Add new directory or file to last found directory;
-            //   if new directory, update current directory cluster to check/use
-            //   for next new files 
-            if (!add_file_to_esp(short_name, file, image, type, &dir_cluster))
+        uint64_t done = 0;
+#if defined(__linux__)
+        // sendfile() writes at the current position of the output, which can be a pipe
+        fflush(image);
+        while (done < extent->size) {
+            off_t off_in = extent->file_offset + done;
+            const ssize_t bytes = sendfile(fileno(image), fileno(file), &off_in, extent->size - done);
+            if (bytes > 0) {
+                done += bytes;
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) continue;
+            break;
+        }
+#endif
+
+        // Copy anything left through a large buffer
+        while (done < extent->size) {
+            const uint64_t len = extent->size - done < COPY_BUFFER_SIZE ? 
+                                 extent->size - done : COPY_BUFFER_SIZE;
+            const uint64_t bytes_read = read_at(file, copy_buf, len, extent->file_offset + done);
+            if (bytes_read == 0 || fwrite(copy_buf, 1, bytes_read, image) != bytes_read) break;
+            done += bytes_read;
+        }
+
+        if (done < extent->size) {
+            fprintf(stderr, "Error: Could not write file data for '%s'\n", file_path);
+            result = false;
+        }
+        pos += extent->size;
+    }
+
+    // Rest of the image, or of the last cluster
+    const uint64_t end = cluster_size ? ((pos + cluster_size - 1) / cluster_size) * cluster_size : 
+                                        image_size;
+    if (result) result = write_stream_zeros(image, zeros, pos, end, cluster_size) && fflush(image) == 0;
+
+    if (file) fclose(file);
+    free_stream_extents();
+    free(zeros);
+    free(copy_buf);
+
+    return result;
+}
+
+// =====================================
+// Store a value in big endian byte order, e.g. for VHD & qcow2 fields
+// =====================================
+void put_big_endian(uint8_t *buf, const uint64_t value, const uint8_t num_bytes) {
+    for (uint8_t i = 0; i < num_bytes; i++) 
+        buf[i] = (value >> ((num_bytes - 1 - i) * 8)) & 0xFF;
+}
+
+// =====================================
+// Write a streamed image as a qcow2 image, allocating only the clusters that 
+//   hold data. Header, L1 table, refcounts and L2 tables come first, then the 
+//   data clusters in disk order, so it is still written front to back
+// =====================================
+bool write_qcow2(FILE *image, const uint64_t disk_size) {
+    const uint64_t cluster_size = QCOW2_CLUSTER_SIZE;
+    const uint64_t l2_entries = cluster_size / sizeof(uint64_t);
+    const uint64_t refcounts_per_block = cluster_size / sizeof(uint16_t);
+
+    if (!sort_stream_extents(disk_size)) return false;
+
+    // Disk clusters with any data, in order
+    uint64_t *clusters = NULL;
+    uint32_t num_clusters = 0;
+    for (uint32_t i = 0; i < num_stream_extents; i++) {
+        const Stream_Extent *extent = &stream_extents[i];
+        for (uint64_t c = extent->offset / cluster_size; 
+             c <= (extent->offset + extent->size - 1) / cluster_size; c++) {
+            if (num_clusters > 0 && clusters[num_clusters - 1] >= c) continue;
+
+            uint64_t *new_clusters = grow_array(clusters, num_clusters, sizeof *new_clusters);
+            if (!new_clusters) {
+                free(clusters);
                 return false;
+            }
+            clusters = new_clusters;
+            clusters[num_clusters++] = c;
+        }
+    }
 
-            any_files_added = true;
+    // 1 L2 table for each range of the disk an L1 entry covers, that has data
+    const uint64_t l1_size = (disk_size + (cluster_size * l2_entries) - 1) / (cluster_size * l2_entries);
+    const uint64_t l1_clusters = (l1_size * sizeof(uint64_t) + cluster_size - 1) / cluster_size;
+    uint64_t num_l2 = 0;
+    for (uint32_t i = 0; i < num_clusters; i++) 
+        if (i == 0 || clusters[i] / l2_entries != clusters[i - 1] / l2_entries) num_l2++;
+
+    // Refcount blocks count every cluster in the file, including themselves and 
+    //   the refcount table
+    uint64_t num_blocks = 0, table_clusters = 0, total_clusters = 0;
+    while (true) {
+        total_clusters = 1 + l1_clusters + table_clusters + num_blocks + num_l2 + num_clusters;
+        const uint64_t new_blocks = (total_clusters + refcounts_per_block - 1) / refcounts_per_block;
+        const uint64_t new_table_clusters = (new_blocks * sizeof(uint64_t) + cluster_size - 1) / 
+                                            cluster_size;
+        if (new_blocks == num_blocks && new_table_clusters == table_clusters) break;
+        num_blocks = new_blocks;
+        table_clusters = new_table_clusters;
+    }
+
+    const uint64_t l1_start = 1, table_start = l1_start + l1_clusters;
+    const uint64_t blocks_start = table_start + table_clusters, l2_start = blocks_start + num_blocks;
+    const uint64_t data_start = l2_start + num_l2;
+
+    uint8_t *meta = calloc(data_start, cluster_size);
+    if (!meta) {
+        fprintf(stderr, "Error: Could not allocate memory for qcow2 metadata\n");
+        free(clusters);
+        return false;
+    }
+
+    // Header, version 2 with 16 bit refcounts; no backing file or snapshots
+    Qcow2_Header *header = (Qcow2_Header *)meta;
+    memcpy(header->magic, "QFI\xFB", 4);
+    put_big_endian(header->version, 2, 4);
+    put_big_endian(header->cluster_bits, QCOW2_CLUSTER_BITS, 4);
+    put_big_endian(header->size, disk_size, 8);
+    put_big_endian(header->l1_size, l1_size, 4);
+    put_big_endian(header->l1_table_offset, l1_start * cluster_size, 8);
+    put_big_endian(header->refcount_table_offset, table_start * cluster_size, 8);
+    put_big_endian(header->refcount_table_clusters, table_clusters, 4);
+
+    // Refcount table & blocks; every cluster is used once
+    for (uint64_t i = 0; i < num_blocks; i++) 
+        put_big_endian(meta + (table_start * cluster_size) + (i * sizeof(uint64_t)), 
+                       (blocks_start + i) * cluster_size, 8);
+    for (uint64_t i = 0; i < total_clusters; i++) 
+        put_big_endian(meta + (blocks_start * cluster_size) + (i * sizeof(uint16_t)), 1, 2);
+
+    // L1 & L2 tables; data clusters follow the metadata in disk order
+    uint64_t l2_offset = 0;
+    for (uint32_t i = 0, l2 = 0; i < num_clusters; i++) {
+        if (i == 0 || clusters[i] / l2_entries != clusters[i - 1] / l2_entries) {
+            l2_offset = (l2_start + l2++) * cluster_size;
+            put_big_endian(meta + (l1_start * cluster_size) + 
+                           ((clusters[i] / l2_entries) * sizeof(uint64_t)),
+                           l2_offset | QCOW2_OFLAG_COPIED, 8);
         }
+        put_big_endian(meta + l2_offset + ((clusters[i] % l2_entries) * sizeof(uint64_t)),
+                       ((data_start + i) * cluster_size) | QCOW2_OFLAG_COPIED, 8);
+    }
 
-        *end++ = '/';
-        start = end;
+    bool result = fwrite(meta, cluster_size, data_start, image) == data_start;
+    free(meta);
+    free(clusters);
+
+    return result && write_stream(image, disk_size, cluster_size);
+}
+
+// =====================================
+// Hash the first size bytes of a file, continuing from a previous hash value
+// =====================================
+bool hash_file_contents(const char *file_path, const uint64_t size, uint64_t *hash) {
+    FILE *file = fopen(file_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not fopen file '%s'\n", file_path);
+        return false;
     }
 
-    *--end = '\0';  // Don't add extra slash to end of path, final file name is not a directory
+    uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+    bool result = buf != NULL;
+    for (uint64_t left = size; result && left > 0; ) {
+        const size_t chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        if (fread(buf, 1, chunk, file) != chunk) {
+            fprintf(stderr, "Error: Could not read file '%s'\n", file_path);
+            result = false;
+            break;
+        }
+        *hash = fnv1a_64(*hash, buf, chunk);
+        left -= chunk;
+    }
+
+    free(buf);
+    fclose(file);
+    return result;
+}
 
-    // Show info to user
-    if (any_files_added) printf("Added '%s' to EFI System Partition\n", path);
+// =====================================
+// Get hash of the partition & ESP layout values of the image
+// =====================================
+uint64_t get_layout_hash(void) {
+    const uint64_t layout[] = { lba_size, esp_size_lbas, data_size_lbas, image_size_lbas, 
+                                esp.cluster_size };
+    uint64_t hash = fnv1a_64(FNV_OFFSET_BASIS, layout, sizeof layout);
+
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        const Partition *partition = &partitions[i];
+        const uint64_t values[] = { partition->lba, partition->num_lbas, partition->attributes };
+        hash = fnv1a_64(hash, values, sizeof values);
+        hash = fnv1a_64(hash, &partition->type_guid, sizeof partition->type_guid);
+        hash = fnv1a_64(hash, partition->name, sizeof partition->name);
+    }
+    return hash;
+}
+
+// =====================================
+// Get the GUID seed for a reproducible image, from a hash of the image layout and
+//   every file to be copied into it, in layout order
+// =====================================
+bool get_content_seed(uint64_t *seed) {
+    uint64_t hash = get_layout_hash();
+    hash = fnv1a_64(hash, &num_copy_jobs, sizeof num_copy_jobs);
+
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        const Copy_Job *job = &copy_jobs[i];
+        hash = fnv1a_64(hash, &job->offset, sizeof job->offset);
+        hash = fnv1a_64(hash, &job->size, sizeof job->size);
+        if (!hash_file_contents(job->file_path, job->size, &hash)) return false;
+    }
 
+    *seed = hash;
+    return true;
+}
+
+// =====================================
+// Get # of sectors for 1 FAT of a new ESP, for a given # of sectors per cluster
+// =====================================
+uint32_t fat32_fat_size(const uint8_t sec_per_clus) {
+    //.BPB_FATSz32 = From FAT docs: TMP1 = disk_size_sectors - reserved sector count;
+    //                              TMP2 = (256 * sectors per cluster) + number of FATs;
+    //                              For FAT32 => TMP2 = TMP2 / 2;
+    //                              FATSz32 = (TMP1 + (TMP2 - 1)) / TMP2;
+    // This should get the # of sectors (LBAs) required to hold all of the clusters for the ESP size,
+    //   for 1 FAT table. The 256 assumes 512 byte sectors; it is half the # of 
+    //   FAT16 entries per sector, so use lba_size / 2 for other lba sizes.
+    const uint32_t temp = (((lba_size / 2) * sec_per_clus) + 2) / 2;   // 2 FATs
+    return ((esp_size_lbas - FAT32_RESERVED_SECTORS) + (temp-1)) / temp;
+}
+
+// =====================================
+// Get # of data clusters in a new ESP, for a given # of sectors per cluster
+// =====================================
+uint64_t fat32_cluster_count(const uint8_t sec_per_clus) {
+    const uint64_t fat_sectors = 2 * (uint64_t)fat32_fat_size(sec_per_clus);
+    if (esp_size_lbas <= FAT32_RESERVED_SECTORS + fat_sectors) return 0;
+    return (esp_size_lbas - FAT32_RESERVED_SECTORS - fat_sectors) / sec_per_clus;
+}
+
+// =====================================
+// Get # of sectors per cluster for a new ESP; either from a cluster size in bytes, or
+//   if 0, from the ESP size per the FAT32 table in fatgen103.doc. Returns 0 if the
+//   ESP can't be FAT32 with this cluster size
+// =====================================
+uint8_t get_esp_sectors_per_cluster(const uint64_t cluster_size) {
+    uint64_t bytes = cluster_size;
+    if (bytes == 0) {
+        // Table values are for 512 byte sectors, so compare sizes in bytes; 
+        //   ESP sizes up to 260MB = 512 bytes, 8GB = 4KiB, 16GB = 8KiB, 32GB = 16KiB,
+        //   and larger = 32KiB
+        if      (esp_size <= 532480ULL * 512)   bytes = 512;
+        else if (esp_size <= 16777216ULL * 512) bytes = 4096;
+        else if (esp_size <= 33554432ULL * 512) bytes = 8192;
+        else if (esp_size <= 67108864ULL * 512) bytes = 16384;
+        else                                    bytes = MAX_CLUSTER_SIZE;
+
+        // Clusters can't be smaller than 1 sector, and the ESP must have enough 
+        //   clusters to be FAT32
+        if (bytes < lba_size) bytes = lba_size;
+        while (bytes > lba_size && fat32_cluster_count(bytes / lba_size) < FAT32_MIN_CLUSTERS) 
+            bytes /= 2;
+    }
+
+    const uint64_t sec_per_clus = bytes / lba_size;
+    const uint64_t clusters = fat32_cluster_count(sec_per_clus);
+    if (clusters < FAT32_MIN_CLUSTERS || clusters > FAT32_MAX_CLUSTERS) return 0;
+
+    return sec_per_clus;
+}
+
+// =====================================
+// Set up a new EFI System Partition (ESP) w/FAT32 filesystem in memory; it is 
+//   written to the image by write_esp() and write_esp_metadata()
+// =====================================
+bool new_esp(void) {
+    // Reserved sectors region --------------------------
+    // Fill out Volume Boot Record (VBR)
+    const uint8_t reserved_sectors = FAT32_RESERVED_SECTORS;
+    Vbr vbr = {
+        .BS_jmpBoot      = { 0xEB, 0x00, 0x90 },
+        .BS_OEMName      = { 'T','H','I','S','D','I','S','K' },
+        .BPB_BytesPerSec = lba_size,         // This is limited to only 512/1024/2048/4096
+        .BPB_SecPerClus  = esp_sec_per_clus,
+        .BPB_RsvdSecCnt  = reserved_sectors,
+        .BPB_NumFATs     = 2,                // 2 FAT tables
+        .BPB_RootEntCnt  = 0,
+        .BPB_TotSec16    = 0,
+        .BPB_Media       = 0xF8,             // "Fixed" non-removable media; Could also be 0xF0 for e.g. flash drive
+        .BPB_FATSz16     = 0,
+        .BPB_SecPerTrk   = 0,  
+        .BPB_NumHeads    = 0,    
+        .BPB_HiddSec     = esp_lba - 1,      // # of sectors before this partition/volume
+        .BPB_TotSec32    = esp_size_lbas,    // Size of this partition
+        .BPB_FATSz32     = 0,                // Filled out below
+        .BPB_ExtFlags    = 0,                // Mirrored FATs
+        .BPB_FSVer       = 0,
+        .BPB_RootClus    = 2,                // Clusters 0 & 1 are reserved; root dir cluster starts at 2
+        .BPB_FSInfo      = 1,                // Sector 0 = this VBR; FS Info sector follows it
+        .BPB_BkBootSec   = 6,                // 6 seems to be common for backup boot sector #
+        .BPB_Reserved    = { 0 },
+        .BS_DrvNum       = 0x80,             // 1st hard drive
+        .BS_Reserved1    = 0,
+        .BS_BootSig      = 0x29,
+        .BS_VolID        = { 0 }, 
+        .BS_VolLab       = { 'N','O',' ','N','A','M','E',' ',' ',' ',' ' },	// No volume label 
+        .BS_FilSysType   = { 'F','A','T','3','2',' ',' ',' ' },
+
+        // Not in fatgen103.doc tables
+        .boot_code       = { 0 },
+        .bootsect_sig    = 0xAA55,     
+    };
+
+    vbr.BPB_FATSz32 = fat32_fat_size(vbr.BPB_SecPerClus);
+
+    // Fill out file system info sector
+    FSInfo fsinfo = {
+        .FSI_LeadSig    = 0x41615252,
+        .FSI_Reserved1  = { 0 },
+        .FSI_StrucSig   = 0x61417272,
+        .FSI_Free_Count = 0xFFFFFFFF,
+        .FSI_Nxt_Free   = 5,            // First available cluster (value = 0) after /EFI/BOOT
+        .FSI_Reserved2  = { 0 },
+        .FSI_TrailSig   = 0xAA550000,
+    };
+
+    // Set up in-memory metadata; FAT, FSInfo and directories are written out
+    //   later in write_esp_metadata(), after all files are added
+    if (!init_esp_staging(&vbr, &fsinfo)) return false;
+
+    // FAT region --------------------------
+    // Cluster 0; FAT identifier, lowest 8 bits are the media type/byte
+    esp.fat[0] = 0xFFFFFF00 | vbr.BPB_Media;
+
+    // Cluster 1; End of Chain (EOC) marker
+    esp.fat[1] = 0xFFFFFFFF;
+
+    // Cluster 2; Root dir '/' cluster start, if end of file/dir data then write EOC marker
+    esp.fat[2] = 0xFFFFFFFF;
+
+    // Cluster 3; '/EFI' dir cluster
+    esp.fat[3] = 0xFFFFFFFF;
+
+    // Cluster 4; '/EFI/BOOT' dir cluster
+    esp.fat[4] = 0xFFFFFFFF;
+
+    // Cluster 5+; Other files/directories...
+    // e.g. if adding a file with a size = 5 sectors/clusters
+    //fat[5] = 6;    // Point to next cluster containing file data
+    //fat[6] = 7;    // Point to next cluster containing file data
+    //fat[7] = 8;    // Point to next cluster containing file data
+    //fat[8] = 9;    // Point to next cluster containing file data
+    //fat[9] = 0xFFFFFFFF; // EOC marker, no more file data after this cluster
+    esp.dirty_lo = 0;
+    esp.dirty_hi = 4;
+
+    if (!build_free_map()) return false;
+
+    // Data region --------------------------
+    // Root '/' Directory entries
+    Esp_Dir *root_dir = new_esp_dir(2, 1);
+    Esp_Dir *efi_dir  = new_esp_dir(3, 1);
+    Esp_Dir *boot_dir = new_esp_dir(4, 1);
+    if (!root_dir || !efi_dir || !boot_dir) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP directories\n");
+        return false;
+    }
+    FAT32_Dir_Entry_Short *dir_ent = (FAT32_Dir_Entry_Short *)root_dir->data;
+
+    // "/EFI" dir entry 
+    *dir_ent = (FAT32_Dir_Entry_Short){
+        .DIR_Name = { 'E','F','I',' ',' ',' ',' ',' ',' ',' ',' ' },
+        .DIR_Attr = ATTR_DIRECTORY,
+        .DIR_NTRes = 0,
+        .DIR_CrtTimeTenth = 0,
+        .DIR_CrtTime = 0,
+        .DIR_CrtDate = 0,
+        .DIR_LstAccDate = 0,
+        .DIR_FstClusHI = 0,
+        .DIR_WrtTime = 0,
+        .DIR_WrtDate = 0,
+        .DIR_FstClusLO = 3,
+        .DIR_FileSize = 0,  // Directories have 0 file size
+    };
+
+    uint16_t create_time = 0, create_date = 0;
+    get_fat_dir_entry_time_date(&create_time, &create_date);
+
+    dir_ent->DIR_CrtTime = create_time;
+    dir_ent->DIR_CrtDate = create_date;
+    dir_ent->DIR_WrtTime = create_time;
+    dir_ent->DIR_WrtDate = create_date;
+
+    // /EFI Directory entries
+    FAT32_Dir_Entry_Short *efi_ent = (FAT32_Dir_Entry_Short *)efi_dir->data;
+
+    efi_ent[0] = *dir_ent;
+    memcpy(efi_ent[0].DIR_Name, ".          ", 11);   // "." dir entry, this directory itself
+
+    efi_ent[1] = *dir_ent;
+    memcpy(efi_ent[1].DIR_Name, "..         ", 11);   // ".." dir entry, parent dir (ROOT dir)
+    efi_ent[1].DIR_FstClusLO = 0;                     // Root directory does not have a cluster value
+
+    efi_ent[2] = *dir_ent;
+    memcpy(efi_ent[2].DIR_Name, "BOOT       ", 11);   // /EFI/BOOT directory
+    efi_ent[2].DIR_FstClusLO = 4;                     // /EFI/BOOT cluster
+
+    // /EFI/BOOT Directory entries
+    FAT32_Dir_Entry_Short *boot_ent = (FAT32_Dir_Entry_Short *)boot_dir->data;
+
+    boot_ent[0] = efi_ent[2];
+    memcpy(boot_ent[0].DIR_Name, ".          ", 11);  // "." dir entry, this directory itself
+
+    boot_ent[1] = efi_ent[2];
+    memcpy(boot_ent[1].DIR_Name, "..         ", 11);  // ".." dir entry, parent dir (/EFI dir)
+    boot_ent[1].DIR_FstClusLO = 3;                    // /EFI directory cluster
+
+    // Index new entries for name lookups
+    return index_esp_dir(root_dir) && index_esp_dir(efi_dir) && index_esp_dir(boot_dir);
+}
+
+// =====================================
+// Write EFI System Partition (ESP) VBR & backup VBR
+// =====================================
+bool write_esp(FILE *image) {
+    // Write VBR
+    if (!write_at(image, &esp.vbr, sizeof esp.vbr, esp_lba * lba_size)) {
+        fprintf(stderr, "Error: Could not write ESP VBR to image\n");
+        return false;
+    }
+    write_full_lba_size(image);
+
+    // Write VBR at backup boot sector location; FSInfo sectors follow each VBR,
+    //   and are written with the rest of the metadata
+    if (!write_at(image, &esp.vbr, sizeof esp.vbr, (esp_lba + esp.vbr.BPB_BkBootSec) * lba_size)) {
+        fprintf(stderr, "Error: Could not write VBR to image\n");
+        return false;
+    }
+    write_full_lba_size(image);
+
+    return true;
+}
+
+// =====================================
+// Read or write all of a directory's clusters, one run of contiguous clusters 
+//   at a time
+// =====================================
+bool transfer_esp_dir(Esp_Dir *dir, FILE *image, const bool write) {
+    uint32_t cluster = dir->cluster;
+    for (uint32_t i = 0; i < dir->num_clusters; ) {
+        if (cluster < 2 || cluster > esp.max_cluster) return false;
+
+        const uint32_t run_start = cluster, run_index = i;
+        do {
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+            i++;
+        } while (i < dir->num_clusters && cluster == run_start + (i - run_index));
+
+        uint8_t *buf = dir->data + (run_index * esp.cluster_size);
+        const uint64_t size = (i - run_index) * esp.cluster_size;
+        const uint64_t offset = cluster_to_lba(run_start) * lba_size;
+        if (write ? !write_at(image, buf, size, offset) : read_at(image, buf, size, offset) != size)
+            return false;
+    }
+
+    return true;
+}
+
+// =====================================
+// Add clusters to a directory to hold at least a given # of entries; grows by
+//   at least the current size, so adding many entries only grows it a few times
+// =====================================
+bool grow_esp_dir(Esp_Dir *dir, const uint32_t min_entries) {
+    const uint32_t entries_per_cluster = esp.cluster_size / sizeof(FAT32_Dir_Entry_Short);
+    const uint32_t max_clusters = MAX_DIR_ENTRIES / entries_per_cluster;
+    if (dir->num_clusters >= max_clusters) {
+        fprintf(stderr, "Error: ESP directory at cluster %u is full, max %d entries\n", 
+                dir->cluster, MAX_DIR_ENTRIES);
+        return false;
+    }
+
+    uint32_t new_clusters = dir->num_clusters;
+    const uint32_t needed_clusters = (min_entries + entries_per_cluster - 1) / entries_per_cluster;
+    if (dir->num_clusters + new_clusters < needed_clusters) 
+        new_clusters = needed_clusters - dir->num_clusters;
+    if (dir->num_clusters + new_clusters > max_clusters) 
+        new_clusters = max_clusters - dir->num_clusters;
+
+    const uint32_t start_cluster = allocate_clusters(new_clusters);
+    if (!start_cluster) {
+        fprintf(stderr, "Error: Not enough free space in ESP to grow directory at cluster %u\n", 
+                dir->cluster);
+        return false;
+    }
+
+    uint8_t *data = realloc(dir->data, (dir->num_clusters + new_clusters) * esp.cluster_size);
+    if (!data) {
+        fprintf(stderr, "Error: Could not allocate memory for ESP directory\n");
+        free_cluster_chain(start_cluster);
+        return false;
+    }
+    memset(data + (dir->num_clusters * esp.cluster_size), 0, new_clusters * esp.cluster_size);
+    dir->data = data;
+
+    // Link new clusters to end of directory's cluster chain
+    uint32_t last_cluster = dir->cluster;
+    for (uint32_t i = 1; i < dir->num_clusters; i++) 
+        last_cluster = esp.fat[last_cluster] & 0x0FFFFFFF;
+    set_fat_entry(last_cluster, start_cluster);
+
+    dir->num_clusters += new_clusters;
+    dir->dirty = true;
+    return index_esp_dir(dir);
+}
+
+// =====================================
+// Get the first free entry in a directory, cleared for use; the directory grows 
+//   if it is full. Returns NULL if directory can't grow
+// =====================================
+FAT32_Dir_Entry_Short *new_dir_entry(Esp_Dir *dir) {
+    if (dir->first_free >= dir->num_entries && !grow_esp_dir(dir, dir->num_entries + 1)) 
+        return NULL;
+
+    FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data;
+    FAT32_Dir_Entry_Short *new_entry = &dir_entry[dir->first_free];
+
+    // Advance to next unused or deleted entry
+    do {
+        dir->first_free++;
+    } while (dir->first_free < dir->num_entries && 
+             dir_entry[dir->first_free].DIR_Name[0] != '\0' &&
+             dir_entry[dir->first_free].DIR_Name[0] != 0xE5);
+
+    memset(new_entry, 0, sizeof *new_entry);
+    dir->dirty = true;
+    return new_entry;
+}
+
+// =====================================
+// Write staged ESP metadata to image: FSInfo, FATs, and directory clusters
+// =====================================
+bool write_esp_metadata(FILE *image) {
+    // FSInfo sector, primary & backup; update free cluster count and next free cluster
+    esp.fsinfo.FSI_Free_Count = esp.free_count;
+    esp.fsinfo.FSI_Nxt_Free = find_next_cluster(esp.next_free, true);
+    if (esp.fsinfo.FSI_Nxt_Free > esp.max_cluster) 
+        esp.fsinfo.FSI_Nxt_Free = find_next_cluster(2, true);
+    if (esp.fsinfo.FSI_Nxt_Free > esp.max_cluster) 
+        esp.fsinfo.FSI_Nxt_Free = 0xFFFFFFFF;   // No free clusters
+
+    if (!write_at(image, &esp.fsinfo, sizeof esp.fsinfo, (esp_lba + 1) * lba_size) ||
+        !write_at(image, &esp.fsinfo, sizeof esp.fsinfo, 
+                  (esp_lba + esp.vbr.BPB_BkBootSec + 1) * lba_size)) {
+        fprintf(stderr, "Error: Could not write ESP File System Info Sector to image\n");
+        return false;
+    }
+
+    // FATs; Write only the changed range of entries, rounded out to full lbas, 
+    //   with 1 write per FAT copy
+    if (esp.dirty_lo <= esp.dirty_hi) {
+        const uint64_t entries_per_lba = lba_size / sizeof *esp.fat;
+        const uint64_t first_lba = esp.dirty_lo / entries_per_lba;
+        const uint64_t last_lba  = esp.dirty_hi / entries_per_lba;
+        const uint64_t size = (last_lba - first_lba + 1) * lba_size;
+
+        for (uint8_t i = 0; i < esp.vbr.BPB_NumFATs; i++) {
+            const uint64_t fat_lba = fat32_fats_lba + (i * esp.vbr.BPB_FATSz32);
+            preallocate_range(image, (fat_lba + first_lba) * lba_size, size);
+            if (!write_at(image, esp.fat + (first_lba * entries_per_lba), size, 
+                          (fat_lba + first_lba) * lba_size)) {
+                fprintf(stderr, "Error: Could not write ESP FAT #%u to image\n", i + 1);
+                return false;
+            }
+        }
+        esp.dirty_lo = UINT32_MAX;
+        esp.dirty_hi = 0;
+    }
+
+    // Changed directory clusters
+    for (uint32_t i = 0; i < esp.num_dirs; i++) {
+        if (!esp.dirs[i]->dirty) continue;
+
+        esp.dirs[i]->dirty = false;
+        if (!transfer_esp_dir(esp.dirs[i], image, true)) {
+            fprintf(stderr, "Error: Could not write ESP directory cluster %u to image\n",
+                    esp.dirs[i]->cluster);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// =====================================
+// Read GPT header & partition table from an existing image, and set 
+//   lba size, image size and partition values from it
+// =====================================
+bool read_gpts(FILE *image) {
+    // Find lba size by checking for the GPT header signature at LBA 1
+    const uint64_t lba_sizes[] = { 512, 1024, 2048, 4096 };
+    Gpt_Header gpt = { 0 };
+    bool found = false;
+    for (uint8_t i = 0; i < sizeof lba_sizes / sizeof lba_sizes[0]; i++) {
+        if (read_at(image, &gpt, sizeof gpt, lba_sizes[i]) == sizeof gpt &&
+            !memcmp(gpt.signature, "EFI PART", 8)) {
+            lba_size = lba_sizes[i];
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "Error: Could not find a GPT header in image\n");
+        return false;
+    }
+
+    // Verify header CRC
+    const uint32_t header_crc32 = gpt.header_crc32;
+    gpt.header_crc32 = 0;
+    if (gpt.header_size < 92 || gpt.header_size > sizeof gpt ||
+        calculate_crc32(&gpt, gpt.header_size) != header_crc32) {
+        fprintf(stderr, "Error: Invalid primary GPT header CRC\n");
+        return false;
+    }
+    gpt.header_crc32 = header_crc32;
+
+    // Read partition table
+    if (gpt.size_of_entry < sizeof(Gpt_Partition_Entry) || gpt.number_of_entries > 1024) {
+        fprintf(stderr, "Error: Unsupported GPT partition table size\n");
+        return false;
+    }
+
+    const uint64_t table_size = (uint64_t)gpt.number_of_entries * gpt.size_of_entry;
+    uint8_t *table = malloc(table_size);
+    if (!table) return false;
+
+    if (read_at(image, table, table_size, gpt.partition_table_lba * lba_size) != table_size ||
+        calculate_crc32(table, table_size) != gpt.partition_table_crc32) {
+        fprintf(stderr, "Error: Invalid primary GPT partition table\n");
+        free(table);
+        return false;
+    }
+
+    // Use first ESP & first basic data partitions found
+    esp_lba = data_lba = 0;
+    for (uint32_t i = 0; i < gpt.number_of_entries; i++) {
+        const Gpt_Partition_Entry *entry = (Gpt_Partition_Entry *)(table + (i * gpt.size_of_entry));
+
+        if (!esp_lba && !memcmp(&entry->partition_type_guid, &ESP_GUID, sizeof(Guid))) {
+            esp_lba = entry->starting_lba;
+            esp_size_lbas = entry->ending_lba - entry->starting_lba + 1;
+        } else if (!data_lba && !memcmp(&entry->partition_type_guid, &BASIC_DATA_GUID, sizeof(Guid))) {
+            data_lba = entry->starting_lba;
+            data_size_lbas = entry->ending_lba - entry->starting_lba + 1;
+        }
+    }
+    free(table);
+
+    if (!esp_lba) {
+        fprintf(stderr, "Error: Could not find an EFI System Partition in image\n");
+        return false;
+    }
+
+    gpt_table_lbas = GPT_TABLE_SIZE / lba_size;
+    align_lba = ALIGNMENT / lba_size;
+    image_size_lbas = gpt.alternate_lba + 1;    // Backup GPT header is at last lba
+    image_size = image_size_lbas * lba_size;
+    esp_size = esp_size_lbas * lba_size;
+    data_size = data_size_lbas * lba_size;
+
+    return true;
+}
+
+// =====================================
+// Find a path in the ESP, e.g. "/EFI/BOOT/BOOTX64.EFI"; the path is uppercased in
+//   place. Gets the directory holding the path, the path's directory entry (both
+//   NULL for the root directory), and its first cluster. Returns false if not found
+// =====================================
+bool find_esp_path(char *path, Esp_Dir **parent, FAT32_Dir_Entry_Short **entry, uint32_t *cluster) {
+    if (*path != '/') return false; // Path must begin with root '/'
+
+    for (size_t i = 0; i < strlen(path); i++) 
+        path[i] = toupper(path[i]);
+
+    Esp_Dir *dir = NULL;
+    FAT32_Dir_Entry_Short *dir_entry = NULL;
+    uint32_t dir_cluster = esp.vbr.BPB_RootClus;
+    char *start = path + 1;     // Skip initial slash
+
+    // Find each name in path
+    while (*start != '\0') {
+        char *end = start;
+        while (*end != '/' && *end != '\0') end++;
+
+        // Convert name to 8.3 name, e.g. "FOO.BAR" -> "FOO     BAR"; Names that don't
+        //   fit 8.3 naming can't be in the ESP
+        char short_name[11];
+        memset(short_name, ' ', 11);
+        char *dot_pos = memchr(start, '.', end - start);
+        const size_t name_len = dot_pos ? (size_t)(dot_pos - start) : (size_t)(end - start);
+        const size_t ext_len = dot_pos ? (size_t)(end - dot_pos - 1) : 0;
+        const bool valid_name = dot_pos ? (name_len > 0 && name_len <= 8 && ext_len <= 3) :
+                                          (name_len > 0 && name_len <= 11);
+        if (valid_name) {
+            memcpy(short_name, start, name_len);
+            if (dot_pos) memcpy(&short_name[8], dot_pos + 1, ext_len);
+        }
+
+        // Search for name in current directory
+        dir = find_esp_dir(dir_cluster);
+        dir_entry = dir && valid_name ? find_dir_entry(dir, (uint8_t *)short_name) : NULL;
+        if (!dir_entry) return false;
+
+        dir_cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+
+        start = *end == '/' ? end + 1 : end;
+    }
+
+    *parent = dir;
+    *entry = dir_entry;
+    *cluster = dir_cluster;
+    return true;
+}
+
+// =====================================
+// Read an existing ESP directory and its subdirectories into memory
+// =====================================
+bool read_esp_dir(FILE *image, const uint32_t cluster) {
+    if (cluster < 2 || cluster > esp.max_cluster) {
+        fprintf(stderr, "Error: Invalid ESP directory cluster %u\n", cluster);
+        return false;
+    }
+    if (find_esp_dir(cluster)) return true;   // Already read
+
+    // Get # of clusters in directory's cluster chain
+    const uint32_t max_clusters = MAX_DIR_ENTRIES / (esp.cluster_size / sizeof(FAT32_Dir_Entry_Short));
+    uint32_t num_clusters = 1;
+    for (uint32_t next = esp.fat[cluster] & 0x0FFFFFFF; 
+         next >= 2 && next <= esp.max_cluster; 
+         next = esp.fat[next] & 0x0FFFFFFF) {
+        if (++num_clusters > max_clusters) {
+            fprintf(stderr, "Error: ESP directory at cluster %u is too large\n", cluster);
+            return false;
+        }
+    }
+
+    Esp_Dir *dir = new_esp_dir(cluster, num_clusters);
+    if (!dir) return false;
+
+    if (!transfer_esp_dir(dir, image, false)) {
+        fprintf(stderr, "Error: Could not read ESP directory at cluster %u\n", cluster);
+        return false;
+    }
+    dir->dirty = false;
+    if (!index_esp_dir(dir)) return false;
+
+    const FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data;
+    const FAT32_Dir_Entry_Short *dir_end = dir_entry + dir->num_entries;
+    for (; dir_entry < dir_end && dir_entry->DIR_Name[0] != '\0'; dir_entry++) {
+        if (dir_entry->DIR_Name[0] == 0xE5 ||                       // Deleted entry
+            dir_entry->DIR_Name[0] == '.' ||                        // "." or ".."
+            (dir_entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+            !(dir_entry->DIR_Attr & ATTR_DIRECTORY))
+            continue;
+
+        if (!read_esp_dir(image, (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO))
+            return false;
+    }
+
+    return true;
+}
+
+// =====================================
+// Read FAT32 metadata from an existing ESP into memory: VBR, FSInfo, FAT 
+//   and directories
+// =====================================
+bool read_esp(FILE *image) {
+    Vbr vbr = { 0 };
+    if (read_at(image, &vbr, sizeof vbr, esp_lba * lba_size) != sizeof vbr ||
+        vbr.bootsect_sig != 0xAA55 || vbr.BPB_BytesPerSec != lba_size || 
+        vbr.BPB_SecPerClus == 0 || vbr.BPB_NumFATs == 0 || 
+        vbr.BPB_FATSz16 != 0 || vbr.BPB_FATSz32 == 0) {
+        fprintf(stderr, "Error: ESP does not have a valid FAT32 VBR\n");
+        return false;
+    }
+
+    FSInfo fsinfo = { 0 };
+    if (read_at(image, &fsinfo, sizeof fsinfo, (esp_lba + vbr.BPB_FSInfo) * lba_size) != sizeof fsinfo ||
+        fsinfo.FSI_LeadSig != 0x41615252 || fsinfo.FSI_StrucSig != 0x61417272) {
+        fprintf(stderr, "Error: ESP does not have a valid FAT32 FSInfo sector\n");
+        return false;
+    }
+
+    if (!init_esp_staging(&vbr, &fsinfo)) return false;
+
+    // Read 1st FAT, FATs are mirrored
+    const uint64_t fat_size = (uint64_t)esp.fat_entries * sizeof *esp.fat;
+    if (read_at(image, esp.fat, fat_size, fat32_fats_lba * lba_size) != fat_size) {
+        fprintf(stderr, "Error: Could not read ESP FAT\n");
+        return false;
+    }
+
+    // Free cluster count & next free values in FSInfo are only hints, get actual values
+    //   from FAT
+    if (!build_free_map()) return false;
+
+    return read_esp_dir(image, vbr.BPB_RootClus);
+}
+
+// =============================
+// Check if a file's data matches an existing ESP file's cluster chain data
+// =============================
+bool esp_file_matches(uint32_t cluster, const uint64_t file_size, FILE *file, FILE *image) {
+    uint8_t *image_buf = malloc(COPY_BUFFER_SIZE), *file_buf = malloc(COPY_BUFFER_SIZE);
+    bool result = image_buf && file_buf;
+
+    fflush(image);
+    uint64_t pos = 0;
+    while (result && pos < file_size) {
+        if (cluster < 2 || cluster > esp.max_cluster) {
+            result = false;
+            break;
+        }
+
+        // Get run of contiguous clusters, up to buffer size
+        const uint32_t run_start = cluster;
+        uint64_t run_size = esp.cluster_size;
+        cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        while (cluster == run_start + (run_size / esp.cluster_size) && 
+               run_size + esp.cluster_size <= COPY_BUFFER_SIZE && pos + run_size < file_size) {
+            run_size += esp.cluster_size;
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        }
+        if (run_size > file_size - pos) run_size = file_size - pos;
+
+        result = read_at(image, image_buf, run_size, cluster_to_lba(run_start) * lba_size) == run_size &&
+                 read_at(file, file_buf, run_size, pos) == run_size &&
+                 !memcmp(image_buf, file_buf, run_size);
+        pos += run_size;
+    }
+
+    free(image_buf);
+    free(file_buf);
+    return result;
+}
+
+// =============================
+// Replace an existing file's data in the ESP, if it has changed
+// =============================
+bool replace_file_in_esp(FAT32_Dir_Entry_Short *dir_entry, FILE *file, FILE *image, bool *changed) {
+    const uint64_t file_size_bytes = get_file_size(file);
+    if (file_size_bytes > UINT32_MAX) {
+        fprintf(stderr, "Error: '%.11s' is 4 GiB or larger, too large for a FAT32 file\n", 
+                dir_entry->DIR_Name);
+        return false;
+    }
+
+    uint32_t cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+
+    *changed = false;
+    if (file_size_bytes == dir_entry->DIR_FileSize && 
+        esp_file_matches(cluster, file_size_bytes, file, image))
+        return true;
+
+    // Free old file data, and add new file data
+    *changed = true;
+    free_cluster_chain(cluster);
+
+    // Empty files have no clusters, and a first cluster of 0
+    cluster = 0;
+    if (file_size_bytes > 0) {
+        cluster = allocate_clusters(bytes_to_clusters(file_size_bytes));
+        if (!cluster) {
+            fprintf(stderr, "Error: Not enough free space in ESP for '%.11s'\n", dir_entry->DIR_Name);
+            return false;
+        }
+
+        // New file data is copied after all files are laid out
+        if (!queue_copy_job(copy_source_path, file_size_bytes, cluster, 0)) return false;
+    }
+
+    uint16_t fat_time, fat_date;
+    get_fat_dir_entry_time_date(&fat_time, &fat_date);
+    dir_entry->DIR_WrtTime = fat_time;
+    dir_entry->DIR_WrtDate = fat_date;
+    dir_entry->DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+    dir_entry->DIR_FstClusLO = cluster & 0xFFFF;
+    dir_entry->DIR_FileSize = file_size_bytes;
+
+    return true;
+}
+
+// =============================
+// Add a new directory or file to a given parent directory; a new directory
+//   gets room for at least dir_entries entries
+// =============================
+bool add_file_to_esp(char *file_name, FILE *file, File_Type type, uint32_t *parent_dir_cluster,
+                     const uint32_t dir_entries) {
+    // Get file size of file
+    uint64_t file_size_bytes = 0, file_size_clusters = 1;
+    if (type == TYPE_DIR) {
+        file_size_clusters = bytes_to_clusters((uint64_t)dir_entries * sizeof(FAT32_Dir_Entry_Short));
+        if (file_size_clusters == 0) file_size_clusters = 1;
+    } else {
+        // FAT32 file sizes are 32 bits; only the data partition can hold larger files
+        file_size_bytes = get_file_size(file);
+        if (file_size_bytes > UINT32_MAX) {
+            fprintf(stderr, "Error: '%.11s' is 4 GiB or larger, too large for a FAT32 file; "
+                            "add it to the data partition instead\n", file_name);
+            return false;
+        }
+        // Empty files have no clusters, and a first cluster of 0
+        file_size_clusters = bytes_to_clusters(file_size_bytes);
+    }
+
+    // Find free directory entry in parent directory
+    Esp_Dir *parent_dir = find_esp_dir(*parent_dir_cluster);
+    if (!parent_dir) {
+        fprintf(stderr, "Error: Could not find ESP directory at cluster %u\n", *parent_dir_cluster);
+        return false;
+    }
+
+    // Get clusters for new dir/file
+    const uint32_t starting_cluster = file_size_clusters ? allocate_clusters(file_size_clusters) : 0;
+    if (file_size_clusters && !starting_cluster) {
+        fprintf(stderr, "Error: Not enough free space in ESP for '%.11s'\n", file_name);
+        return false;
+    }
+
+    // Add new directory entry for this new dir/file in first free entry, which may
+    //   be a deleted file's entry; parent directory grows if full
+    FAT32_Dir_Entry_Short *dir_entry = new_dir_entry(parent_dir);
+    if (!dir_entry) {
+        fprintf(stderr, "Error: No free directory entries left for '%.11s'\n", file_name);
+        free_cluster_chain(starting_cluster);
+        return false;
+    }
+
+    // Set 8.3 file name
+    memcpy(dir_entry->DIR_Name, file_name, 11);
+    index_dir_entry(parent_dir, dir_entry - (FAT32_Dir_Entry_Short *)parent_dir->data);
+
+    if (type == TYPE_DIR) dir_entry->DIR_Attr = ATTR_DIRECTORY;
+
+    uint16_t fat_time, fat_date;
+    get_fat_dir_entry_time_date(&fat_time, &fat_date);
+    dir_entry->DIR_CrtTime = fat_time;
+    dir_entry->DIR_CrtDate = fat_date;
+    dir_entry->DIR_WrtTime = fat_time;
+    dir_entry->DIR_WrtDate = fat_date;
+
+    dir_entry->DIR_FstClusHI = (starting_cluster >> 16) & 0xFFFF;
+    dir_entry->DIR_FstClusLO = starting_cluster & 0xFFFF;
+
+    if (type == TYPE_FILE)
+        dir_entry->DIR_FileSize = file_size_bytes;
+
+    // Add new file data
+    // For directory add dir_entrys for "." and ".."
+    if (type == TYPE_DIR) {
+        Esp_Dir *new_dir = new_esp_dir(starting_cluster, file_size_clusters);
+        if (!new_dir) {
+            fprintf(stderr, "Error: Could not allocate memory for ESP directory '%.11s'\n", 
+                    file_name);
+            return false;
+        }
+        FAT32_Dir_Entry_Short *dot_entry = new_dir_entry(new_dir);
+        *dot_entry = *dir_entry;
+        memcpy(dot_entry->DIR_Name, ".          ", 11);  // "." dir_entry; this directory itself
+
+        FAT32_Dir_Entry_Short *dotdot_entry = new_dir_entry(new_dir);
+        *dotdot_entry = *dir_entry;
+        memcpy(dotdot_entry->DIR_Name, "..         ", 11);  // ".." dir_entry; parent directory
+
+        // Root directory does not have a cluster value
+        const uint32_t dotdot_cluster = 
+            *parent_dir_cluster == esp.vbr.BPB_RootClus ? 0 : *parent_dir_cluster;
+        dotdot_entry->DIR_FstClusHI = (dotdot_cluster >> 16) & 0xFFFF;
+        dotdot_entry->DIR_FstClusLO = dotdot_cluster & 0xFFFF;
+    } else {
+        // For file, add file data to this new file's cluster's data location in data region;
+        //   this is copied after all files are laid out
+        if (file_size_bytes > 0 && 
+            !queue_copy_job(copy_source_path, file_size_bytes, starting_cluster, 0)) 
+            return false;
+    }
+
+    // Set dir_cluster for new parent dir, if a directory was just added
+    if (type == TYPE_DIR)
+        *parent_dir_cluster = starting_cluster;
+
+    return true;
+}
+
+// =============================
+// Add a file path to the EFI System Partition;
+//   will add new directories if not found, and
+//   new file at end of path
+// =============================
+bool add_path_to_esp(char *path, FILE *file, FILE *image) {
+    // Parse input path for each name
+    if (*path != '/') return false; // Path must begin with root '/'
+
+    // Uppercase path for that smooth DOS feel, but probably doesn't matter for any modern UEFI
+    //   or FAT implementations
+    for (size_t i = 0; i < strlen(path); i++) 
+        path[i] = toupper(path[i]);
+
+    File_Type type = TYPE_DIR;
+    char *start = path + 1; // Skip initial slash
+    char *end = start;
+    uint32_t dir_cluster = esp.vbr.BPB_RootClus;    // Next directory's cluster location; start at root
+    bool any_files_added = false, file_updated = false;
+
+    // Get next name from path, until reached end of path for file to add
+    while (type == TYPE_DIR) {
+        while (*end != '/' && *end != '\0') end++;
+
+        if (*end == '/') type = TYPE_DIR;
+        else             type = TYPE_FILE;  // Reached end of path
+
+        *end = '\0';    // Null terminate next name in case of directory
+
+
+        char *dot_pos = strchr(start, '.');
+        if ((type == TYPE_DIR  && strlen(start) > 11) ||
+            (type == TYPE_FILE && strlen(start) > 12) || 
+            (dot_pos && ((dot_pos - start > 8) ||           // Name 8 too long
+                         (end - dot_pos) > 4))) {           // Ext 3 too long
+            // Name is too long or invalid 8.3 naming
+            fprintf(stderr, "WARNING: Name '%s' is too long for 8.3 naming. Truncating to fit.\n",
+                    start);
+
+            if (dot_pos) dot_pos[4] = '\0';  // Truncate file name
+            else {
+                // Directory
+                size_t diff = strlen(start) - 11;   // Get name overlength amount
+
+                *end = '/';                 // End new name
+                char *next_start = end+1;   // Start of next name in path
+
+                // Truncate directory name by shifting rest of path back
+                memmove(start+12, next_start, strlen(next_start));
+
+                // Set new end of full path by shortened amount
+                *(path + strlen(path) - diff) = '\0';   
+
+                end = start+11;
+                *end = '\0';    // End new name
+            }
+        }
+
+        // Convert file name to 8.3 name before checking if exists
+        // e.g. "FOO.BAR"  -> "FOO     BAR" 
+        //      "BA.Z"     -> "BA      Z  " 
+        //      "ELEPHANT" -> "ELEPHANT   "
+        char short_name[12] = {0};
+        memset(short_name, ' ', 11);
+        if (type == TYPE_DIR || !dot_pos)  {
+            memcpy(short_name, start, strlen(start));  // No '.', copy full name
+        } else {
+            memcpy(short_name, start, dot_pos - start); // Name 8 in 8.3
+            strncpy(&short_name[8], dot_pos+1, 3);      // Extension 3 in 8.3
+        }
+
+        // Directory that will hold the file gets room for the expected # of entries
+        const bool last_dir = type == TYPE_DIR && !strchr(end + 1, '/');
+        const uint32_t dir_entries = last_dir ? esp_dir_hint : 0;
+
+        // Search for name in current directory's file data (dir_entrys)
+        Esp_Dir *dir = find_esp_dir(dir_cluster);
+        if (!dir) return false;
+
+        FAT32_Dir_Entry_Short *dir_entry = find_dir_entry(dir, (uint8_t *)short_name);
+        const bool found = dir_entry != NULL;
+        if (found) {
+            // Found name in directory, save cluster for last directory found
+            dir_cluster = (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO;
+
+            Esp_Dir *found_dir = last_dir ? find_esp_dir(dir_cluster) : NULL;
+            if (found_dir && dir_entries > found_dir->num_entries && !grow_esp_dir(found_dir, dir_entries))
+                return false;
+        }
+
+        if (found && update && type == TYPE_FILE) {
+            // Updating an existing image; replace file if it has changed
+            if (dir_entry->DIR_Attr & ATTR_DIRECTORY) {
+                fprintf(stderr, "Error: '%s' is a directory in the ESP\n", start);
+                return false;
+            }
+
+            if (!replace_file_in_esp(dir_entry, file, image, &file_updated))
+                return false;
+
+            if (file_updated) dir->dirty = true;
+        }
+
+        if (!found) {
+            // Add new directory or file to last found directory;
+            //   if new directory, update current directory cluster to check/use
+            //   for next new files 
+            if (!add_file_to_esp(short_name, file, type, &dir_cluster, dir_entries))
+                return false;
+
+            any_files_added = true;
+        }
+
+        *end++ = '/';
+        start = end;
+    }
+
+    *--end = '\0';  // Don't add extra slash to end of path, final file name is not a directory
+
+    // Show info to user; nothing is written until all files are laid out
+    if (any_files_added) printf("Planned '%s' for EFI System Partition\n", path);
+    else if (file_updated) printf("Planned update of '%s' in EFI System Partition\n", path);
+    else if (update) printf("'%s' is unchanged in EFI System Partition\n", path);
+
+    return true;
+}
+
+// =============================
+// Remove a file or empty directory from the EFI System Partition, 
+//   and free its clusters
+// =============================
+bool remove_path_from_esp(char *path) {
+    Esp_Dir *dir = NULL;
+    FAT32_Dir_Entry_Short *dir_entry = NULL;
+    uint32_t dir_cluster = 0;
+    if (!find_esp_path(path, &dir, &dir_entry, &dir_cluster)) {
+        fprintf(stderr, "Error: '%s' not found in EFI System Partition\n", path);
+        return false;
+    }
+
+    if (!dir_entry) {
+        fprintf(stderr, "Error: Can't remove root directory of EFI System Partition\n");
+        return false;
+    }
+
+    if (dir_entry->DIR_Attr & ATTR_DIRECTORY) {
+        // Only remove empty directories
+        Esp_Dir *sub_dir = find_esp_dir(dir_cluster);
+        if (!sub_dir) return false;
+
+        const FAT32_Dir_Entry_Short *entry = (FAT32_Dir_Entry_Short *)sub_dir->data;
+        const FAT32_Dir_Entry_Short *dir_end = entry + sub_dir->num_entries;
+        for (; entry < dir_end && entry->DIR_Name[0] != '\0'; entry++) {
+            if (entry->DIR_Name[0] != 0xE5 && entry->DIR_Name[0] != '.') {
+                fprintf(stderr, "Error: Directory '%s' is not empty\n", path);
+                return false;
+            }
+        }
+        free_esp_dir(dir_cluster);
+    }
+
+    // Mark entry as deleted, along with any long name entries before it, and free its clusters
+    if (dir_cluster != 0) free_cluster_chain(dir_cluster);
+
+    dir_entry->DIR_Name[0] = 0xE5;
+    for (FAT32_Dir_Entry_Short *entry = dir_entry - 1; 
+         entry >= (FAT32_Dir_Entry_Short *)dir->data && 
+         (entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME && entry->DIR_Name[0] != 0xE5;
+         entry--) {
+        entry->DIR_Name[0] = 0xE5;
+    }
+    dir->dirty = true;
+    if (!index_esp_dir(dir)) return false;
+
+    printf("Planned removal of '%s' from EFI System Partition\n", path);
     return true;
 }
 
+// =========================================================================
+// Get disk image info file, creating it on first use; for a dry run it is a
+//   temporary file instead, so nothing is written
+// =========================================================================
+FILE *get_info_file(void) {
+    if (!info_file) info_file = dry_run ? tmpfile() : fopen("FILE.TXT", "wb+");
+    if (!info_file) fprintf(stderr, "Error: Could not open file 'FILE.TXT'\n");
+    return info_file;
+}
+
 // =========================================================================
 // Add disk image info file to hold at minimum the size of this disk image
 // =========================================================================
-bool add_disk_image_info_file(FILE *image) {
-    FILE *fp = NULL;
-    if (!opened_info_file) {
-        opened_info_file = true;
-        fp = fopen("FILE.TXT", "wb");  // Truncate on first open
+bool add_disk_image_info_file(FILE *image, const uint64_t disk_size) {
+    FILE *fp = get_info_file();
+    if (!fp) return false;
+
+    fprintf(fp, "DISK_SIZE=%"PRIu64"\n", disk_size);
+    if (fflush(fp) != 0) return false;
+    rewind(fp);
+
+    char path[25] = { 0 };
+    strcpy(path, "/EFI/BOOT/FILE.TXT");
+    copy_source_path = "FILE.TXT";
+    const bool result = add_path_to_esp(path, fp, image);
+
+    // File data is copied later from the closed file
+    fclose(fp);
+    info_file = NULL;
+
+    return result;
+}
+
+// ======================================
+// Add file to the Basic Data Partition; its range in the partition is set
+//   here, and its data is copied after all files are laid out
+// ======================================
+bool add_file_to_data_partition(char *filepath) {
+    // Will save location of next spot to put a file in
+    static uint64_t starting_lba = 0;
+
+    FILE *fp = fopen(filepath, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filepath);
+        return false;
+    }
+
+    // Get file size 
+    uint64_t file_size_bytes = 0, file_size_lbas = 0;
+    file_size_bytes = get_file_size(fp);
+    file_size_lbas = bytes_to_lbas(file_size_bytes);
+    fclose(fp);
+
+    // To clone the file, it needs to start on a host filesystem block boundary
+    if (reflink) {
+        const uint64_t align_lbas = host_block_size / lba_size;
+        const uint64_t lba = data_lba + starting_lba;
+        starting_lba = ((lba + align_lbas - 1) / align_lbas * align_lbas) - data_lba;
+    }
+
+    // Check if adding next file will overrun data partition size
+    if ((starting_lba + file_size_lbas) * lba_size > data_size) {
+        fprintf(stderr, 
+                "Error: Can't add file %s to Data Partition; "
+                "Data Partition size is %"PRIu64 "(%"PRIu64" LBAs) and all files added "
+                "would overrun this size\n",
+                filepath,
+                data_size, data_size_lbas);
+        return false;
+    }
+
+    char *name = NULL;
+    char *slash = strrchr(filepath, '/'); 
+    if (!slash) name = filepath;
+    else name = slash + 1;
+
+    // Index records have a fixed size name; longer names are only in FILE.TXT
+    const bool indexed = strlen(name) < sizeof data_index->record.name;
+    if (!indexed)
+        fprintf(stderr, "WARNING: '%s' is left out of the data partition index, as its name "
+                        "is over %zu chars\n", name, sizeof data_index->record.name - 1);
+
+    // Clone as much of the file as possible, and copy the rest, later
+    const uint64_t offset = (data_lba + starting_lba) * lba_size;
+    if (!queue_copy_job(filepath, file_size_bytes, 0, offset)) return false;
+
+    // Print info to user; nothing is written until all files are laid out
+    printf("Planned '%s' from path '%s' for Data Partition\n", 
+           name,
+           filepath);
+
+    // Add to info file for each file added; "Data (partition) files info"
+    fp = get_info_file();
+    if (!fp) return false;
+
+    fprintf(fp,
+            "FILE_NAME=%s\n"
+            "FILE_SIZE=%"PRIu64"\n"
+            "DISK_LBA=%"PRIu64"\n\n",  // Add extra line between files
+            name,
+            file_size_bytes,
+            data_lba + starting_lba);  // Offset from start of data partition
+
+    // Add to the data partition index; the CRC32 of the file is got from its copy
+    //   job, as it is copied. A file left out of the index has an empty name
+    Data_Index_Entry *entries = grow_array(data_index, num_data_index_entries, sizeof *entries);
+    if (!entries) return false;
+    data_index = entries;
+
+    Data_Index_Entry *entry = &data_index[num_data_index_entries++];
+    *entry = (Data_Index_Entry){
+        .file_path = filepath,
+        .record = {
+            .name_hash = indexed ? data_index_name_hash(name) : 0,
+            .size = file_size_bytes,
+            .lba = data_lba + starting_lba,
+        },
+    };
+    if (indexed) {
+        strcpy(entry->record.name, name);
+        copy_jobs[num_copy_jobs - 1].index_entry = num_data_index_entries;
+    }
+
+    // Set next spot to write a file at
+    starting_lba += file_size_lbas;
+
+    return true;
+}
+
+// ======================================
+// Lay out the data partition index after all data partition files are added; 
+//   the header is in the last lba of the data partition, so it can be found 
+//   without reading anything else, and the hash table of records is right before it
+// ======================================
+bool layout_data_index(void) {
+    uint32_t num_records = 0;
+    for (uint32_t i = 0; i < num_data_index_entries; i++) 
+        if (data_index[i].record.name[0]) num_records++;
+    if (!num_records) return true;
+
+    // At most half the slots are used, so most lookups read only 1 lba of records
+    uint32_t num_slots = lba_size / sizeof(Data_Index_Record);
+    while (num_slots < num_records * 2) num_slots *= 2;
+
+    const uint64_t table_lbas = bytes_to_lbas((uint64_t)num_slots * sizeof(Data_Index_Record));
+    const uint64_t header_lba = data_lba + data_size_lbas - 1;
+    data_index_header = (Data_Index_Header){
+        .version = DATA_INDEX_VERSION,
+        .header_size = sizeof data_index_header,
+        .record_size = sizeof(Data_Index_Record),
+        .num_records = num_records,
+        .num_slots = num_slots,
+        .table_lba = header_lba - table_lbas,
+        .table_lbas = table_lbas,
+    };
+    memcpy(data_index_header.signature, DATA_INDEX_SIGNATURE, sizeof data_index_header.signature);
+
+    // Files are added in order, so the last one ends the furthest in
+    const Data_Index_Record *last = &data_index[num_data_index_entries - 1].record;
+    if (last->lba + bytes_to_lbas(last->size) > data_index_header.table_lba) {
+        fprintf(stderr, "Error: Data partition index needs %"PRIu64" more LBAs after the files "
+                        "added; Data Partition size is %"PRIu64" (%"PRIu64" LBAs)\n",
+                table_lbas + 1, data_size, data_size_lbas);
+        return false;
+    }
+
+    return true;
+}
+
+// =============================
+// Get CRC32 of the first size bytes of a local file
+// =============================
+bool crc32_file_contents(const char *file_path, const uint64_t size, uint32_t *crc) {
+    FILE *file = fopen(file_path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Could not fopen file '%s'\n", file_path);
+        return false;
+    }
+
+    uint8_t *buf = malloc(COPY_BUFFER_SIZE);
+    bool result = buf != NULL;
+    *crc = 0;
+    for (uint64_t left = size; result && left > 0; ) {
+        const size_t chunk = left < COPY_BUFFER_SIZE ? left : COPY_BUFFER_SIZE;
+        if (fread(buf, 1, chunk, file) != chunk) {
+            fprintf(stderr, "Error: Could not read file '%s'\n", file_path);
+            result = false;
+            break;
+        }
+        *crc = update_crc32(*crc, buf, chunk);
+        left -= chunk;
+    }
+
+    free(buf);
+    fclose(file);
+    return result;
+}
+
+// ======================================
+// Write the data partition index; records go in hash table slots in the order the 
+//   files were added, so lookups of the same name find the first file added
+// ======================================
+bool write_data_index(FILE *image) {
+    if (!data_index_header.num_records) return true;
+
+    const uint64_t size = (data_index_header.table_lbas + 1) * lba_size;
+    uint8_t *buf = calloc(1, size);
+    if (!buf) {
+        fprintf(stderr, "Error: Could not allocate memory for data partition index\n");
+        return false;
+    }
+
+    Data_Index_Record *slots = (Data_Index_Record *)buf;
+    bool result = true;
+    for (uint32_t i = 0; result && i < num_data_index_entries; i++) {
+        Data_Index_Entry *entry = &data_index[i];
+        if (!entry->record.name[0]) continue;
+
+        // CRC32 is read from the file if it wasn't got while copying, e.g. for a 
+        //   streamed image
+        if (!entry->has_crc32) {
+            uint32_t crc = 0;
+            result = crc32_file_contents(entry->file_path, entry->record.size, &crc);
+            entry->record.crc32 = crc;
+            entry->has_crc32 = result;
+        }
+
+        uint32_t slot = entry->record.name_hash & (data_index_header.num_slots - 1);
+        while (slots[slot].name[0]) slot = (slot + 1) & (data_index_header.num_slots - 1);
+        slots[slot] = entry->record;
+    }
+
+    Data_Index_Header *header = (Data_Index_Header *)(buf + (data_index_header.table_lbas * lba_size));
+    *header = data_index_header;
+    header->table_crc32 = calculate_crc32(slots, (uint64_t)header->num_slots * sizeof *slots);
+    header->header_crc32 = calculate_crc32(header, sizeof *header);
+
+    result = result && write_at(image, buf, size, data_index_header.table_lba * lba_size);
+    free(buf);
+    return result;
+}
+
+// ======================================
+// Add the content files of partitions after the data partition; each is copied 
+//   to the start of its partition after all files are laid out
+// ======================================
+bool add_partition_files(void) {
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        const Partition *partition = &partitions[i];
+        if (!partition->file_path) continue;
+
+        if (!queue_copy_job(partition->file_path, partition->file_size, 0, partition->lba * lba_size)) 
+            return false;
+
+        printf("Planned '%s' for partition %u\n", partition->file_path, i + 3);
+    }
+
+    return true;
+}
+
+// =============================
+// Add a range of lbas to the layout printed for a dry run
+// =============================
+bool add_plan_extent(Plan_Extent **extents, uint32_t *count, const uint64_t lba, 
+                     const uint64_t num_lbas, const char *name, const char *file_path) {
+    Plan_Extent *new_extents = grow_array(*extents, *count, sizeof *new_extents);
+    if (!new_extents) return false;
+    *extents = new_extents;
+
+    new_extents[(*count)++] = (Plan_Extent){ lba, num_lbas, name, file_path };
+    return true;
+}
+
+// =============================
+// Add each run of contiguous clusters in an ESP cluster chain to the layout
+//   printed for a dry run
+// =============================
+bool add_plan_chain(Plan_Extent **extents, uint32_t *count, uint32_t cluster, 
+                    uint64_t num_clusters, const char *name, const char *file_path) {
+    while (num_clusters > 0 && cluster >= 2 && cluster <= esp.max_cluster) {
+        const uint32_t run_start = cluster;
+        uint64_t run_size = 0;
+        do {
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+            run_size++;
+        } while (run_size < num_clusters && cluster == run_start + run_size);
+
+        if (!add_plan_extent(extents, count, cluster_to_lba(run_start), 
+                             run_size * esp.vbr.BPB_SecPerClus, name, file_path))
+            return false;
+        num_clusters -= run_size;
+    }
+
+    return true;
+}
+
+// =============================
+// Compare 2 layout ranges for sorting by lba
+// =============================
+int compare_plan_extents(const void *a, const void *b) {
+    const uint64_t lba_a = ((const Plan_Extent *)a)->lba, lba_b = ((const Plan_Extent *)b)->lba;
+    return (lba_a > lba_b) - (lba_a < lba_b);
+}
+
+// =============================
+// Print lba ranges of everything that would be written to the image, in lba 
+//   order, for a dry run; for an update, only the changes are shown
+// =============================
+bool print_plan(void) {
+    Plan_Extent *extents = NULL;
+    uint32_t count = 0;
+    bool result = true;
+
+    if (!update) {
+        result = add_plan_extent(&extents, &count, 0, 1, "Protective MBR", NULL) &&
+                 add_plan_extent(&extents, &count, 1, 1 + gpt_table_lbas, 
+                                 "Primary GPT header & table", NULL) &&
+                 add_plan_extent(&extents, &count, esp_lba, esp.vbr.BPB_RsvdSecCnt, 
+                                 "ESP VBR, FSInfo & backup VBR", NULL) &&
+                 add_plan_extent(&extents, &count, image_size_lbas - 1 - gpt_table_lbas, 
+                                 gpt_table_lbas + 1, "Backup GPT table & header", NULL);
+    }
+
+    result = result && 
+             add_plan_extent(&extents, &count, fat32_fats_lba, 
+                             (uint64_t)esp.vbr.BPB_NumFATs * esp.vbr.BPB_FATSz32, "ESP FATs", NULL);
+
+    for (uint32_t i = 0; result && i < esp.num_dirs; i++) {
+        if (esp.dirs[i]->dirty)
+            result = add_plan_chain(&extents, &count, esp.dirs[i]->cluster, esp.dirs[i]->num_clusters, 
+                                    "ESP directory", NULL);
+    }
+
+    for (uint32_t i = 0; result && i < num_copy_jobs; i++) {
+        const Copy_Job *job = &copy_jobs[i];
+        if (job->cluster) {
+            const uint64_t num_clusters = bytes_to_clusters(job->size);
+            result = add_plan_chain(&extents, &count, job->cluster, num_clusters, "ESP file ", 
+                                    job->file_path);
+        } else {
+            const bool in_data = job->offset < (data_lba + data_size_lbas) * lba_size;
+            result = add_plan_extent(&extents, &count, job->offset / lba_size, bytes_to_lbas(job->size),
+                                     in_data ? "Data partition file " : "Partition file ", 
+                                     job->file_path);
+        }
+    }
+
+    if (result && data_index_header.num_records) 
+        result = add_plan_extent(&extents, &count, data_index_header.table_lba, 
+                                 data_index_header.table_lbas + 1, "Data partition index", NULL);
+
+    if (result) {
+        qsort(extents, count, sizeof *extents, compare_plan_extents);
+
+        printf("\n%-20s %-20s %s\n", "START LBA", "# LBAS", "CONTENTS");
+        for (uint32_t i = 0; i < count; i++) {
+            printf("%-20"PRIu64" %-20"PRIu64" %s", extents[i].lba, extents[i].num_lbas, extents[i].name);
+            if (extents[i].file_path) printf("'%s'", extents[i].file_path);
+            printf("\n");
+        }
+
+        const uint64_t total_clusters = esp.max_cluster - 1;
+        printf("\nESP: %"PRIu64" of %"PRIu64" clusters used, %"PRIu64" bytes per cluster\n",
+               total_clusters - esp.free_count, total_clusters, esp.cluster_size);
+    }
+
+    free(extents);
+    return result;
+}
+
+// =============================
+// Get a fingerprint of a local file's identity and last change, without reading 
+//   it; 0 if the file doesn't exist
+// =============================
+uint64_t get_file_fingerprint(const char *file_path) {
+    struct stat st;
+    if (stat(file_path, &st) != 0) return 0;
+
+    const uint64_t identity[] = {
+        st.st_dev, st.st_ino, st.st_size, st.st_mtime, st.st_ctime,
+#if !defined(_WIN32)
+        st.st_mtim.tv_nsec, st.st_ctim.tv_nsec,
+#endif
+    };
+    const uint64_t hash = fnv1a_64(FNV_OFFSET_BASIS, identity, sizeof identity);
+    return hash ? hash : 1;
+}
+
+// =============================
+// Get hash of the options that change the image contents, and the names of all
+//   files given to add; done before files are added, as adding them changes paths
+// =============================
+uint64_t get_options_hash(const Options *options) {
+    const int64_t values[] = { options->vhd, options->reproducible, source_date_epoch };
+    uint64_t hash = fnv1a_64(FNV_OFFSET_BASIS, values, sizeof values);
+
+    if (options->seed) hash = fnv1a_64(hash, options->seed, strlen(options->seed) + 1);
+
+    for (uint32_t i = 0; i < options->num_esp_files; i++) {
+        const Esp_File *esp_file = &options->esp_files[i];
+        hash = fnv1a_64(hash, esp_file->esp_path, strlen(esp_file->esp_path) + 1);
+        hash = fnv1a_64(hash, esp_file->file_path, strlen(esp_file->file_path) + 1);
+    }
+
+    for (uint32_t i = 0; i < options->num_data_files; i++)
+        hash = fnv1a_64(hash, options->data_files[i], strlen(options->data_files[i]) + 1);
+
+    return hash;
+}
+
+// =============================
+// Add a range of the image to a build cache state
+// =============================
+bool add_cache_extent(Cache_State *state, const uint64_t offset, const uint64_t size, 
+                      const uint64_t fingerprint) {
+    Cache_Extent *extents = grow_array(state->extents, state->num_extents, sizeof *extents);
+    if (!extents) return false;
+    state->extents = extents;
+
+    state->extents[state->num_extents++] = (Cache_Extent){ 
+        .offset = offset, 
+        .size = size, 
+        .fingerprint = fingerprint,
+    };
+    return true;
+}
+
+// =============================
+// Get build cache state of the image as it is laid out; a key for all options and 
+//   inputs, and where each file and ESP directory cluster goes
+// =============================
+bool get_cache_state(const uint64_t options_hash, Cache_State *state) {
+    *state = (Cache_State){ .layout = get_layout_hash() };
+    state->key = fnv1a_64(options_hash, &state->layout, sizeof state->layout);
+
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        const Copy_Job *job = &copy_jobs[i];
+
+        // Image info file is written again every build, so use its contents
+        uint64_t fingerprint = 0;
+        if (!strcmp(job->file_path, "FILE.TXT")) {
+            fingerprint = FNV_OFFSET_BASIS;
+            if (!hash_file_contents(job->file_path, job->size, &fingerprint)) return false;
+        } else {
+            fingerprint = get_file_fingerprint(job->file_path);
+        }
+
+        if (!add_cache_extent(state, job->offset, job->size, fingerprint)) return false;
+        state->extents[i].index_entry = job->index_entry;
+
+        // Only where each file goes and its identity are part of the key
+        state->key = fnv1a_64(state->key, &state->extents[i], offsetof(Cache_Extent, crc32));
+    }
+
+    for (uint32_t i = 0; i < esp.num_dirs; i++) {
+        uint32_t cluster = esp.dirs[i]->cluster;
+        for (uint32_t j = 0; j < esp.dirs[i]->num_clusters; j++) {
+            if (!add_cache_extent(state, cluster_to_lba(cluster) * lba_size, esp.cluster_size, 0))
+                return false;
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        }
+    }
+
+    // Data partition index is written again every build, so an old one is cleared first
+    if (data_index_header.num_records && 
+        !add_cache_extent(state, data_index_header.table_lba * lba_size, 
+                          (data_index_header.table_lbas + 1) * lba_size, 0))
+        return false;
+
+    return true;
+}
+
+// =============================
+// Get path of a file in the build cache directory, named by a hash value
+// =============================
+char *get_cache_path(const uint64_t hash, const char *suffix) {
+    const size_t size = strlen(cache_dir) + 1 + 16 + strlen(suffix) + 1;
+    char *path = malloc(size);
+    if (!path) {
+        fprintf(stderr, "Error: Could not allocate memory for file path\n");
+        return NULL;
+    }
+
+    snprintf(path, size, "%s/%016"PRIx64"%s", cache_dir, hash, suffix);
+    return path;
+}
+
+// =============================
+// Read build cache state of an image from the last time it was built
+// =============================
+bool read_cache_state(const char *state_path, Cache_State *state) {
+    *state = (Cache_State){ 0 };
+
+    FILE *fp = fopen(state_path, "r");
+    if (!fp) return false;
+
+    bool result = fscanf(fp, "KEY=%"SCNx64"\nLAYOUT=%"SCNx64"\nIMAGE=%"SCNx64"\n", 
+                         &state->key, &state->layout, &state->image) == 3;
+
+    // Data partition files also have the CRC32 of their data
+    char line[128];
+    while (result && fgets(line, sizeof line, fp)) {
+        Cache_Extent extent = { 0 };
+        const int fields = sscanf(line, "EXTENT %"SCNu64" %"SCNu64" %"SCNx64" %"SCNx32, 
+                                  &extent.offset, &extent.size, &extent.fingerprint, &extent.crc32);
+        result = fields >= 3 && add_cache_extent(state, extent.offset, extent.size, extent.fingerprint);
+        if (result && fields == 4) {
+            state->extents[state->num_extents - 1].crc32 = extent.crc32;
+            state->extents[state->num_extents - 1].has_crc32 = true;
+        }
+    }
+
+    result = result && feof(fp);
+    fclose(fp);
+    return result;
+}
+
+// =============================
+// Write build cache state of an image, after it is built
+// =============================
+bool write_cache_state(const char *state_path, const Cache_State *state) {
+    FILE *fp = fopen(state_path, "w");
+    if (!fp) return false;
+
+    fprintf(fp, "KEY=%016"PRIx64"\nLAYOUT=%016"PRIx64"\nIMAGE=%016"PRIx64"\n", 
+            state->key, state->layout, state->image);
+
+    for (uint32_t i = 0; i < state->num_extents; i++) {
+        const Cache_Extent *extent = &state->extents[i];
+        fprintf(fp, "EXTENT %"PRIu64" %"PRIu64" %016"PRIx64, 
+                extent->offset, extent->size, extent->fingerprint);
+        if (extent->has_crc32) fprintf(fp, " %08"PRIx32, extent->crc32);
+        fprintf(fp, "\n");
+    }
+
+    return fclose(fp) == 0;
+}
+
+// =============================
+// Clone a whole file to a new path, sharing its data blocks; the new file is 
+//   only put in place if the clone succeeds. Returns false if reflinks are not 
+//   supported here
+// =============================
+bool clone_whole_file(const char *src_path, const char *dst_path) {
+#if defined(__linux__) && defined(FICLONE)
+    char *tmp_path = join_strings(dst_path, ".tmp");
+    if (!tmp_path) return false;
+
+    bool result = false;
+    const int src_fd = open(src_path, O_RDONLY);
+    if (src_fd >= 0) {
+        const int dst_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (dst_fd >= 0) {
+            result = ioctl(dst_fd, FICLONE, src_fd) == 0;
+            result = close(dst_fd) == 0 && result;
+            result = result && rename(tmp_path, dst_path) == 0;
+            if (!result) unlink(tmp_path);
+        }
+        close(src_fd);
+    }
+
+    free(tmp_path);
+    return result;
+#else
+    (void)src_path, (void)dst_path;
+    return false;
+#endif
+}
+
+// =============================
+// Set or clear a range of the image to zeros; for a sparse image this leaves a 
+//   hole where possible
+// =============================
+bool zero_range(FILE *image, const uint64_t offset, const uint64_t size) {
+    static const uint8_t zeros[65536] = { 0 };
+
+    fflush(image);
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (sparse && fallocate(fileno(image), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+                            offset, size) == 0)
+        return true;
+#endif
+
+    if (!seek_to(image, offset)) return false;
+    for (uint64_t left = size; left > 0; ) {
+        const uint64_t len = left < sizeof zeros ? left : sizeof zeros;
+        if (fwrite(zeros, 1, len, image) != len) return false;
+        left -= len;
+    }
+    return true;
+}
+
+// =============================
+// Compare cache extents by image offset, for qsort() and bsearch()
+// =============================
+int compare_cache_extents(const void *a, const void *b) {
+    const uint64_t offset_a = ((const Cache_Extent *)a)->offset;
+    const uint64_t offset_b = ((const Cache_Extent *)b)->offset;
+    return (offset_a > offset_b) - (offset_a < offset_b);
+}
+
+// =============================
+// Get the CRC32s of data partition files unchanged since the last build from its
+//   cache state, so they aren't got again for the data partition index
+// =============================
+void get_cached_crc32s(Cache_State *old_state, const Cache_State *new_state) {
+    qsort(old_state->extents, old_state->num_extents, sizeof *old_state->extents, 
+          compare_cache_extents);
+
+    for (uint32_t i = 0; i < new_state->num_extents; i++) {
+        const Cache_Extent *new_extent = &new_state->extents[i];
+        if (!new_extent->index_entry) continue;
+
+        const Cache_Extent *old_extent = bsearch(new_extent, old_state->extents, old_state->num_extents, 
+                                                 sizeof *old_state->extents, compare_cache_extents);
+        if (old_extent && old_extent->has_crc32 && new_extent->fingerprint && 
+            old_extent->size == new_extent->size && old_extent->fingerprint == new_extent->fingerprint) {
+            Data_Index_Entry *entry = &data_index[new_extent->index_entry - 1];
+            entry->record.crc32 = old_extent->crc32;
+            entry->has_crc32 = true;
+        }
+    }
+}
+
+// =============================
+// Add the CRC32s of data partition files to the build cache state, after the 
+//   data partition index is written
+// =============================
+void add_cache_crc32s(Cache_State *state) {
+    for (uint32_t i = 0; i < state->num_extents; i++) {
+        Cache_Extent *extent = &state->extents[i];
+        if (!extent->index_entry) continue;
+
+        const Data_Index_Entry *entry = &data_index[extent->index_entry - 1];
+        extent->crc32 = entry->record.crc32;
+        extent->has_crc32 = entry->has_crc32;
+    }
+}
+
+// =============================
+// Get an existing image ready to be written over with the same layout, keeping
+//   files that are unchanged since it was built. Everything the new image 
+//   doesn't write the same is cleared to zeros first, so the result is the same
+//   as building it from scratch; unchanged files' copy jobs are then dropped
+// =============================
+bool patch_image(FILE *image, Cache_State *old_state, const Cache_State *new_state) {
+    // FATs are always written from scratch
+    if (!zero_range(image, fat32_fats_lba * lba_size, 
+                    (uint64_t)esp.vbr.BPB_NumFATs * esp.vbr.BPB_FATSz32 * lba_size))
+        return false;
+
+    qsort(old_state->extents, old_state->num_extents, sizeof *old_state->extents, 
+          compare_cache_extents);
+
+    // Copy jobs and the new state's first extents are in the same order
+    bool *unchanged = calloc(num_copy_jobs + 1, sizeof *unchanged);
+    if (!unchanged) return false;
+
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        const Cache_Extent *new_extent = &new_state->extents[i];
+        Cache_Extent *old_extent = bsearch(new_extent, old_state->extents, old_state->num_extents, 
+                                           sizeof *old_state->extents, compare_cache_extents);
+        if (old_extent && new_extent->fingerprint && old_extent->size == new_extent->size &&
+            old_extent->fingerprint == new_extent->fingerprint) {
+            unchanged[i] = true;
+            old_extent->fingerprint = UINT64_MAX;   // Keep this extent's data
+        }
+    }
+
+    bool result = true;
+    for (uint32_t i = 0; result && i < old_state->num_extents; i++) {
+        const Cache_Extent *extent = &old_state->extents[i];
+        if (extent->fingerprint != UINT64_MAX) 
+            result = zero_range(image, extent->offset, extent->size);
+    }
+
+    // Drop copy jobs for unchanged files
+    uint32_t num_jobs = 0;
+    for (uint32_t i = 0; i < num_copy_jobs; i++) {
+        if (!unchanged[i]) copy_jobs[num_jobs++] = copy_jobs[i];
+    }
+    printf("PATCHING IMAGE: %u of %u files changed\n", num_jobs, num_copy_jobs);
+    num_copy_jobs = num_jobs;
+
+    // MBR and primary GPT header are written from the start of the image
+    rewind(image);
+
+    free(unchanged);
+    return result;
+}
+
+// =============================
+// Add a copy of a string to the end of a list of strings
+// =============================
+bool add_string_to_list(char ***list, uint32_t *count, const char *str) {
+    char **new_list = grow_array(*list, *count, sizeof *new_list);
+    if (!new_list) return false;
+    *list = new_list;
+
+    new_list[*count] = join_strings(str, "");
+    if (!new_list[*count]) return false;
+
+    (*count)++;
+    return true;
+}
+
+// =============================
+// Check if a local path is a directory
+// =============================
+bool is_directory(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+bool add_esp_file_opt(Options *options, const char *esp_dir, const char *file_path);
+
+// =============================
+// Add all files in a local directory and its subdirectories to an ESP path, 
+//   mirroring the local directory tree under it
+// =============================
+bool add_esp_dir_opt(Options *options, const char *esp_dir, const char *dir_path) {
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        fprintf(stderr, "Error: Could not open directory '%s'\n", dir_path);
+        return false;
+    }
+
+    const bool has_slash = dir_path[strlen(dir_path) - 1] == '/';
+    bool result = true;
+    for (struct dirent *dir_ent = readdir(dir); result && dir_ent; dir_ent = readdir(dir)) {
+        if (!strcmp(dir_ent->d_name, ".") || !strcmp(dir_ent->d_name, "..")) continue;
+
+        char *path = join_strings(dir_path, has_slash ? "" : "/");
+        char *child_path = path ? join_strings(path, dir_ent->d_name) : NULL;
+        free(path);
+        if (!child_path) {
+            result = false;
+            break;
+        }
+
+        if (is_directory(child_path)) {
+            // Subdirectory goes under its own name in the ESP
+            char *sub_dir = join_strings(esp_dir, dir_ent->d_name);
+            char *esp_sub_dir = sub_dir ? join_strings(sub_dir, "/") : NULL;
+            result = esp_sub_dir && add_esp_dir_opt(options, esp_sub_dir, child_path);
+            free(sub_dir);
+            free(esp_sub_dir);
+        } else {
+            result = add_esp_file_opt(options, esp_dir, child_path);
+        }
+        free(child_path);
+    }
+
+    closedir(dir);
+    return result;
+}
+
+// =============================
+// Add a local file to an ESP path, e.g. "/EFI/BOOT/"; a local directory has all
+//   of its files added instead. Files are not opened until they are added
+// =============================
+bool add_esp_file_opt(Options *options, const char *esp_dir, const char *file_path) {
+    // Ensure path starts and ends with a slash '/'
+    if ((esp_dir[0] != '/') || (esp_dir[strlen(esp_dir) - 1] != '/')) {
+        fprintf(stderr, 
+                "Error: All file paths to add to ESP must start and end with slash '/'\n");
+        return false;
+    }
+
+    if (is_directory(file_path)) return add_esp_dir_opt(options, esp_dir, file_path);
+
+    Esp_File *esp_files = grow_array(options->esp_files, options->num_esp_files, sizeof *esp_files);
+    if (!esp_files) return false;
+    options->esp_files = esp_files;
+
+    // Concat file to add to path; Get only last name in path, no folders 
+    const char *slash = strrchr(file_path, '/');
+    Esp_File *esp_file = &esp_files[options->num_esp_files];
+    esp_file->esp_path = join_strings(esp_dir, slash ? slash + 1 : file_path);
+    esp_file->file_path = join_strings(file_path, "");
+    esp_file->index = options->num_esp_files;
+    if (!esp_file->esp_path || !esp_file->file_path) return false;
+
+    options->num_esp_files++;
+    return true;
+}
+
+// =============================
+// Read a manifest file of files to add, 1 per line:
+//   "esp <ESP path> <local file or directory>" adds to the ESP, as with -ae
+//   "data <local file>" adds to the data partition, as with -ad
+// Blank lines and lines starting with '#' are skipped; local paths are the rest
+//   of the line, and can have spaces
+// =============================
+bool read_manifest(Options *options, const char *manifest_path) {
+    FILE *fp = fopen(manifest_path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Error: Could not open manifest file '%s'\n", manifest_path);
+        return false;
+    }
+
+    char line[MAX_MANIFEST_LINE];
+    bool result = true;
+    for (uint32_t line_num = 1; result && fgets(line, sizeof line, fp); line_num++) {
+        size_t len = strlen(line);
+        if (len == sizeof line - 1 && line[len - 1] != '\n' && !feof(fp)) {
+            fprintf(stderr, "Error: Line %u of manifest '%s' is too long\n", line_num, manifest_path);
+            result = false;
+            break;
+        }
+
+        // Trim whitespace from both ends
+        while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+        char *start = line;
+        while (isspace((unsigned char)*start)) start++;
+        if (*start == '\0' || *start == '#') continue;
+
+        // Split off keyword and, for ESP files, the ESP path
+        char *keyword = start;
+        while (*start && !isspace((unsigned char)*start)) start++;
+        if (*start) *start++ = '\0';
+        while (isspace((unsigned char)*start)) start++;
+
+        if (!strcmp(keyword, "esp")) {
+            char *esp_dir = start;
+            while (*start && !isspace((unsigned char)*start)) start++;
+            if (*start) *start++ = '\0';
+            while (isspace((unsigned char)*start)) start++;
+
+            if (*esp_dir && *start) {
+                result = add_esp_file_opt(options, esp_dir, start);
+                continue;
+            }
+        } else if (!strcmp(keyword, "data") && *start) {
+            result = add_string_to_list(&options->data_files, &options->num_data_files, start);
+            continue;
+        }
+
+        fprintf(stderr, "Error: Invalid line %u in manifest '%s'\n", line_num, manifest_path);
+        result = false;
+    }
+
+    fclose(fp);
+    return result;
+}
+
+// =============================
+// Compare the directories of 2 ESP files' paths, for sorting
+// =============================
+int compare_esp_dirs(const void *a, const void *b) {
+    const char *path_a = ((const Esp_File *)a)->esp_path, *path_b = ((const Esp_File *)b)->esp_path;
+    const size_t len_a = strrchr(path_a, '/') - path_a + 1, len_b = strrchr(path_b, '/') - path_b + 1;
+
+    const int result = strncmp(path_a, path_b, len_a < len_b ? len_a : len_b);
+    if (result) return result;
+    return (len_a > len_b) - (len_a < len_b);
+}
+
+// =============================
+// Compare 2 ESP files for sorting by directory, then by order given
+// =============================
+int compare_esp_files(const void *a, const void *b) {
+    int result = compare_esp_dirs(a, b);
+    if (result) return result;
+
+    // Reproducible images add files in path order, not the order given or found in
+    //   host directories
+    if (reproducible) {
+        result = strcmp(((const Esp_File *)a)->esp_path, ((const Esp_File *)b)->esp_path);
+        if (result) return result;
+    }
+
+    const uint32_t index_a = ((const Esp_File *)a)->index, index_b = ((const Esp_File *)b)->index;
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+// =============================
+// Parse a partition size in MiB from the command line; sizes are whole MiB, up
+//   to 4 PiB so byte offsets always fit in 64 bits
+// =============================
+bool parse_size_mib(const char *str, uint32_t *size_mib) {
+    char *end = NULL;
+    const unsigned long long value = strtoull(str, &end, 10);
+    if (!isdigit((unsigned char)*str) || *end || value == 0 || value > UINT32_MAX) {
+        fprintf(stderr, "Error: Invalid size '%s', must be 1-%"PRIu32" MiB\n", str, UINT32_MAX);
+        return false;
+    }
+
+    *size_mib = value;
+    return true;
+}
+
+// =============================
+// Parse a GUID string, e.g. "0FC63DAF-8483-4772-8E79-3D69D8477DE4"
+// =============================
+bool parse_guid(const char *str, Guid *guid) {
+    uint8_t bytes[16] = { 0 };
+    uint8_t num_digits = 0;
+    for (uint8_t i = 0; str[i]; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (str[i] != '-') return false;
+            continue;
+        }
+        if (!isxdigit((unsigned char)str[i]) || num_digits >= 32) return false;
+
+        const uint8_t value = isdigit((unsigned char)str[i]) ? str[i] - '0' : 
+                                                               (toupper((unsigned char)str[i]) - 'A') + 10;
+        bytes[num_digits / 2] |= num_digits % 2 ? value : value << 4;
+        num_digits++;
+    }
+    if (num_digits != 32) return false;
+
+    // 1st 3 fields are stored little endian, the rest as written
+    *guid = (Guid){
+        .time_lo = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | (bytes[2] << 8) | bytes[3],
+        .time_mid = (bytes[4] << 8) | bytes[5],
+        .time_hi_and_ver = (bytes[6] << 8) | bytes[7],
+        .clock_seq_hi_and_res = bytes[8],
+        .clock_seq_lo = bytes[9],
+    };
+    memcpy(guid->node, bytes + 10, sizeof guid->node);
+    return true;
+}
+
+// =============================
+// Parse GPT partition attributes; names or bit numbers joined with '+', e.g.
+//   "required+no-automount" or "0+63"
+// =============================
+bool parse_partition_attributes(char *str, uint64_t *attributes) {
+    static const struct { const char *name; uint8_t bit; } names[] = {
+        { "required", 0 }, { "no-block-io", 1 }, { "legacy-boot", 2 }, { "grow-fs", 59 },
+        { "read-only", 60 }, { "hidden", 62 }, { "no-automount", 63 },
+    };
+
+    *attributes = 0;
+    for (char *token = strtok(str, "+"); token; token = strtok(NULL, "+")) {
+        uint8_t i = 0;
+        while (i < sizeof names / sizeof names[0] && strcmp(token, names[i].name)) i++;
+        if (i < sizeof names / sizeof names[0]) {
+            *attributes |= 1ULL << names[i].bit;
+            continue;
+        }
+
+        // Otherwise a bit number
+        char *end = NULL;
+        const unsigned long bit = strtoul(token, &end, 10);
+        if (!isdigit((unsigned char)*token) || *end || bit > 63) return false;
+        *attributes |= 1ULL << bit;
+    }
+    return true;
+}
+
+// =============================
+// Parse a partition spec from -p; comma separated key=value pairs, e.g.
+//   "type=linux,name=rootfs-a,size=2048,file=rootfs.img". Size is in MiB or 
+//   "fill", and if not given is the content file's size; alignment is in MiB
+// =============================
+bool parse_partition_spec(const char *spec, Partition *partition) {
+    *partition = (Partition){ .type_guid = PARTITION_TYPES[0].guid, .align_mib = 1 };
+
+    char *copy = join_strings(spec, "");
+    if (!copy) return false;
+
+    bool result = true;
+    const char *type_name = PARTITION_TYPES[0].name;
+    char *next = copy;
+    while (result && next) {
+        char *key = next;
+        next = strchr(next, ',');
+        if (next) *next++ = '\0';
+
+        char *value = strchr(key, '=');
+        if (value) *value++ = '\0';
+
+        char *end = NULL;
+        if (!value) {
+            result = false;
+        } else if (!strcmp(key, "type")) {
+            uint8_t i = 0;
+            while (i < sizeof PARTITION_TYPES / sizeof PARTITION_TYPES[0] && 
+                   strcmp(value, PARTITION_TYPES[i].name)) 
+                i++;
+            if (i < sizeof PARTITION_TYPES / sizeof PARTITION_TYPES[0]) {
+                partition->type_guid = PARTITION_TYPES[i].guid;
+                type_name = PARTITION_TYPES[i].name;
+            } else {
+                // All zero type GUID marks an unused GPT entry, which firmware ignores
+                result = parse_guid(value, &partition->type_guid) && 
+                         !is_zero(&partition->type_guid, sizeof partition->type_guid);
+                type_name = "";
+            }
+        } else if (!strcmp(key, "name")) {
+            result = strlen(value) < sizeof partition->name;
+            for (char *c = value; result && *c; c++) 
+                result = *c >= ' ' && *c <= '~';
+            if (result) strcpy(partition->name, value);
+        } else if (!strcmp(key, "size")) {
+            partition->fill = !strcmp(value, "fill");
+            if (!partition->fill) {
+                partition->size_mib = strtoull(value, &end, 10);
+                result = isdigit((unsigned char)*value) && !*end && partition->size_mib > 0 && 
+                         partition->size_mib <= UINT32_MAX;
+            }
+        } else if (!strcmp(key, "align")) {
+            partition->align_mib = strtoull(value, &end, 10);
+            result = isdigit((unsigned char)*value) && !*end && partition->align_mib > 0 && 
+                     partition->align_mib <= 1024;
+        } else if (!strcmp(key, "attrs")) {
+            result = parse_partition_attributes(value, &partition->attributes);
+        } else if (!strcmp(key, "file")) {
+            partition->file_path = join_strings(value, "");
+            result = partition->file_path != NULL;
+        } else {
+            result = false;
+        }
+
+        if (!result) fprintf(stderr, "Error: Invalid partition spec '%s' at '%s'\n", spec, key);
+    }
+
+    // Unnamed partitions are named after their type
+    if (!partition->name[0]) strcpy(partition->name, type_name);
+
+    if (result && !partition->size_mib && !partition->fill && !partition->file_path) {
+        fprintf(stderr, "Error: Partition spec '%s' needs a size or a content file\n", spec);
+        result = false;
+    }
+
+    free(copy);
+    return result;
+}
+
+// =============================
+// Get/parse input arguments from command line
+// =============================
+Options get_opts(int argc, char *argv[]) {
+    Options options = { 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-h") ||
+            !strcmp(argv[i], "--help")) {
+            // Print help text and exit
+            options.help = true;
+            return options;
+        }
+
+        if (!strcmp(argv[i], "-i") ||
+            !strcmp(argv[i], "--image-name")) {
+            // Set name of image, instead of using default name
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.image_name = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-is") ||
+            !strcmp(argv[i], "--image-size")) {
+            // Set size of the whole disk image in MiB, instead of just fitting the partitions
+            if (++i >= argc || !parse_size_mib(argv[i], &options.image_size)) {
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-l") ||
+            !strcmp(argv[i], "--lba-size")) {
+            // Set size of lba/disk sector, instead of default 512 bytes
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.lba_size = strtol(argv[i], NULL, 10);
+
+            if (options.lba_size != 512  &&
+                options.lba_size != 1024 &&
+                options.lba_size != 2048 &&
+                options.lba_size != 4096) {
+                // Error: invalid LBA size
+                fprintf(stderr, "Error: Invalid LBA size, must be one of 512/1024/2048/4096\n");
+                options.error = true;
+                return options;
+            }
+
+            // Enforce minimum size of ESP per LBA size, if given; otherwise the
+            //   ESP is the minimum size
+            if (options.esp_size &&
+                ((options.lba_size == 512  && options.esp_size < 33)  ||
+                 (options.lba_size == 1024 && options.esp_size < 65)  ||
+                 (options.lba_size == 2048 && options.esp_size < 129) ||
+                 (options.lba_size == 4096 && options.esp_size < 257))) {
+
+                fprintf(stderr, "Error: ESP Must be a minimum of 33/65/129/257 MiB for "
+                                "LBA sizes 512/1024/2048/4096 respectively\n");
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-es") ||
+            !strcmp(argv[i], "--esp-size")) {
+            // Set size of EFI System Partition in Megabytes (MiB)
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            // Enforce minimum size of ESP per LBA size
+            if (!parse_size_mib(argv[i], &options.esp_size)) {
+                options.error = true;
+                return options;
+            }
+            if ((options.lba_size == 512  && options.esp_size < 33)  ||
+                (options.lba_size == 1024 && options.esp_size < 65)  ||
+                (options.lba_size == 2048 && options.esp_size < 129) ||
+                (options.lba_size == 4096 && options.esp_size < 257)) {
+
+                fprintf(stderr, "Error: ESP Must be a minimum of 33/65/129/257 MiB for "
+                                "LBA sizes 512/1024/2048/4096 respectively\n");
+                options.error = true;
+                return options;
+            }
+
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-bc") ||
+            !strcmp(argv[i], "--benchmark-crc32")) {
+            // Check and time CRC32 functions for this CPU, then exit
+            options.benchmark_crc32 = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-c") ||
+            !strcmp(argv[i], "--cache")) {
+            // Reuse or patch images from earlier builds, kept in a cache directory
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.cache_dir = argv[i];
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-cs") ||
+            !strcmp(argv[i], "--cluster-size")) {
+            // Set size of ESP clusters in bytes, instead of choosing it from the ESP size
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.cluster_size = strtol(argv[i], NULL, 10);
+
+            // Must be a power of 2, up to 32KiB
+            if (options.cluster_size < 512 || options.cluster_size > MAX_CLUSTER_SIZE ||
+                (options.cluster_size & (options.cluster_size - 1)) != 0) {
+                fprintf(stderr, "Error: Invalid cluster size, must be one of "
+                                "512/1024/2048/4096/8192/16384/32768\n");
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-x") ||
+            !strcmp(argv[i], "--extract")) {
+            // Extract files from an existing image to a local directory, instead of 
+            //   creating one
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+            options.extract_dir = argv[i];
+
+            for (i += 1; i < argc && argv[i][0] != '-'; i++) {
+                if (!add_string_to_list(&options.extract_paths, &options.num_extract_paths, argv[i])) {
+                    options.error = true;
+                    return options;
+                }
+            }
+
+            // Overall for loop will increment i; in order to get next option, decrement here
+            i--;    
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-dv") ||
+            !strcmp(argv[i], "--device")) {
+            // Write the image straight to a block device or file
+            options.device = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-ds") ||
+            !strcmp(argv[i], "--data-size")) {
+            // Set size of EFI System Partition in Megabytes (MiB)
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            if (!parse_size_mib(argv[i], &options.data_size)) {
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-ae") ||
+            !strcmp(argv[i], "--add-esp-files")) {
+            // Add files to the EFI System Partition
+            if (i + 2 >= argc) {
+                // Need at least 2 more args for path & file, for this to work
+                fprintf(stderr, "Error: Must include at least 1 path and 1 file to add to ESP\n");
+                options.error = true;
+                return options;
+            }
+
+            for (i += 1; i + 1 < argc && argv[i][0] != '-'; i += 2) {
+                // Grab next 2 args, 1st will be path to add, 2nd will be file or directory
+                //   to add to path
+                if (!add_esp_file_opt(&options, argv[i], argv[i+1])) {
+                    options.error = true;
+                    return options;
+                }
+            }
+
+            // Overall for loop will increment i; in order to get next option, decrement here
+            i--;    
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-ad") ||
+            !strcmp(argv[i], "--add-data-files")) {
+            // Add files to the Basic Data Partition
+            for (i += 1; i < argc && argv[i][0] != '-'; i++) {
+                if (!add_string_to_list(&options.data_files, &options.num_data_files, argv[i])) {
+                    options.error = true;
+                    return options;
+                }
+            }
+
+            // Overall for loop will increment i; in order to get next option, decrement here
+            i--;    
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-j") ||
+            !strcmp(argv[i], "--jobs")) {
+            // Set # of worker threads to copy file data with
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.jobs = strtol(argv[i], NULL, 10);
+            if (options.jobs < 1 || options.jobs > MAX_JOBS) {
+                fprintf(stderr, "Error: Invalid # of jobs, must be 1-%d\n", MAX_JOBS);
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-ls") ||
+            !strcmp(argv[i], "--list")) {
+            // Print all files in an existing image, instead of creating one
+            options.list = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-m") ||
+            !strcmp(argv[i], "--manifest")) {
+            // Add ESP and data partition files listed in a manifest file
+            if (++i >= argc || !read_manifest(&options, argv[i])) {
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-n") ||
+            !strcmp(argv[i], "--dry-run")) {
+            // Lay out the image and print where everything goes, without writing it
+            options.dry_run = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-p") ||
+            !strcmp(argv[i], "--partition")) {
+            // Add a partition after the data partition
+            Partition *new_partitions = NULL;
+            if (options.num_partitions >= NUMBER_OF_GPT_TABLE_ENTRIES - 2) {
+                fprintf(stderr, "Error: At most %d partitions can be added\n", 
+                        NUMBER_OF_GPT_TABLE_ENTRIES - 2);
+                options.error = true;
+                return options;
+            }
+            if (++i >= argc || !(new_partitions = grow_array(options.partitions, options.num_partitions, 
+                                                             sizeof *new_partitions))) {
+                options.error = true;
+                return options;
+            }
+            options.partitions = new_partitions;
+
+            if (!parse_partition_spec(argv[i], &options.partitions[options.num_partitions++])) {
+                options.error = true;
+                return options;
+            }
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-pa") ||
+            !strcmp(argv[i], "--preallocate")) {
+            // Preallocate ranges of the image that hold data on the host filesystem
+            options.preallocate = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-q") ||
+            !strcmp(argv[i], "--qcow2")) {
+            // Create a qcow2 image instead of a raw image
+            options.qcow2 = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-re") ||
+            !strcmp(argv[i], "--remove-esp-files")) {
+            // Remove files or empty directories from the ESP of an existing image
+            for (i += 1; i < argc && argv[i][0] != '-'; i++) {
+                if (argv[i][0] != '/') {
+                    fprintf(stderr, 
+                            "Error: All file paths to remove from ESP must start with slash '/'\n");
+                    options.error = true;
+                    return options;
+                }
+
+                if (!add_string_to_list(&options.esp_remove_paths, &options.num_esp_remove_paths, 
+                                        argv[i])) {
+                    options.error = true;
+                    return options;
+                }
+            }
+
+            // Overall for loop will increment i; in order to get next option, decrement here
+            i--;    
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-rl") ||
+            !strcmp(argv[i], "--reflink")) {
+            // Clone data partition files into the image, where the host filesystem allows
+            options.reflink = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-rp") ||
+            !strcmp(argv[i], "--reproducible")) {
+            // Make the image byte-identical for the same inputs
+            options.reproducible = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-sd") ||
+            !strcmp(argv[i], "--seed")) {
+            // Derive GUIDs from a seed string, instead of the file contents
+            if (++i >= argc) {
+                options.error = true;
+                return options;
+            }
+
+            options.seed = argv[i];
+            options.reproducible = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-sp") ||
+            !strcmp(argv[i], "--sparse")) {
+            // Do not write zero filled regions of the image, leave them as holes
+            options.sparse = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-st") ||
+            !strcmp(argv[i], "--stream")) {
+            // Write the image front to back in 1 pass, without seeking
+            options.stream = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-u") ||
+            !strcmp(argv[i], "--update")) {
+            // Update files in an existing image, instead of creating a new image
+            options.update = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-v") ||
+            !strcmp(argv[i], "--vhd")) {
+            // Add a fixed Virtual Hard Disk Footer to the disk image;
+            //   will also change the suffix to .vhd
+
+            options.vhd = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-vd") ||
+            !strcmp(argv[i], "--vhd-dynamic")) {
+            // Create a dynamic vhd, with only blocks holding data
+            options.vhd_dynamic = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-vx") ||
+            !strcmp(argv[i], "--vhdx")) {
+            // Create a dynamic vhdx, with only blocks holding data
+            options.vhdx = true; 
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-vf") ||
+            !strcmp(argv[i], "--verify")) {
+            // Check an existing image, instead of creating one
+            options.verify = true; 
+            continue;
+        }
+    }
+
+    return options;
+}
+
+// =============================
+// Get a Virtual Hard Disk checksum; the one's complement of the sum of all bytes,
+//   with the checksum field set to 0
+// =============================
+uint32_t get_vhd_checksum(const void *buf, const uint64_t size) {
+    // Code Taken from Microsoft VHD documentation
+    uint32_t checksum = 0;
+    const uint8_t *bufp = buf;
+    for (uint64_t counter = 0; counter < size; counter++) 
+        checksum += bufp[counter];
+
+    return ~checksum;
+}
+
+// =============================
+// Fill out a Virtual Hard Disk footer for a disk image of a given size; the data
+//   offset is where a dynamic disk's header is, or all 1s for a fixed disk
+// =============================
+Vhd new_vhd_footer(const uint64_t vhd_image_size, const uint8_t disk_type, const uint64_t data_offset) {
+    // Fill out VHD footer info
+    Vhd vhd = {
+        .cookie = { 'c','o','n','e','c','t','i','x' },
+        .features = { 0 },
+        .version = { 0x00, 0x01, 0x00, 0x00 },
+        .data_offset = { 0 },
+        .timestamp = { 0 }, // # of seconds since 01/01/2000
+        .creator_app = { 'q','f','i','c' },
+        .creator_ver = { 0x00, 0x01, 0x00, 0x00},
+        .creator_OS = { 'M','Y','O','S' },
+        .original_size = { 0 },
+        .current_size = { 0 },
+        .disk_geometry = { 0 },
+        .disk_type = { 0x00, 0x00, 0x00, disk_type }, // 2 = Fixed, 3 = Dynamic hard disk
+        .checksum = { 0 },
+        .unique_id = new_guid(),
+        .saved_state = 0,
+        .reserved = { 0 },
+    };
+
+    put_big_endian(vhd.data_offset, data_offset, 8);
+
+    // Unix epoch for 01/01/2000 = 946684800,
+    //  subtract this value from epoch 01/01/1970 to translate
+    //  to correct timestamp
+    const int64_t curr_time = source_date_epoch >= 0 ? source_date_epoch : (int64_t)time(NULL);
+    const uint32_t time_u32 = curr_time > VHD_EPOCH ? (uint32_t)(curr_time - VHD_EPOCH) : 0;
+    vhd.timestamp[0] = (time_u32 >> 24) & 0xFF;
+    vhd.timestamp[1] = (time_u32 >> 16) & 0xFF;
+    vhd.timestamp[2] = (time_u32 >>  8) & 0xFF;
+    vhd.timestamp[3] = time_u32 & 0xFF;
+
+    // Image size for a fixed disk should be 4KiB aligned - 512 bytes, so the image 
+    //   with the vhd footer is 4KiB aligned and not "corrupted"
+    vhd.original_size[0] = (vhd_image_size >> 56) & 0xFF;
+    vhd.original_size[1] = (vhd_image_size >> 48) & 0xFF;
+    vhd.original_size[2] = (vhd_image_size >> 40) & 0xFF;
+    vhd.original_size[3] = (vhd_image_size >> 32) & 0xFF;
+    vhd.original_size[4] = (vhd_image_size >> 24) & 0xFF;
+    vhd.original_size[5] = (vhd_image_size >> 16) & 0xFF;
+    vhd.original_size[6] = (vhd_image_size >>  8) & 0xFF;
+    vhd.original_size[7] = vhd_image_size & 0xFF;
+
+    memcpy(vhd.current_size, vhd.original_size, sizeof vhd.original_size); 
+
+    // Fill out disk geometry (CHS values)
+    // Code Taken from Microsoft VHD documentation
+    uint32_t totalSectors;
+    uint16_t cylinders;
+    uint8_t heads, sectorsPerTrack;
+    uint32_t cylinderTimesHeads;
+
+    totalSectors = image_size_lbas;
+    //                  C      H     S
+    if (totalSectors > 65535 * 16 * 255)
+        totalSectors = 65535 * 16 * 255;
+
+    if (totalSectors >= 65535 * 16 * 63) {
+        sectorsPerTrack = 255;
+        heads = 16;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+    } else {
+        sectorsPerTrack = 17;
+        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+
+        heads = (cylinderTimesHeads + 1023) / 1024;
+
+        if (heads < 4) heads = 4;
+
+        if (cylinderTimesHeads >= (heads * 1024) || heads > 16) {
+            sectorsPerTrack = 31;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+
+        if (cylinderTimesHeads >= (heads * 1024)) {
+            sectorsPerTrack = 63;
+            heads = 16;
+            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        }
+    }
+    cylinders = cylinderTimesHeads / heads;
+
+    // CHS values for disk geometry: Cylinders 2 bytes, heads 1 byte, sectorsPerTrack 1 byte
+    vhd.disk_geometry[0] = (cylinders >> 8) & 0xFF;
+    vhd.disk_geometry[1] = cylinders & 0xFF;
+    vhd.disk_geometry[2] = heads;
+    vhd.disk_geometry[3] = sectorsPerTrack;
+
+    // Fill out checksum
+    const uint32_t checksum = get_vhd_checksum(&vhd, sizeof vhd);
+
+    vhd.checksum[0] = (checksum >> 24) & 0xFF;
+    vhd.checksum[1] = (checksum >> 16) & 0xFF;
+    vhd.checksum[2] = (checksum >>  8) & 0xFF;
+    vhd.checksum[3] = checksum & 0xFF;
+
+    return vhd;
+}
+
+// =============================
+// Add a fixed Virtual Hard Disk footer to the disk image, after the given size
+//   of the disk image
+// =============================
+void add_fixed_vhd_footer(FILE *image, const uint64_t vhd_image_size) {
+    const Vhd vhd = new_vhd_footer(vhd_image_size, VHD_FIXED, UINT64_MAX);
+
+    // Write footer to end of file
+    write_at(image, &vhd, sizeof vhd, vhd_image_size);
+}
+
+// =====================================
+// Find which blocks of a streamed image hold any non-zero data; blocks with no
+//   saved ranges are all zeros, the rest are read back to check
+// =====================================
+bool find_data_blocks(const uint64_t block_size, bool *has_data) {
+    uint8_t *buf = malloc(block_size);
+    if (!buf) {
+        fprintf(stderr, "Error: Could not allocate memory for image block\n");
+        return false;
+    }
+
+    Stream_Reader reader = { 0 };
+    uint64_t next_block = 0;    // Blocks before this are already checked
+    bool result = true;
+    for (uint32_t i = 0; result && i < num_stream_extents; i++) {
+        const Stream_Extent *extent = &stream_extents[i];
+        uint64_t block = extent->offset / block_size;
+        if (block < next_block) block = next_block;
+
+        for (; result && block <= (extent->offset + extent->size - 1) / block_size; block++) {
+            result = read_stream_data(&reader, buf, block * block_size, block_size);
+            has_data[block] = result && !is_zero(buf, block_size);
+            next_block = block + 1;
+        }
+    }
+
+    if (reader.file) fclose(reader.file);
+    free(buf);
+    return result;
+}
+
+// =====================================
+// Write each block of a streamed image holding data, in disk order; each block
+//   can have a header e.g. a sector bitmap before it
+// =====================================
+bool write_data_blocks(FILE *image, const uint64_t block_size, const uint64_t num_blocks, 
+                       const bool *has_data, const uint8_t *block_header, 
+                       const uint64_t block_header_size) {
+    uint8_t *buf = malloc(block_header_size + block_size);
+    if (!buf) {
+        fprintf(stderr, "Error: Could not allocate memory for image block\n");
+        return false;
+    }
+    if (block_header_size) memcpy(buf, block_header, block_header_size);
+
+    Stream_Reader reader = { 0 };
+    bool result = true;
+    for (uint64_t block = 0; result && block < num_blocks; block++) {
+        if (!has_data[block]) continue;
+        result = read_stream_data(&reader, buf + block_header_size, block * block_size, block_size) &&
+                 fwrite(buf, 1, block_header_size + block_size, image) == block_header_size + block_size;
+    }
+
+    if (reader.file) fclose(reader.file);
+    free(buf);
+    return result;
+}
+
+// =====================================
+// Write a streamed image as a dynamic Virtual Hard Disk, allocating only the 
+//   blocks holding non-zero data. The footer copy, dynamic header and Block 
+//   Allocation Table come first, then each block's sector bitmap and data in 
+//   disk order, then the footer, so it is still written front to back
+// =====================================
+bool write_dynamic_vhd(FILE *image, const uint64_t disk_size) {
+    const uint64_t block_size = VHD_BLOCK_SIZE;
+    const uint64_t num_blocks = (disk_size + block_size - 1) / block_size;
+    const uint64_t table_offset = sizeof(Vhd) + sizeof(Vhd_Dynamic_Header);
+    const uint64_t table_size = (((num_blocks * sizeof(uint32_t)) + 511) / 512) * 512;
+    const uint64_t bitmap_size = (((block_size / 512 / 8) + 511) / 512) * 512;
+
+    if (!sort_stream_extents(disk_size)) return false;
+
+    bool *has_data = calloc(num_blocks, sizeof *has_data);
+    uint8_t *table = malloc(table_size), *bitmap = malloc(bitmap_size);
+    bool result = has_data && table && bitmap;
+    if (!result) fprintf(stderr, "Error: Could not allocate memory for VHD block table\n");
+
+    if (result) result = find_data_blocks(block_size, has_data);
+
+    // Block Allocation Table; sector # of each allocated block, all 1s for the rest
+    if (result) memset(table, 0xFF, table_size);
+    uint64_t sector = (table_offset + table_size) / 512;
+    for (uint64_t i = 0; result && i < num_blocks; i++) {
+        if (!has_data[i]) continue;
+        if (sector > UINT32_MAX) {
+            fprintf(stderr, "Error: Image is too large for a dynamic VHD\n");
+            result = false;
+            break;
+        }
+        put_big_endian(table + (i * sizeof(uint32_t)), sector, 4);
+        sector += (bitmap_size + block_size) / 512;
+    }
+
+    // Footer is at the start and end of the file
+    const Vhd vhd = new_vhd_footer(disk_size, VHD_DYNAMIC, sizeof(Vhd));
+
+    Vhd_Dynamic_Header header = {
+        .cookie = { 'c','x','s','p','a','r','s','e' },
+        .header_version = { 0x00, 0x01, 0x00, 0x00 },
+    };
+    memset(header.data_offset, 0xFF, sizeof header.data_offset);
+    put_big_endian(header.table_offset, table_offset, 8);
+    put_big_endian(header.max_table_entries, num_blocks, 4);
+    put_big_endian(header.block_size, block_size, 4);
+    put_big_endian(header.checksum, get_vhd_checksum(&header, sizeof header), 4);
+
+    // All sectors in allocated blocks are in this file
+    if (result) memset(bitmap, 0xFF, bitmap_size);
+
+    result = result && 
+             fwrite(&vhd, 1, sizeof vhd, image) == sizeof vhd &&
+             fwrite(&header, 1, sizeof header, image) == sizeof header &&
+             fwrite(table, 1, table_size, image) == table_size &&
+             write_data_blocks(image, block_size, num_blocks, has_data, bitmap, bitmap_size) &&
+             fwrite(&vhd, 1, sizeof vhd, image) == sizeof vhd &&
+             fflush(image) == 0;
+
+    free(has_data);
+    free(table);
+    free(bitmap);
+    free_stream_extents();
+    return result;
+}
+
+// =====================================
+// Write a streamed image as a dynamic VHDX, allocating only the blocks holding 
+//   non-zero data. The file identifier, headers, region tables, an empty log, 
+//   metadata and BAT come first, then each block in disk order
+// =====================================
+bool write_vhdx(FILE *image, const uint64_t disk_size) {
+    const uint64_t block_size = VHDX_BLOCK_SIZE;
+    const uint64_t num_blocks = (disk_size + block_size - 1) / block_size;
+
+    // A sector bitmap entry follows every chunk ratio # of block entries in the BAT
+    const uint64_t chunk_ratio = (((uint64_t)1 << 23) * lba_size) / block_size;
+    const uint64_t num_bat_entries = num_blocks + ((num_blocks - 1) / chunk_ratio);
+
+    // All regions are 1MiB aligned
+    const uint64_t log_offset = VHDX_ALIGNMENT, log_length = VHDX_ALIGNMENT;
+    const uint64_t metadata_offset = log_offset + log_length, metadata_length = VHDX_ALIGNMENT;
+    const uint64_t bat_offset = metadata_offset + metadata_length;
+    const uint64_t bat_length = ((num_bat_entries * sizeof(uint64_t) + VHDX_ALIGNMENT - 1) / 
+                                 VHDX_ALIGNMENT) * VHDX_ALIGNMENT;
+    const uint64_t data_offset = bat_offset + bat_length;
+
+    if (!sort_stream_extents(disk_size)) return false;
+
+    bool *has_data = calloc(num_blocks, sizeof *has_data);
+    uint8_t *meta = calloc(1, data_offset);     // Everything before the 1st block
+    bool result = has_data && meta;
+    if (!result) fprintf(stderr, "Error: Could not allocate memory for VHDX metadata\n");
+
+    if (result) result = find_data_blocks(block_size, has_data);
+
+    if (result) {
+        // File type identifier, with the creator as a UTF-16 string
+        const char16_t creator[] = u"write_gpt";
+        memcpy(meta, "vhdxfile", 8);
+        memcpy(meta + 8, creator, sizeof creator);
+
+        // 2 headers; the one with the higher sequence # is current
+        Vhdx_Header header = {
+            .signature = { 'h','e','a','d' },
+            .sequence_number = 1,
+            .file_write_guid = new_guid(),
+            .data_write_guid = new_guid(),
+            .version = 1,
+            .log_length = log_length,
+            .log_offset = log_offset,
+        };
+        for (uint8_t i = 0; i < 2; i++) {
+            header.checksum = 0;
+            header.checksum = calculate_crc32c(&header, sizeof header);
+            memcpy(meta + VHDX_HEADER_OFFSET + (i * VHDX_HEADER_SIZE), &header, sizeof header);
+            header.sequence_number++;
+        }
+
+        // 2 copies of the region table; its checksum covers the whole 64KiB
+        Vhdx_Region_Table *regions = (Vhdx_Region_Table *)(meta + VHDX_REGION_TABLE_OFFSET);
+        *regions = (Vhdx_Region_Table){
+            .signature = { 'r','e','g','i' },
+            .entry_count = 2,
+            .entries = {
+                { VHDX_BAT_GUID, bat_offset, bat_length, 1 },
+                { VHDX_METADATA_GUID, metadata_offset, metadata_length, 1 },
+            },
+        };
+        regions->checksum = calculate_crc32c(regions, VHDX_REGION_TABLE_SIZE);
+        memcpy(meta + VHDX_REGION_TABLE_OFFSET + VHDX_REGION_TABLE_SIZE, regions, 
+               VHDX_REGION_TABLE_SIZE);
+
+        // Metadata table, then the items it points to
+        uint8_t *items = meta + metadata_offset + VHDX_METADATA_ITEMS_OFFSET;
+        const uint32_t file_parameters[2] = { block_size, 0 };  // Block size, flags
+        const uint64_t virtual_disk_size = disk_size;
+        const Guid virtual_disk_id = new_guid();
+        const uint32_t logical_sector_size = lba_size, physical_sector_size = 4096;
+
+        memcpy(items, file_parameters, sizeof file_parameters);
+        memcpy(items + 8, &virtual_disk_size, sizeof virtual_disk_size);
+        memcpy(items + 16, &virtual_disk_id, sizeof virtual_disk_id);
+        memcpy(items + 32, &logical_sector_size, sizeof logical_sector_size);
+        memcpy(items + 36, &physical_sector_size, sizeof physical_sector_size);
+
+        const uint32_t item_offset = VHDX_METADATA_ITEMS_OFFSET;
+        *(Vhdx_Metadata_Table *)(meta + metadata_offset) = (Vhdx_Metadata_Table){
+            .signature = { 'm','e','t','a','d','a','t','a' },
+            .entry_count = 5,
+            .entries = {
+                // Flags: 4 = required, 6 = virtual disk & required
+                { VHDX_FILE_PARAMETERS_GUID,      item_offset,      8, 4, 0 },
+                { VHDX_VIRTUAL_DISK_SIZE_GUID,    item_offset + 8,  8, 6, 0 },
+                { VHDX_PAGE_83_DATA_GUID,         item_offset + 16, 16, 6, 0 },
+                { VHDX_LOGICAL_SECTOR_SIZE_GUID,  item_offset + 32, 4, 6, 0 },
+                { VHDX_PHYSICAL_SECTOR_SIZE_GUID, item_offset + 36, 4, 6, 0 },
+            },
+        };
+
+        // BAT; allocated blocks are fully present at their file offset in MiB, 
+        //   and everything else is not present, which reads as zeros
+        uint64_t block_offset = data_offset;
+        for (uint64_t i = 0; i < num_blocks; i++) {
+            if (!has_data[i]) continue;
+            const uint64_t entry = ((block_offset / VHDX_ALIGNMENT) << 20) | VHDX_BLOCK_FULLY_PRESENT;
+            memcpy(meta + bat_offset + ((i + (i / chunk_ratio)) * sizeof entry), &entry, sizeof entry);
+            block_offset += block_size;
+        }
+    }
+
+    result = result && 
+             fwrite(meta, 1, data_offset, image) == data_offset &&
+             write_data_blocks(image, block_size, num_blocks, has_data, NULL, 0) &&
+             fflush(image) == 0;
+
+    free(has_data);
+    free(meta);
+    free_stream_extents();
+    return result;
+}
+
+// =====================================
+// Get the block sizes of a block device or file to write an image to directly; 
+//   logical is the smallest lba size the device can use, 0 for files, and 
+//   physical is the block size to read & write in
+// =====================================
+bool get_device_block_sizes(const char *path, uint32_t *logical, uint32_t *physical) {
+#if defined(__linux__)
+    *logical = 0;
+    *physical = 4096;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        // File created when the image is written
+        if (errno == ENOENT) return true;
+        fprintf(stderr, "Error: Could not stat device or file %s\n", path);
+        return false;
+    }
+
+    if (!S_ISBLK(st.st_mode)) {
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Error: %s is not a block device or regular file\n", path);
+            return false;
+        }
+        if (st.st_blksize > 0) *physical = st.st_blksize;
+        return true;
+    }
+
+    const int fd = open(path, O_RDONLY);
+    int logical_size = 0;
+    unsigned int physical_size = 0;
+    const bool result = fd >= 0 && 
+                        ioctl(fd, BLKSSZGET, &logical_size) == 0 && logical_size > 0 &&
+                        ioctl(fd, BLKPBSZGET, &physical_size) == 0;
+    if (fd >= 0) close(fd);
+    if (!result) {
+        fprintf(stderr, "Error: Could not get block sizes of device %s\n", path);
+        return false;
+    }
+
+    *logical = logical_size;
+    *physical = physical_size > 0 ? physical_size : (uint32_t)logical_size;
+    return true;
+#else
+    (void)path, (void)logical, (void)physical;
+    fprintf(stderr, "Error: Writing directly to a device is only supported on Linux\n");
+    return false;
+#endif
+}
+
+#if defined(__linux__)
+// =====================================
+// Write a buffer to a device at a given byte offset, retrying short writes
+// =====================================
+bool write_device_at(const int fd, const void *buf, const uint64_t size, const uint64_t offset) {
+    const uint8_t *bufp = buf;
+    uint64_t total = 0;
+    while (total < size) {
+        const ssize_t bytes = pwrite(fd, bufp + total, size - total, offset + total);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return false;
+        total += bytes;
+    }
+    return true;
+}
+
+// =====================================
+// Zero a range of a device without writing zeros from user space where possible: 
+//   BLKZEROOUT for block devices, which the device can offload with WRITE ZEROES 
+//   or an unmap that reads back as zeros, or fallocate() for files. Blocks of a 
+//   preallocated file are kept allocated, with a hole punched only if that fails
+// =====================================
+bool zero_device_range(const int fd, const bool block_device, const uint8_t *zeros, 
+                       const uint64_t offset, const uint64_t size) {
+    if (size == 0) return true;
+
+    if (block_device) {
+        uint64_t range[2] = { offset, size };
+        if (ioctl(fd, BLKZEROOUT, range) == 0) return true;
     } else {
-        fp = fopen("FILE.TXT", "ab");  // Add to end of file
+#if defined(FALLOC_FL_ZERO_RANGE)
+        if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) 
+            return true;
+#endif
+#if defined(FALLOC_FL_PUNCH_HOLE)
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) 
+            return true;
+#endif
+    }
+
+    for (uint64_t done = 0; done < size; ) {
+        const uint64_t len = size - done < COPY_BUFFER_SIZE ? size - done : COPY_BUFFER_SIZE;
+        if (!write_device_at(fd, zeros, len, offset + done)) return false;
+        done += len;
+    }
+    return true;
+}
+#endif
+
+// =====================================
+// Write an image straight to a block device or existing/preallocated file, 
+//   from its saved ranges as with streaming. Ranges are rounded out to the
+//   device block size and written with O_DIRECT from aligned buffers; gaps 
+//   between them are zeroed by the device or filesystem instead. Written ranges
+//   are read back from the device and checked against their CRC32
+// =====================================
+bool write_to_device(const char *path, const uint64_t image_size, const uint64_t block_size) {
+#if defined(__linux__)
+    struct stat st;
+    const bool block_device = stat(path, &st) == 0 && S_ISBLK(st.st_mode);
+
+    // Don't write to a device that is mounted or otherwise in use
+    const int flags = O_RDWR | (block_device ? O_EXCL : O_CREAT);
+    bool direct = true;
+    int fd = open(path, flags | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        fprintf(stderr, "WARNING: O_DIRECT is not supported for %s, writing through the page "
+                        "cache\n", path);
+        direct = false;
+        fd = open(path, flags, 0644);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open device or file %s\n", path);
+        free_stream_extents();
+        return false;
+    }
+
+    // Device must hold the whole image; a smaller file is grown to the image size
+    uint64_t device_size = 0;
+    if (block_device) {
+        if (ioctl(fd, BLKGETSIZE64, &device_size) != 0) device_size = 0;
+    } else if (fstat(fd, &st) == 0) {
+        device_size = st.st_size;
+        if (device_size < image_size && ftruncate(fd, image_size) == 0) device_size = image_size;
+    }
+    if (device_size < image_size) {
+        fprintf(stderr, "Error: %s is too small for the image, %"PRIu64" bytes needed\n", 
+                path, image_size);
+        close(fd);
+        free_stream_extents();
+        return false;
+    }
+
+    uint8_t *zeros = NULL, *buf = NULL;
+    if (posix_memalign((void **)&zeros, 4096, COPY_BUFFER_SIZE) != 0) zeros = NULL;
+    if (posix_memalign((void **)&buf, 4096, COPY_BUFFER_SIZE) != 0) buf = NULL;
+    if (zeros) memset(zeros, 0, COPY_BUFFER_SIZE);
+
+    // Ranges to write; saved ranges rounded out to whole blocks, merged when the 
+    //   gap between them is too small to be worth zeroing separately
+    Device_Range *ranges = NULL;
+    uint32_t num_ranges = 0;
+    bool result = zeros && buf && sort_stream_extents(image_size);
+    if (!zeros || !buf) fprintf(stderr, "Error: Could not allocate memory for writing to device\n");
+
+    for (uint32_t i = 0; result && i < num_stream_extents; i++) {
+        const uint64_t start = stream_extents[i].offset - (stream_extents[i].offset % block_size);
+        const uint64_t end = ((stream_extents[i].offset + stream_extents[i].size + block_size - 1) / 
+                              block_size) * block_size;
+
+        if (num_ranges > 0 && 
+            start <= ranges[num_ranges-1].offset + ranges[num_ranges-1].size + DEVICE_ZERO_MIN) {
+            ranges[num_ranges-1].size = end - ranges[num_ranges-1].offset;
+            continue;
+        }
+
+        Device_Range *new_ranges = grow_array(ranges, num_ranges, sizeof *ranges);
+        if (!new_ranges) {
+            result = false;
+            break;
+        }
+        ranges = new_ranges;
+        ranges[num_ranges++] = (Device_Range){ .offset = start, .size = end - start };
+    }
+
+    // Write each range in large aligned chunks, zeroing the gap before it
+    Stream_Reader reader = { 0 };
+    uint64_t pos = 0, bytes_written = 0, bytes_zeroed = 0;
+    for (uint32_t i = 0; result && i < num_ranges; i++) {
+        Device_Range *range = &ranges[i];
+        if (!zero_device_range(fd, block_device, zeros, pos, range->offset - pos)) {
+            fprintf(stderr, "Error: Could not zero %s at offset %"PRIu64"\n", path, pos);
+            result = false;
+            break;
+        }
+        bytes_zeroed += range->offset - pos;
+
+        for (uint64_t done = 0; result && done < range->size; ) {
+            const uint64_t len = range->size - done < COPY_BUFFER_SIZE ? 
+                                 range->size - done : COPY_BUFFER_SIZE;
+            result = read_stream_data(&reader, buf, range->offset + done, len);
+            if (result && !write_device_at(fd, buf, len, range->offset + done)) {
+                fprintf(stderr, "Error: Could not write to %s at offset %"PRIu64"\n", 
+                        path, range->offset + done);
+                result = false;
+            }
+            if (result) range->crc = update_crc32(range->crc, buf, len);
+            done += len;
+        }
+        bytes_written += range->size;
+        pos = range->offset + range->size;
+    }
+    if (reader.file) fclose(reader.file);
+
+    // Rest of the image after the last range
+    if (result && !zero_device_range(fd, block_device, zeros, pos, image_size - pos)) {
+        fprintf(stderr, "Error: Could not zero %s at offset %"PRIu64"\n", path, pos);
+        result = false;
+    }
+    bytes_zeroed += image_size - pos;
+
+    if (result && fdatasync(fd) != 0) {
+        fprintf(stderr, "Error: Could not flush writes to %s\n", path);
+        result = false;
+    }
+
+    // Read back what was written from the device itself, not the page cache
+    if (result && !direct) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    for (uint32_t i = 0; result && i < num_ranges; i++) {
+        const Device_Range *range = &ranges[i];
+        uint32_t crc = 0;
+        for (uint64_t done = 0; done < range->size; ) {
+            const uint64_t len = range->size - done < COPY_BUFFER_SIZE ? 
+                                 range->size - done : COPY_BUFFER_SIZE;
+            const ssize_t bytes = pread(fd, buf, len, range->offset + done);
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) break;
+            crc = update_crc32(crc, buf, bytes);
+            done += bytes;
+        }
+
+        if (crc != range->crc) {
+            fprintf(stderr, "Error: Data read back from %s at offset %"PRIu64" does not match "
+                            "what was written\n", path, range->offset);
+            result = false;
+        }
+    }
+
+    if (close(fd) != 0) result = false;
+    if (result) 
+        printf("Wrote %"PRIu64"MiB to %s, zeroed %"PRIu64"MiB, verified %u ranges\n", 
+               bytes_written / ALIGNMENT, path, bytes_zeroed / ALIGNMENT, num_ranges);
+
+    free(ranges);
+    free(zeros);
+    free(buf);
+    free_stream_extents();
+    return result;
+#else
+    (void)path, (void)image_size, (void)block_size;
+    fprintf(stderr, "Error: Writing directly to a device is only supported on Linux\n");
+    free_stream_extents();
+    return false;
+#endif
+}
+
+// CRC32 function available on this CPU, for benchmarking
+typedef struct {
+    const char *name;
+    uint32_t (*function)(uint32_t c, const uint8_t *buf, uint64_t len);
+} Crc32_Function;
+
+// =============================
+// Copy a range of the image out to a file, kernel-side if possible, otherwise 
+//   through a large buffer
+// =============================
+bool copy_image_range_out(FILE *image, const uint64_t offset, const uint64_t size, FILE *out) {
+    static uint8_t *copy_buf = NULL;
+    uint64_t pos = 0;
+
+#if !defined(_WIN32)
+    // Output file is written at its current position
+    fflush(out);
+    const off_t out_pos = lseek(fileno(out), 0, SEEK_CUR);
+    if (out_pos >= 0) {
+        pos = copy_range_in_kernel(fileno(image), offset, fileno(out), out_pos, size);
+        lseek(fileno(out), out_pos + pos, SEEK_SET);
+    }
+#endif
+
+    if (pos < size && !copy_buf) {
+        copy_buf = malloc(COPY_BUFFER_SIZE);
+        if (!copy_buf) return false;
+    }
+
+    while (pos < size) {
+        const uint64_t len = size - pos < COPY_BUFFER_SIZE ? size - pos : COPY_BUFFER_SIZE;
+        if (read_at(image, copy_buf, len, offset + pos) != len ||
+            fwrite(copy_buf, 1, len, out) != len) 
+            return false;
+        pos += len;
+    }
+
+    return true;
+}
+
+// =============================
+// Copy an ESP file out of the image, 1 run of contiguous clusters at a time
+// =============================
+bool copy_esp_file_out(FILE *image, uint32_t cluster, const uint64_t file_size, FILE *out) {
+    uint64_t pos = 0;
+    while (pos < file_size) {
+        if (cluster < 2 || cluster > esp.max_cluster) return false;
+
+        const uint32_t run_start = cluster;
+        uint64_t run_size = esp.cluster_size;
+        cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        while (cluster == run_start + (run_size / esp.cluster_size) && pos + run_size < file_size) {
+            run_size += esp.cluster_size;
+            cluster = esp.fat[cluster] & 0x0FFFFFFF;
+        }
+        if (run_size > file_size - pos) run_size = file_size - pos;
+
+        if (!copy_image_range_out(image, cluster_to_lba(run_start) * lba_size, run_size, out)) 
+            return false;
+        pos += run_size;
+    }
+
+    return true;
+}
+
+// =============================
+// Get "NAME.EXT" from a directory entry's 8.3 name
+// =============================
+void get_entry_name(const FAT32_Dir_Entry_Short *dir_entry, char name[13]) {
+    uint8_t len = 0;
+    for (uint8_t i = 0; i < 8 && dir_entry->DIR_Name[i] != ' '; i++) 
+        name[len++] = dir_entry->DIR_Name[i];
+    if (dir_entry->DIR_Name[8] != ' ') name[len++] = '.';
+    for (uint8_t i = 8; i < 11 && dir_entry->DIR_Name[i] != ' '; i++) 
+        name[len++] = dir_entry->DIR_Name[i];
+    name[len] = '\0';
+}
+
+// =============================
+// Read data partition file records from FILE.TXT in the ESP
+// =============================
+bool read_data_file_records(FILE *image, Data_File_Record **records, uint32_t *count) {
+    *records = NULL;
+    *count = 0;
+
+    char path[25] = { 0 };
+    strcpy(path, "/EFI/BOOT/FILE.TXT");
+    Esp_Dir *dir = NULL;
+    FAT32_Dir_Entry_Short *dir_entry = NULL;
+    uint32_t cluster = 0;
+    if (!find_esp_path(path, &dir, &dir_entry, &cluster) || !dir_entry) return true;     // No data files
+
+    FILE *fp = tmpfile();
+    if (!fp) return false;
+    bool result = copy_esp_file_out(image, cluster, dir_entry->DIR_FileSize, fp);
+    rewind(fp);
+
+    Data_File_Record record = { 0 };
+    char line[512];
+    while (result && fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "FILE_NAME=%255[^\n]", record.name) == 1) continue;
+        if (sscanf(line, "FILE_SIZE=%"SCNu64, &record.size) == 1) continue;
+        if (sscanf(line, "DISK_LBA=%"SCNu64, &record.lba) != 1) continue;
+
+        // End of a file record
+        Data_File_Record *new_records = grow_array(*records, *count, sizeof *new_records);
+        if (!new_records) {
+            result = false;
+            break;
+        }
+        *records = new_records;
+        (*records)[(*count)++] = record;
+    }
+
+    fclose(fp);
+    return result;
+}
+
+// =============================
+// Print an ESP directory's files & directories, and everything under it
+// =============================
+void list_esp_dir(const uint32_t cluster, const char *path) {
+    const Esp_Dir *dir = find_esp_dir(cluster);
+    if (!dir) return;
+
+    const FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data;
+    const FAT32_Dir_Entry_Short *dir_end = dir_entry + dir->num_entries;
+    for (; dir_entry < dir_end && dir_entry->DIR_Name[0] != '\0'; dir_entry++) {
+        if (dir_entry->DIR_Name[0] == 0xE5 || dir_entry->DIR_Name[0] == '.' ||
+            (dir_entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+            (dir_entry->DIR_Attr & ATTR_VOLUME_ID)) 
+            continue;
+
+        char name[13];
+        get_entry_name(dir_entry, name);
+
+        char *entry_path = join_strings(path, name);
+        if (!entry_path) return;
+
+        if (dir_entry->DIR_Attr & ATTR_DIRECTORY) {
+            printf("%-12s %s/\n", "-", entry_path);
+            char *dir_path = join_strings(entry_path, "/");
+            if (dir_path) list_esp_dir((dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO, 
+                                       dir_path);
+            free(dir_path);
+        } else {
+            printf("%-12u %s\n", dir_entry->DIR_FileSize, entry_path);
+        }
+        free(entry_path);
+    }
+}
+
+// =============================
+// Print all ESP files & directories, and data partition files from FILE.TXT
+// =============================
+bool list_image(FILE *image) {
+    printf("\nESP:\n%-12s %s\n", "SIZE", "PATH");
+    list_esp_dir(esp.vbr.BPB_RootClus, "/");
+
+    Data_File_Record *records = NULL;
+    uint32_t count = 0;
+    if (!read_data_file_records(image, &records, &count)) {
+        fprintf(stderr, "Error: Could not read FILE.TXT from ESP\n");
+        return false;
+    }
+
+    printf("\nDATA PARTITION:\n%-12s %-12s %s\n", "SIZE", "LBA", "NAME");
+    for (uint32_t i = 0; i < count; i++) 
+        printf("%-12"PRIu64" %-12"PRIu64" %s\n", records[i].size, records[i].lba, records[i].name);
+
+    free(records);
+    return true;
+}
+
+// =============================
+// Extract an ESP file to a local file, or to stdout for "-"
+// =============================
+bool extract_esp_file(FILE *image, const FAT32_Dir_Entry_Short *dir_entry, const char *out_path) {
+    FILE *out = strcmp(out_path, "-") ? fopen(out_path, "wb") : stdout;
+    if (!out) {
+        fprintf(stderr, "Error: Could not fopen file '%s'\n", out_path);
+        return false;
+    }
+
+    bool result = copy_esp_file_out(image, (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO, 
+                                    dir_entry->DIR_FileSize, out);
+    if (out == stdout) result = fflush(out) == 0 && result;
+    else result = fclose(out) == 0 && result;
+
+    if (!result) fprintf(stderr, "Error: Could not extract '%s'\n", out_path);
+    return result;
+}
+
+// =============================
+// Extract an ESP directory and everything under it to a local directory
+// =============================
+bool extract_esp_dir(FILE *image, const uint32_t cluster, const char *out_dir) {
+#if defined(_WIN32)
+    mkdir(out_dir);
+#else
+    mkdir(out_dir, 0755);
+#endif
+    if (!is_directory(out_dir)) {
+        fprintf(stderr, "Error: Could not create directory '%s'\n", out_dir);
+        return false;
+    }
+
+    const Esp_Dir *dir = find_esp_dir(cluster);
+    if (!dir) return false;
+
+    bool result = true;
+    const FAT32_Dir_Entry_Short *dir_entry = (FAT32_Dir_Entry_Short *)dir->data;
+    const FAT32_Dir_Entry_Short *dir_end = dir_entry + dir->num_entries;
+    for (; result && dir_entry < dir_end && dir_entry->DIR_Name[0] != '\0'; dir_entry++) {
+        if (dir_entry->DIR_Name[0] == 0xE5 || dir_entry->DIR_Name[0] == '.' ||
+            (dir_entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+            (dir_entry->DIR_Attr & ATTR_VOLUME_ID)) 
+            continue;
+
+        char name[14] = "/";
+        get_entry_name(dir_entry, name + 1);
+        char *out_path = join_strings(out_dir, name);
+        if (!out_path) return false;
+
+        if (dir_entry->DIR_Attr & ATTR_DIRECTORY) 
+            result = extract_esp_dir(image, (dir_entry->DIR_FstClusHI << 16) | dir_entry->DIR_FstClusLO, 
+                                     out_path);
+        else 
+            result = extract_esp_file(image, dir_entry, out_path);
+        free(out_path);
+    }
+
+    return result;
+}
+
+// =============================
+// Check a data partition file record from FILE.TXT before extracting it; the image
+//   may be untrusted, so its data must be inside the data partition, and its name 
+//   must be a plain file name when used as a local file name
+// =============================
+bool check_data_file_record(const Data_File_Record *record, const bool check_name) {
+    const char *name = record->name;
+    if (check_name && (!*name || !strcmp(name, ".") || !strcmp(name, "..") || 
+                       strchr(name, '/') || strchr(name, '\\'))) {
+        fprintf(stderr, "Error: FILE.TXT record name '%s' is not a plain file name\n", name);
+        return false;
+    }
+
+    const uint64_t num_lbas = (record->size / lba_size) + (record->size % lba_size != 0);
+    if (!data_size_lbas || record->lba < data_lba || 
+        num_lbas > data_lba + data_size_lbas - record->lba) {
+        fprintf(stderr, "Error: FILE.TXT record for '%s' at lba %"PRIu64" with %"PRIu64" bytes is "
+                        "outside the data partition\n", name, record->lba, record->size);
+        return false;
+    }
+    return true;
+}
+
+// =============================
+// Extract files from the image to a local directory, or to stdout for "-"; paths 
+//   starting with '/' are ESP files or directories, other names are data 
+//   partition files from FILE.TXT. With no paths, the whole ESP is extracted to 
+//   <dir>/ESP and all data partition files to <dir>/DATA
+// =============================
+bool extract_from_image(FILE *image, const char *out_dir, char **paths, const uint32_t num_paths) {
+    const bool to_stdout = !strcmp(out_dir, "-");
+    if (!to_stdout) {
+#if defined(_WIN32)
+        mkdir(out_dir);
+#else
+        mkdir(out_dir, 0755);
+#endif
+    }
+
+    Data_File_Record *records = NULL;
+    uint32_t count = 0;
+    if (!read_data_file_records(image, &records, &count)) {
+        fprintf(stderr, "Error: Could not read FILE.TXT from ESP\n");
+        return false;
+    }
+
+    bool result = true;
+    if (num_paths == 0) {
+        if (to_stdout) {
+            fprintf(stderr, "Error: Only files can be extracted to stdout\n");
+            free(records);
+            return false;
+        }
+
+        // Everything
+        char *esp_dir = join_strings(out_dir, "/ESP"), *data_dir = join_strings(out_dir, "/DATA");
+        result = esp_dir && data_dir && extract_esp_dir(image, esp.vbr.BPB_RootClus, esp_dir);
+        if (result && count > 0) {
+#if defined(_WIN32)
+            mkdir(data_dir);
+#else
+            mkdir(data_dir, 0755);
+#endif
+        }
+
+        for (uint32_t i = 0; result && i < count; i++) {
+            if (!check_data_file_record(&records[i], true)) {
+                result = false;
+                break;
+            }
+
+            char *name = join_strings("/", records[i].name);
+            char *out_path = name ? join_strings(data_dir, name) : NULL;
+            FILE *out = out_path ? fopen(out_path, "wb") : NULL;
+            result = out && copy_image_range_out(image, records[i].lba * lba_size, records[i].size, out);
+            if (out) result = fclose(out) == 0 && result;
+            if (!result) fprintf(stderr, "Error: Could not extract data partition file '%s'\n", 
+                                 records[i].name);
+            free(name);
+            free(out_path);
+        }
+        free(esp_dir);
+        free(data_dir);
+    }
+
+    for (uint32_t i = 0; result && i < num_paths; i++) {
+        char *path = paths[i];
+
+        // Local file or directory is named after the last name in the path
+        char *slash = strrchr(path, '/');
+        if (slash && slash != path && slash[1] == '\0') *slash = '\0';  // Trailing slash
+        const char *name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+        char *out_path = NULL;
+        if (!to_stdout) {
+            char *local_name = join_strings("/", *name ? name : "ESP");
+            out_path = local_name ? join_strings(out_dir, local_name) : NULL;
+            free(local_name);
+            if (!out_path) return false;
+        }
+
+        if (*path == '/') {
+            Esp_Dir *dir = NULL;
+            FAT32_Dir_Entry_Short *dir_entry = NULL;
+            uint32_t cluster = 0;
+            if (!find_esp_path(path, &dir, &dir_entry, &cluster)) {
+                fprintf(stderr, "Error: '%s' not found in EFI System Partition\n", path);
+                result = false;
+            } else if (!dir_entry || (dir_entry->DIR_Attr & ATTR_DIRECTORY)) {
+                if (to_stdout) {
+                    fprintf(stderr, "Error: Only files can be extracted to stdout\n");
+                    result = false;
+                } else {
+                    result = extract_esp_dir(image, dir_entry ? cluster : esp.vbr.BPB_RootClus, 
+                                             out_path);
+                }
+            } else {
+                result = extract_esp_file(image, dir_entry, to_stdout ? "-" : out_path);
+            }
+        } else {
+            uint32_t j = 0;
+            while (j < count && strcmp(records[j].name, path)) j++;
+            if (j == count) {
+                fprintf(stderr, "Error: '%s' not found in data partition\n", path);
+                result = false;
+            } else if (!check_data_file_record(&records[j], false)) {
+                result = false;
+            } else {
+                FILE *out = to_stdout ? stdout : fopen(out_path, "wb");
+                result = out && copy_image_range_out(image, records[j].lba * lba_size, 
+                                                     records[j].size, out);
+                if (out) result = (out == stdout ? fflush(out) : fclose(out)) == 0 && result;
+                if (!result) fprintf(stderr, "Error: Could not extract data partition file '%s'\n", 
+                                     path);
+            }
+        }
+        free(out_path);
+    }
+
+    free(records);
+    return result;
+}
+
+// =============================
+// Map a whole image file into memory, read only; on platforms without mmap(), 
+//   it is read into memory instead
+// =============================
+uint8_t *map_image(const char *image_name, uint64_t *size) {
+#if defined(_WIN32)
+    FILE *file = fopen(image_name, "rb");
+    if (!file) return NULL;
+
+    *size = get_file_size(file);
+
+    uint8_t *data = malloc(*size ? *size : 1);
+    if (data && fread(data, 1, *size, file) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+#else
+    const int fd = open(image_name, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        data = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+
+    // Image is read front to back, mostly
+    madvise(data, *size, MADV_SEQUENTIAL);
+    return data;
+#endif
+}
+
+// =============================
+// Unmap an image mapped with map_image()
+// =============================
+void unmap_image(uint8_t *data, const uint64_t size) {
+#if defined(_WIN32)
+    (void)size;
+    free(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+// =============================
+// Check the VHD footer at the end of an image, if it has one; returns size of 
+//   the disk image without the footer
+// =============================
+uint64_t verify_vhd_footer(Verify_State *state) {
+    if (state->file_size < sizeof(Vhd) * 2) return state->file_size;
+
+    const Vhd *vhd = (const Vhd *)(state->image + state->file_size - sizeof(Vhd));
+    if (memcmp(vhd->cookie, "conectix", sizeof vhd->cookie)) return state->file_size;
+
+    // Checksum is the 1's complement of the sum of all footer bytes but itself
+    uint32_t checksum = 0;
+    const uint8_t *vhd_p = (const uint8_t *)vhd;
+    for (uint32_t i = 0; i < sizeof *vhd; i++) {
+        if (i < offsetof(Vhd, checksum) || i >= offsetof(Vhd, checksum) + sizeof vhd->checksum)
+            checksum += vhd_p[i];
+    }
+    checksum = ~checksum;
+
+    const uint32_t footer_checksum = ((uint32_t)vhd->checksum[0] << 24) | 
+                                     ((uint32_t)vhd->checksum[1] << 16) |
+                                     ((uint32_t)vhd->checksum[2] << 8) | vhd->checksum[3];
+    if (checksum != footer_checksum) {
+        fprintf(stderr, "Error: VHD footer checksum is %#x, should be %#x\n", 
+                footer_checksum, checksum);
+        state->errors++;
+    }
+
+    uint64_t current_size = 0;
+    for (uint8_t i = 0; i < sizeof vhd->current_size; i++) 
+        current_size = (current_size << 8) | vhd->current_size[i];
+    if (current_size != state->file_size - sizeof *vhd) {
+        fprintf(stderr, "Error: VHD footer disk size is %"PRIu64", should be %"PRIu64"\n", 
+                current_size, state->file_size - sizeof *vhd);
+        state->errors++;
+    }
+
+    printf("VHD FOOTER: checked\n");
+    return state->file_size - sizeof *vhd;
+}
+
+// =============================
+// Check the protective MBR against the disk size from the GPT
+// =============================
+void verify_mbr(Verify_State *state, const uint64_t disk_lbas) {
+    const Mbr *mbr = (const Mbr *)state->image;
+    const uint64_t errors = state->errors;
+
+    if (mbr->boot_signature != 0xAA55) {
+        fprintf(stderr, "Error: MBR boot signature is %#x, should be 0xAA55\n", mbr->boot_signature);
+        state->errors++;
+    }
+
+    const Mbr_Partition *partition = &mbr->partition[0];
+    const uint64_t size_lba = (disk_lbas > 0xFFFFFFFF ? 0x100000000 : disk_lbas) - 1;
+    if (partition->os_type != 0xEE || partition->starting_lba != 1 || 
+        partition->size_lba != size_lba) {
+        fprintf(stderr, "Error: MBR protective partition is type %#x at lba %u with %u lbas, "
+                        "should be type 0xEE at lba 1 with %"PRIu64" lbas\n",
+                partition->os_type, partition->starting_lba, partition->size_lba, size_lba);
+        state->errors++;
+    }
+
+    for (uint8_t i = 1; i < 4; i++) {
+        if (!is_zero(&mbr->partition[i], sizeof mbr->partition[i])) {
+            fprintf(stderr, "Error: MBR partition %u should be empty\n", i + 1);
+            state->errors++;
+        }
+    }
+
+    if (state->errors == errors) printf("MBR: OK\n");
+}
+
+// =============================
+// Check a GPT header and its partition table; returns NULL if they can't be used
+// =============================
+const Gpt_Header *verify_gpt_header(Verify_State *state, const uint64_t lba, const char *name) {
+    if ((lba + 1) * lba_size > state->image_size) {
+        fprintf(stderr, "Error: %s GPT header lba %"PRIu64" is past end of image\n", name, lba);
+        state->errors++;
+        return NULL;
+    }
+
+    const Gpt_Header *gpt = (const Gpt_Header *)(state->image + (lba * lba_size));
+    if (memcmp(gpt->signature, "EFI PART", sizeof gpt->signature) || 
+        gpt->header_size < 92 || gpt->header_size > lba_size) {
+        fprintf(stderr, "Error: No valid %s GPT header at lba %"PRIu64"\n", name, lba);
+        state->errors++;
+        return NULL;
+    }
+
+    // CRC is of the header with the CRC field set to 0
+    uint8_t header[4096];
+    memcpy(header, gpt, gpt->header_size);
+    ((Gpt_Header *)header)->header_crc32 = 0;
+    if (calculate_crc32(header, gpt->header_size) != gpt->header_crc32) {
+        fprintf(stderr, "Error: %s GPT header CRC is wrong\n", name);
+        state->errors++;
+    }
+
+    if (gpt->my_lba != lba) {
+        fprintf(stderr, "Error: %s GPT header is at lba %"PRIu64", but says it is at %"PRIu64"\n", 
+                name, lba, gpt->my_lba);
+        state->errors++;
     }
-    if (!fp) return false;
 
-    fprintf(fp, "DISK_SIZE=%"PRIu64"\n", image_size);
-    fclose(fp);
+    const uint64_t table_size = (uint64_t)gpt->number_of_entries * gpt->size_of_entry;
+    if (gpt->size_of_entry < sizeof(Gpt_Partition_Entry) || gpt->size_of_entry % 8 != 0 || 
+        gpt->number_of_entries > 1024 ||
+        (gpt->partition_table_lba * lba_size) + table_size > state->image_size) {
+        fprintf(stderr, "Error: %s GPT partition table is invalid or past end of image\n", name);
+        state->errors++;
+        return NULL;
+    }
 
-    fp = fopen("FILE.TXT", "rb");
+    if (calculate_crc32(state->image + (gpt->partition_table_lba * lba_size), table_size) != 
+        gpt->partition_table_crc32) {
+        fprintf(stderr, "Error: %s GPT partition table CRC is wrong\n", name);
+        state->errors++;
+    }
 
-    char path[25] = { 0 };
-    strcpy(path, "/EFI/BOOT/FILE.TXT");
-    if (!add_path_to_esp(path, fp, image)) return false;
-    fclose(fp);
+    if (gpt->first_usable_lba > gpt->last_usable_lba || 
+        gpt->last_usable_lba >= state->image_size / lba_size) {
+        fprintf(stderr, "Error: %s GPT usable lbas %"PRIu64"-%"PRIu64" are invalid\n", 
+                name, gpt->first_usable_lba, gpt->last_usable_lba);
+        state->errors++;
+    }
 
-    return true;
+    return gpt;
 }
 
-// ======================================
-// Add file to the Basic Data Partition
-// ======================================
-bool add_file_to_data_partition(char *filepath, FILE *image) {
-    // Will save location of next spot to put a file in
-    static uint64_t starting_lba = 0;
-
-    // Go to data partition
-    fseek(image, (data_lba + starting_lba) * lba_size, SEEK_SET);
-
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", filepath);
+// =============================
+// Check primary & backup GPT headers and tables, and their partitions; finds the 
+//   ESP and basic data partition
+// =============================
+bool verify_gpts(Verify_State *state) {
+    // Find lba size by checking for the GPT header signature at LBA 1
+    const uint64_t lba_sizes[] = { 512, 1024, 2048, 4096 };
+    lba_size = 0;
+    for (uint8_t i = 0; i < sizeof lba_sizes / sizeof lba_sizes[0]; i++) {
+        if (lba_sizes[i] * 2 <= state->image_size &&
+            !memcmp(state->image + lba_sizes[i], "EFI PART", 8)) {
+            lba_size = lba_sizes[i];
+            break;
+        }
+    }
+    if (!lba_size) {
+        fprintf(stderr, "Error: Could not find a GPT header in image\n");
+        state->errors++;
         return false;
     }
+    printf("LBA SIZE: %"PRIu64"\n", lba_size);
+
+    const uint64_t errors = state->errors;
+    const Gpt_Header *primary = verify_gpt_header(state, 1, "Primary");
+    if (!primary) return false;
+
+    verify_mbr(state, primary->alternate_lba + 1);
+
+    const Gpt_Header *backup = verify_gpt_header(state, primary->alternate_lba, "Backup");
+    if (backup) {
+        if (backup->alternate_lba != 1 || 
+            memcmp(&backup->disk_guid, &primary->disk_guid, sizeof backup->disk_guid) ||
+            backup->first_usable_lba != primary->first_usable_lba ||
+            backup->last_usable_lba != primary->last_usable_lba ||
+            backup->number_of_entries != primary->number_of_entries ||
+            backup->size_of_entry != primary->size_of_entry ||
+            backup->partition_table_crc32 != primary->partition_table_crc32 ||
+            memcmp(state->image + (backup->partition_table_lba * lba_size),
+                   state->image + (primary->partition_table_lba * lba_size),
+                   (uint64_t)primary->number_of_entries * primary->size_of_entry)) {
+            fprintf(stderr, "Error: Backup GPT header or table does not match the primary\n");
+            state->errors++;
+        }
+    }
 
-    // Get file size 
-    uint64_t file_size_bytes = 0, file_size_lbas = 0;
-    fseek(fp, 0, SEEK_END);
-    file_size_bytes = ftell(fp);
-    file_size_lbas = bytes_to_lbas(file_size_bytes);
-    rewind(fp);
+    // Partitions must be in the usable range and not overlap; use the first ESP & 
+    //   basic data partitions found
+    const uint8_t *table = state->image + (primary->partition_table_lba * lba_size);
+    const Gpt_Partition_Entry *esp_entry = NULL, *data_entry = NULL;
+    for (uint32_t i = 0; i < primary->number_of_entries; i++) {
+        const Gpt_Partition_Entry *entry = (const Gpt_Partition_Entry *)(table + (i * primary->size_of_entry));
+        if (is_zero(&entry->partition_type_guid, sizeof entry->partition_type_guid)) continue;
+
+        if (entry->starting_lba < primary->first_usable_lba || 
+            entry->ending_lba > primary->last_usable_lba || 
+            entry->starting_lba > entry->ending_lba) {
+            fprintf(stderr, "Error: GPT partition %u at lbas %"PRIu64"-%"PRIu64" is outside "
+                            "usable lbas\n", i + 1, entry->starting_lba, entry->ending_lba);
+            state->errors++;
+            continue;
+        }
 
-    // Check if adding next file will overrun data partition size
-    if ((starting_lba + file_size_lbas) * lba_size >= data_size) {
-        fprintf(stderr, 
-                "Error: Can't add file %s to Data Partition; "
-                "Data Partition size is %"PRIu64 "(%"PRIu64" LBAs) and all files added "
-                "would overrun this size\n",
-                filepath,
-                data_size, data_size_lbas);
-    }
+        for (uint32_t j = 0; j < i; j++) {
+            const Gpt_Partition_Entry *other = (const Gpt_Partition_Entry *)(table + (j * primary->size_of_entry));
+            if (!is_zero(&other->partition_type_guid, sizeof other->partition_type_guid) &&
+                entry->starting_lba <= other->ending_lba && other->starting_lba <= entry->ending_lba) {
+                fprintf(stderr, "Error: GPT partitions %u and %u overlap\n", j + 1, i + 1);
+                state->errors++;
+            }
+        }
 
-    uint8_t *file_buf = calloc(1, lba_size);
-    for (uint64_t i = 0; i < file_size_lbas; i++) {
-        uint64_t bytes_read = fread(file_buf, 1, lba_size, fp);
-        fwrite(file_buf, 1, bytes_read, image);
+        if (!esp_entry && !memcmp(&entry->partition_type_guid, &ESP_GUID, sizeof ESP_GUID)) 
+            esp_entry = entry;
+        if (!data_entry && !memcmp(&entry->partition_type_guid, &BASIC_DATA_GUID, sizeof BASIC_DATA_GUID))
+            data_entry = entry;
     }
-    free(file_buf);
-    fclose(fp);
 
-    // Print info to user
-    char *name = NULL;
-    char *slash = strrchr(filepath, '/'); 
-    if (!slash) name = filepath;
-    else name = slash + 1;
+    if (state->errors == errors) printf("GPT: OK, primary and backup headers & tables match\n");
 
-    printf("Added '%s' from path '%s' to Data Partition\n", 
-           name,
-           filepath);
+    if (!esp_entry) {
+        fprintf(stderr, "Error: No EFI System Partition in GPT\n");
+        state->errors++;
+        return false;
+    }
 
-    // Add to info file for each file added 
-    char info_file[12] = "FILE.TXT"; // "Data (partition) files info"
+    esp_lba = esp_entry->starting_lba;
+    esp_size_lbas = esp_entry->ending_lba - esp_entry->starting_lba + 1;
+    if (data_entry) {
+        data_lba = data_entry->starting_lba;
+        data_size_lbas = data_entry->ending_lba - data_entry->starting_lba + 1;
+    }
+    return true;
+}
 
-    if (!opened_info_file) {
-        opened_info_file = true;
-        fp = fopen(info_file, "wb");    // Truncate before writing again
-    } else {
-        fp = fopen(info_file, "ab");    // Add to end of previous info
+// =============================
+// Check ESP VBR, backup VBR & FSInfo sector, and set up values to check the FATs
+// =============================
+bool verify_esp_vbr(Verify_State *state) {
+    const Vbr *vbr = (const Vbr *)(state->image + (esp_lba * lba_size));
+    const uint8_t spc = vbr->BPB_SecPerClus;
+
+    if (vbr->bootsect_sig != 0xAA55 || vbr->BPB_BytesPerSec != lba_size || 
+        spc == 0 || (spc & (spc - 1)) || vbr->BPB_RsvdSecCnt == 0 || vbr->BPB_NumFATs == 0 ||
+        vbr->BPB_FATSz16 != 0 || vbr->BPB_FATSz32 == 0 || vbr->BPB_TotSec32 > esp_size_lbas ||
+        vbr->BPB_RootClus < 2 || memcmp(vbr->BS_FilSysType, "FAT32   ", 8)) {
+        fprintf(stderr, "Error: ESP VBR is not a valid FAT32 VBR for this partition\n");
+        state->errors++;
+        return false;
     }
 
-    if (!fp) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", info_file);
+    state->vbr = vbr;
+    state->cluster_size = (uint64_t)spc * lba_size;
+    state->fat_lba = esp_lba + vbr->BPB_RsvdSecCnt;
+    state->data_offset = (state->fat_lba + ((uint64_t)vbr->BPB_NumFATs * vbr->BPB_FATSz32)) * lba_size;
+    state->max_cluster = ((vbr->BPB_TotSec32 - (state->data_offset / lba_size - esp_lba)) / spc) + 1;
+    state->fat_entries = ((uint64_t)vbr->BPB_FATSz32 * lba_size) / sizeof(uint32_t);
+
+    if (state->max_cluster - 1 < FAT32_MIN_CLUSTERS || state->max_cluster >= state->fat_entries ||
+        state->data_offset + ((uint64_t)(state->max_cluster - 1) * state->cluster_size) > 
+        state->image_size) {
+        fprintf(stderr, "Error: ESP has %u clusters, which is not valid for FAT32 with this "
+                        "FAT size and image size\n", state->max_cluster - 1);
+        state->errors++;
         return false;
     }
 
-    fprintf(fp,
-            "FILE_NAME=%s\n"
-            "FILE_SIZE=%"PRIu64"\n"
-            "DISK_LBA=%"PRIu64"\n\n",  // Add extra line between files
-            name,
-            file_size_bytes,
-            data_lba + starting_lba);  // Offset from start of data partition
+    if (vbr->BPB_BkBootSec && memcmp(vbr, state->image + ((esp_lba + vbr->BPB_BkBootSec) * lba_size), 
+                                     sizeof *vbr)) {
+        fprintf(stderr, "Error: ESP backup VBR does not match the VBR\n");
+        state->errors++;
+    }
 
-    fclose(fp);
+    state->fsinfo = (const FSInfo *)(state->image + ((esp_lba + vbr->BPB_FSInfo) * lba_size));
+    if (state->fsinfo->FSI_LeadSig != 0x41615252 || state->fsinfo->FSI_StrucSig != 0x61417272 ||
+        state->fsinfo->FSI_TrailSig != 0xAA550000) {
+        fprintf(stderr, "Error: ESP FSInfo sector signatures are wrong\n");
+        state->errors++;
+    }
 
-    // Set next spot to write a file at
-    starting_lba += file_size_lbas;
+    state->fat = (const uint32_t *)(state->image + (state->fat_lba * lba_size));
+    if ((state->fat[0] & 0x0FFFFFFF) != (0x0FFFFF00 | vbr->BPB_Media) || 
+        (state->fat[1] & 0x0FFFFFFF) < 0x0FFFFFF8) {
+        fprintf(stderr, "Error: ESP FAT entries 0 & 1 are not the media type & end of chain\n");
+        state->errors++;
+    }
 
+    printf("ESP: %u clusters of %"PRIu64" bytes, %u FATs of %u lbas\n", 
+           state->max_cluster - 1, state->cluster_size, vbr->BPB_NumFATs, vbr->BPB_FATSz32);
     return true;
 }
 
 // =============================
-// Get/parse input arguments from command line
+// 1st pass over a range of FAT entries; compare FAT copies, check entry values,
+//   count references to each cluster, and count free clusters & runs
 // =============================
-Options get_opts(int argc, char *argv[]) {
-    Options options = { 0 };
-
-    for (int i = 1; i < argc; i++) {
-        if (!strcmp(argv[i], "-h") ||
-            !strcmp(argv[i], "--help")) {
-            // Print help text and exit
-            options.help = true;
-            return options;
+void verify_fat_range(Verify_Range *range) {
+    const Verify_State *state = range->state;
+    const uint32_t *fat = state->fat;
+
+    for (uint8_t i = 1; i < state->vbr->BPB_NumFATs; i++) {
+        const uint32_t *copy = fat + ((uint64_t)i * state->vbr->BPB_FATSz32 * lba_size / sizeof *fat);
+        if (memcmp(fat + range->first, copy + range->first, 
+                   (uint64_t)(range->last - range->first + 1) * sizeof *fat)) {
+            for (uint32_t c = range->first; c <= range->last; c++) 
+                if (fat[c] != copy[c]) range->fat_mismatches++;
         }
+    }
 
-        if (!strcmp(argv[i], "-i") ||
-            !strcmp(argv[i], "--image-name")) {
-            // Set name of image, instead of using default name
-            if (++i >= argc) {
-                options.error = true;
-                return options;
-            }
-
-            options.image_name = argv[i];
+    uint32_t free_run = 0;
+    bool all_free = true;
+    for (uint32_t c = range->first; c <= range->last; c++) {
+        if (c < 2 || c > state->max_cluster) continue;
+
+        const uint32_t next = fat[c] & 0x0FFFFFFF;
+        if (next == 0) {
+            range->free_clusters++;
+            free_run++;
+            if (free_run > range->max_free_run) range->max_free_run = free_run;
+            if (all_free) range->free_prefix = free_run;
             continue;
         }
 
-        if (!strcmp(argv[i], "-l") ||
-            !strcmp(argv[i], "--lba-size")) {
-            // Set size of lba/disk sector, instead of default 512 bytes
-            if (++i >= argc) {
-                options.error = true;
-                return options;
-            }
+        all_free = false;
+        free_run = 0;
+        if (next >= 2 && next <= state->max_cluster) {
+            if (state->refs[next] < 2) state->refs[next]++;
+            if (next != c + 1) range->chain_breaks++;
+        } else if (next == 0x0FFFFFF7) {
+            range->bad_clusters++;
+        } else if (next < 0x0FFFFFF8) {
+            range->invalid_entries++;
+        }
+    }
+    range->free_suffix = free_run;
+    range->all_free = all_free;
+}
 
-            options.lba_size = strtol(argv[i], NULL, 10);
+// =============================
+// 2nd pass over a range of FAT entries, after all directories are walked; find 
+//   allocated clusters not in any file or directory, and cross-linked clusters
+// =============================
+void verify_lost_range(Verify_Range *range) {
+    const Verify_State *state = range->state;
 
-            if (options.lba_size != 512  &&
-                options.lba_size != 1024 &&
-                options.lba_size != 2048 &&
-                options.lba_size != 4096) {
-                // Error: invalid LBA size
-                fprintf(stderr, "Error: Invalid LBA size, must be one of 512/1024/2048/4096\n");
-                options.error = true;
-                return options;
-            }
+    for (uint32_t c = range->first; c <= range->last; c++) {
+        if (c < 2 || c > state->max_cluster) continue;
 
-            // Enforce minimum size of ESP per LBA size
-            if ((options.lba_size == 512  && options.esp_size < 33)  ||
-                (options.lba_size == 1024 && options.esp_size < 65)  ||
-                (options.lba_size == 2048 && options.esp_size < 129) ||
-                (options.lba_size == 4096 && options.esp_size < 257)) {
+        const uint32_t next = state->fat[c] & 0x0FFFFFFF;
+        if (next != 0 && next != 0x0FFFFFF7 && !state->reachable[c]) range->lost_clusters++;
+        if (state->refs[c] > 1) range->cross_links++;
+    }
+}
 
-                fprintf(stderr, "Error: ESP Must be a minimum of 33/65/129/257 MiB for "
-                                "LBA sizes 512/1024/2048/4096 respectively\n");
-                options.error = true;
-                return options;
-            }
-            continue;
-        }
+#if !defined(_WIN32)
+// =============================
+// Verify worker thread; runs a pass over its own range of FAT entries
+// =============================
+void *verify_worker(void *arg) {
+    Verify_Range *range = arg;
+    range->pass(range);
+    return NULL;
+}
+#endif
 
-        if (!strcmp(argv[i], "-es") ||
-            !strcmp(argv[i], "--esp-size")) {
-            // Set size of EFI System Partition in Megabytes (MiB)
-            if (++i >= argc) {
-                options.error = true;
-                return options;
-            }
+// =============================
+// Run a pass over all FAT entries, split into ranges across threads
+// =============================
+void run_verify_pass(Verify_Range *ranges, const uint32_t num_ranges, void (*pass)(Verify_Range *)) {
+#if !defined(_WIN32)
+    pthread_t threads[MAX_JOBS];
+    bool started[MAX_JOBS] = { 0 };
+    for (uint32_t i = 1; i < num_ranges; i++) {
+        ranges[i].pass = pass;
+        started[i] = pthread_create(&threads[i], NULL, verify_worker, &ranges[i]) == 0;
+        if (!started[i]) pass(&ranges[i]);
+    }
+    pass(&ranges[0]);
+    for (uint32_t i = 1; i < num_ranges; i++) 
+        if (started[i]) pthread_join(threads[i], NULL);
+#else
+    for (uint32_t i = 0; i < num_ranges; i++) 
+        pass(&ranges[i]);
+#endif
+}
 
-            // Enforce minimum size of ESP per LBA size
-            options.esp_size = strtol(argv[i], NULL, 10);
-            if ((options.lba_size == 512  && options.esp_size < 33)  ||
-                (options.lba_size == 1024 && options.esp_size < 65)  ||
-                (options.lba_size == 2048 && options.esp_size < 129) ||
-                (options.lba_size == 4096 && options.esp_size < 257)) {
+// =============================
+// Follow a file or directory's cluster chain, marking its clusters as reachable;
+//   returns # of clusters in the chain
+// =============================
+uint32_t verify_chain(Verify_State *state, const uint32_t first_cluster, const char *path, 
+                      uint32_t *extents) {
+    *extents = 0;
+    if (first_cluster < 2 || first_cluster > state->max_cluster) {
+        fprintf(stderr, "Error: '%s' starts at invalid cluster %u\n", path, first_cluster);
+        state->errors++;
+        return 0;
+    }
 
-                fprintf(stderr, "Error: ESP Must be a minimum of 33/65/129/257 MiB for "
-                                "LBA sizes 512/1024/2048/4096 respectively\n");
-                options.error = true;
-                return options;
-            }
+    if (state->refs[first_cluster]) {
+        fprintf(stderr, "Error: '%s' starts at cluster %u, which is also in another chain\n", 
+                path, first_cluster);
+        state->errors++;
+    }
 
-            continue;
+    uint32_t length = 0, cluster = first_cluster, prev = 0;
+    while (true) {
+        if (state->reachable[cluster]) {
+            fprintf(stderr, "Error: '%s' is cross-linked at cluster %u\n", path, cluster);
+            state->errors++;
+            break;
         }
-
-        if (!strcmp(argv[i], "-ds") ||
-            !strcmp(argv[i], "--data-size")) {
-            // Set size of EFI System Partition in Megabytes (MiB)
-            if (++i >= argc) {
-                options.error = true;
-                return options;
-            }
-
-            options.data_size = strtol(argv[i], NULL, 10);
-            continue;
+        state->reachable[cluster] = 1;
+        length++;
+        if (cluster != prev + 1) (*extents)++;
+        prev = cluster;
+
+        const uint32_t next = state->fat[cluster] & 0x0FFFFFFF;
+        if (next >= 0x0FFFFFF8) break;
+        if (next < 2 || next > state->max_cluster) {
+            fprintf(stderr, "Error: '%s' chain has invalid FAT entry %#x at cluster %u\n", 
+                    path, next, cluster);
+            state->errors++;
+            break;
         }
+        cluster = next;
+    }
 
-        if (!strcmp(argv[i], "-ae") ||
-            !strcmp(argv[i], "--add-esp-files")) {
-            // Add files to the EFI System Partition
-            if (i + 2 >= argc) {
-                // Need at least 2 more args for path & file, for this to work
-                fprintf(stderr, "Error: Must include at least 1 path and 1 file to add to ESP\n");
-                options.error = true;
-                return options;
-            }
-
-            // Allocate memory for file paths & File pointers
-            const uint32_t MAX_FILES = 10;
-            options.esp_file_paths = malloc(MAX_FILES * sizeof(char *));
-            options.esp_files = malloc(MAX_FILES * sizeof(FILE *));
+    return length;
+}
 
-            for (i += 1; i < argc && argv[i][0] != '-'; i++) {
-                // Grab next 2 args, 1st will be path to add, 2nd will be file to add to path
-                const int MAX_LEN = 256;
-                options.esp_file_paths[options.num_esp_file_paths] = calloc(1, MAX_LEN);
-
-                // Get path to add
-                strncpy(options.esp_file_paths[options.num_esp_file_paths], 
-                        argv[i], 
-                        MAX_LEN-1);
-
-                // Ensure path starts and ends with a slash '/'
-                if ((argv[i][0] != '/') ||
-                    (argv[i][strlen(argv[i]) - 1] != '/')) {
-                    fprintf(stderr, 
-                            "Error: All file paths to add to ESP must start and end with slash '/'\n");
-                    options.error = true;
-                    return options;
+// =============================
+// Check a directory's entries, and all files & directories under it
+// =============================
+void verify_dir(Verify_State *state, const uint32_t cluster, const uint32_t parent, 
+                const char *path) {
+    uint32_t extents = 0;
+    const uint32_t num_clusters = verify_chain(state, cluster, path, &extents);
+    if (num_clusters == 0) return;
+    state->num_dirs++;
+
+    const uint32_t entries_per_cluster = state->cluster_size / sizeof(FAT32_Dir_Entry_Short);
+    uint32_t dir_cluster = cluster;
+    for (uint32_t i = 0; i < num_clusters; i++) {
+        const FAT32_Dir_Entry_Short *entries = (const FAT32_Dir_Entry_Short *)
+            (state->image + state->data_offset + ((uint64_t)(dir_cluster - 2) * state->cluster_size));
+
+        for (uint32_t j = 0; j < entries_per_cluster; j++) {
+            const FAT32_Dir_Entry_Short *entry = &entries[j];
+            if (entry->DIR_Name[0] == 0x00) return;     // No more entries
+            if (entry->DIR_Name[0] == 0xE5 || 
+                (entry->DIR_Attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+                (entry->DIR_Attr & ATTR_VOLUME_ID)) 
+                continue;
+
+            const uint32_t entry_cluster = ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+
+            // "." & ".." point to this directory and its parent; root is cluster 0 here
+            if (!memcmp(entry->DIR_Name, ".          ", 11) || 
+                !memcmp(entry->DIR_Name, "..         ", 11)) {
+                const uint32_t expected = entry->DIR_Name[1] == '.' ? parent : cluster;
+                if (entry_cluster != expected) {
+                    fprintf(stderr, "Error: '%s' entry '%.2s' is cluster %u, should be %u\n", 
+                            path, entry->DIR_Name, entry_cluster, expected);
+                    state->errors++;
                 }
+                continue;
+            }
 
-                // Get FILE * for file to add to path
-                i++;
-                options.esp_files[options.num_esp_file_paths] = fopen(argv[i], "rb");
-                if (!options.esp_files[options.num_esp_file_paths]) {
-                    fprintf(stderr, "Error: Could not fopen file '%s'\n", argv[i]);
-                    options.error = true;
-                    return options;
+            // Get full path as NAME.EXT
+            char name[13] = { 0 };
+            uint8_t len = 0;
+            for (uint8_t k = 0; k < 8 && entry->DIR_Name[k] != ' '; k++) name[len++] = entry->DIR_Name[k];
+            if (entry->DIR_Name[8] != ' ') name[len++] = '.';
+            for (uint8_t k = 8; k < 11 && entry->DIR_Name[k] != ' '; k++) name[len++] = entry->DIR_Name[k];
+
+            char entry_path[MAX_VERIFY_PATH];
+            snprintf(entry_path, sizeof entry_path, "%s%s%s", path, name, 
+                     entry->DIR_Attr & ATTR_DIRECTORY ? "/" : "");
+
+            if (entry->DIR_Attr & ATTR_DIRECTORY) {
+                if (entry->DIR_FileSize != 0) {
+                    fprintf(stderr, "Error: Directory '%s' has size %u, should be 0\n", 
+                            entry_path, entry->DIR_FileSize);
+                    state->errors++;
                 }
+                const uint32_t this_cluster = cluster == state->vbr->BPB_RootClus ? 0 : cluster;
+                verify_dir(state, entry_cluster, this_cluster, entry_path);
+                continue;
+            }
 
-                // Concat file to add to path 
-                char *slash = strrchr(argv[i], '/');
-                if (!slash) {
-                    // Plain file name, no folder path
-                    strncat(options.esp_file_paths[options.num_esp_file_paths], 
-                            argv[i], 
-                            MAX_LEN-1);
-                } else {
-                    // Get only last name in path, no folders 
-                    strncat(options.esp_file_paths[options.num_esp_file_paths], 
-                            slash + 1,  // File name starts after final slash
-                            MAX_LEN-1);
+            state->num_files++;
+            state->file_bytes += entry->DIR_FileSize;
+            if (entry->DIR_FileSize == 0) {
+                if (entry_cluster != 0) {
+                    fprintf(stderr, "Error: Empty file '%s' has cluster %u, should be 0\n", 
+                            entry_path, entry_cluster);
+                    state->errors++;
                 }
+                continue;
+            }
 
-                if (++options.num_esp_file_paths == MAX_FILES) {
-                    fprintf(stderr, 
-                            "Error: Number of ESP files to add must be <= %d\n",
-                            MAX_FILES);
-                    options.error = true;
-                    return options;
-                }
+            uint32_t file_extents = 0;
+            const uint32_t file_clusters = verify_chain(state, entry_cluster, entry_path, &file_extents);
+            const uint64_t expected = (entry->DIR_FileSize + state->cluster_size - 1) / state->cluster_size;
+            if (file_clusters != expected) {
+                fprintf(stderr, "Error: '%s' is %u bytes, but has %u clusters instead of %"PRIu64"\n",
+                        entry_path, entry->DIR_FileSize, file_clusters, expected);
+                state->errors++;
             }
+            state->file_extents += file_extents;
+            if (file_extents > 1) state->fragmented_files++;
 
-            // Overall for loop will increment i; in order to get next option, decrement here
-            i--;    
-            continue;
+            if (!strcmp(entry_path, "/EFI/BOOT/FILE.TXT")) {
+                state->info_cluster = entry_cluster;
+                state->info_size = entry->DIR_FileSize;
+            }
         }
 
-        if (!strcmp(argv[i], "-ad") ||
-            !strcmp(argv[i], "--add-data-files")) {
-            // Add files to the Basic Data Partition
-            // Allocate memory for file paths
-            const uint32_t MAX_FILES = 10;
-            options.data_files = malloc(MAX_FILES * sizeof(char *));
-
-            for (i += 1; i < argc && argv[i][0] != '-'; i++) {
-                // Grab next 2 args, 1st will be path to add, 2nd will be file to add to path
-                const int MAX_LEN = 256;
-                options.data_files[options.num_data_files] = calloc(1, MAX_LEN);
-
-                // Get path to add
-                strncpy(options.data_files[options.num_data_files], 
-                        argv[i], 
-                        MAX_LEN-1);
+        dir_cluster = state->fat[dir_cluster] & 0x0FFFFFFF;
+    }
+}
 
-                if (++options.num_data_files == MAX_FILES) {
-                    fprintf(stderr, 
-                            "Error: Number of Data Parition files to add must be <= %d\n",
-                            MAX_FILES);
+// =============================
+// Check data partition file records in FILE.TXT; each must be inside the data 
+//   partition without overlapping others, and DISK_SIZE must be the image size
+// =============================
+void verify_info_file(Verify_State *state) {
+    if (!state->info_cluster) {
+        printf("FILE.TXT: not found\n");
+        return;
+    }
 
-                    options.error = true;
-                    return options;
-                }
-            }
+    // Read file from its clusters, already checked to be the right length
+    char *info = calloc(1, state->info_size + 1);
+    if (!info) return;
+    uint32_t cluster = state->info_cluster;
+    for (uint64_t pos = 0; pos < state->info_size; pos += state->cluster_size) {
+        const uint64_t len = state->info_size - pos < state->cluster_size ? 
+                             state->info_size - pos : state->cluster_size;
+        memcpy(info + pos, state->image + state->data_offset + ((uint64_t)(cluster - 2) * state->cluster_size), len);
+        cluster = state->fat[cluster] & 0x0FFFFFFF;
+        if (cluster < 2 || cluster > state->max_cluster) break;
+    }
 
-            // Overall for loop will increment i; in order to get next option, decrement here
-            i--;    
-            continue;
+    const uint64_t errors = state->errors;
+    uint32_t num_records = 0;
+    uint64_t prev_end = 0, file_size = 0, disk_size = 0;
+    char file_name[256] = { 0 };
+    bool have_disk_size = false;
+    for (char *line = strtok(info, "\n"); line; line = strtok(NULL, "\n")) {
+        uint64_t value = 0;
+        if (sscanf(line, "FILE_NAME=%255[^\n]", file_name) == 1) continue;
+        if (sscanf(line, "FILE_SIZE=%"SCNu64, &value) == 1) file_size = value;
+        if (sscanf(line, "DISK_SIZE=%"SCNu64, &value) == 1) {
+            disk_size = value;
+            have_disk_size = true;
         }
-
-        if (!strcmp(argv[i], "-v") ||
-            !strcmp(argv[i], "--vhd")) {
-            // Add a fixed Virtual Hard Disk Footer to the disk image;
-            //   will also change the suffix to .vhd
-
-            options.vhd = true; 
-            continue;
+        if (sscanf(line, "DISK_LBA=%"SCNu64, &value) != 1) continue;
+
+        // End of a file record
+        num_records++;
+        const uint64_t num_lbas = (file_size + lba_size - 1) / lba_size;
+        if (value < data_lba || value + num_lbas > data_lba + data_size_lbas || value < prev_end) {
+            fprintf(stderr, "Error: FILE.TXT record for '%s' at lbas %"PRIu64"-%"PRIu64" is "
+                            "outside the data partition, or overlaps another file\n", 
+                    file_name, value, value + num_lbas);
+            state->errors++;
+        } else {
+            printf("  %-24s %-12"PRIu64" LBA %-12"PRIu64" CRC32 %08x\n", file_name, file_size, 
+                   value, calculate_crc32(state->image + (value * lba_size), file_size));
         }
+        prev_end = value + num_lbas;
     }
 
-    return options;
+    if (!have_disk_size || disk_size != state->file_size) {
+        fprintf(stderr, "Error: FILE.TXT DISK_SIZE is %"PRIu64", but image is %"PRIu64" bytes\n", 
+                disk_size, state->file_size);
+        state->errors++;
+    }
+
+    if (state->errors == errors) printf("FILE.TXT: OK, %u data partition file records\n", num_records);
+    free(info);
 }
 
 // =============================
-// Add a fixed Virtual Hard Disk footer to the disk image
+// Check the data partition index, if the image has one; its CRC32s, and that 
+//   every record can be found by its name and is inside the data partition
 // =============================
-void add_fixed_vhd_footer(FILE *image) {
-    // Fill out VHD footer info
-    Vhd vhd = {
-        .cookie = { 'c','o','n','e','c','t','i','x' },
-        .features = { 0 },
-        .version = { 0x00, 0x01, 0x00, 0x00 },
-        .data_offset = -1,
-        .timestamp = { 0 }, // # of seconds since 01/01/2000
-        .creator_app = { 'q','f','i','c' },
-        .creator_ver = { 0x00, 0x01, 0x00, 0x00},
-        .creator_OS = { 'M','Y','O','S' },
-        .original_size = { 0 },
-        .current_size = { 0 },
-        .disk_geometry = { 0 },
-        .disk_type = { 0x00, 0x00, 0x00, 0x02 }, // 2 = Fixed hard disk
-        .checksum = { 0 },
-        .unique_id = new_guid(),
-        .saved_state = 0,
-        .reserved = { 0 },
-    };
-
-    // Unix epoch for 01/01/2000 = 946684800,
-    //  subtract this value from epoch 01/01/1970 to translate
-    //  to correct timestamp
-    uint32_t time_u32 = (uint32_t)time(NULL) - 946684800; 
-    vhd.timestamp[0] = (time_u32 >> 24) & 0xFF;
-    vhd.timestamp[1] = (time_u32 >> 16) & 0xFF;
-    vhd.timestamp[2] = (time_u32 >>  8) & 0xFF;
-    vhd.timestamp[3] = time_u32 & 0xFF;
+void verify_data_index(Verify_State *state) {
+    const uint64_t header_lba = data_lba + data_size_lbas - 1;
+    if (!data_size_lbas || (header_lba + 1) * lba_size > state->image_size) return;
+
+    Data_Index_Header header = { 0 };
+    memcpy(&header, state->image + (header_lba * lba_size), sizeof header);
+    if (memcmp(header.signature, DATA_INDEX_SIGNATURE, sizeof header.signature)) {
+        printf("DATA INDEX: not found\n");
+        return;
+    }
 
-    // Get current image size (should be 4KiB aligned - 512 bytes)
-    //   and use 4KiB aligned size for vhd footer to not have "corrupted" image
-    fseek(image, 0, SEEK_END); 
-    const uint64_t vhd_image_size = ftell(image);
+    const uint32_t header_crc32 = header.header_crc32;
+    header.header_crc32 = 0;
+    if (header.version != DATA_INDEX_VERSION || header.header_size != sizeof header ||
+        header.record_size != sizeof(Data_Index_Record) || header.num_slots == 0 ||
+        (header.num_slots & (header.num_slots - 1)) != 0 || 
+        header.table_lba < data_lba || header.table_lba + header.table_lbas != header_lba ||
+        (uint64_t)header.num_slots * sizeof(Data_Index_Record) > header.table_lbas * lba_size ||
+        calculate_crc32(&header, sizeof header) != header_crc32) {
+        fprintf(stderr, "Error: Data partition index header is invalid, or its CRC32 is wrong\n");
+        state->errors++;
+        return;
+    }
 
-    vhd.original_size[0] = (vhd_image_size >> 56) & 0xFF;
-    vhd.original_size[1] = (vhd_image_size >> 48) & 0xFF;
-    vhd.original_size[2] = (vhd_image_size >> 40) & 0xFF;
-    vhd.original_size[3] = (vhd_image_size >> 32) & 0xFF;
-    vhd.original_size[4] = (vhd_image_size >> 24) & 0xFF;
-    vhd.original_size[5] = (vhd_image_size >> 16) & 0xFF;
-    vhd.original_size[6] = (vhd_image_size >>  8) & 0xFF;
-    vhd.original_size[7] = vhd_image_size & 0xFF;
+    const Data_Index_Record *slots = (const Data_Index_Record *)(state->image + (header.table_lba * lba_size));
+    if (calculate_crc32(slots, (uint64_t)header.num_slots * sizeof *slots) != header.table_crc32) {
+        fprintf(stderr, "Error: Data partition index table CRC32 is wrong\n");
+        state->errors++;
+        return;
+    }
 
-    memcpy(vhd.current_size, vhd.original_size, sizeof vhd.original_size); 
+    const uint64_t errors = state->errors;
+    uint32_t num_records = 0;
+    for (uint32_t i = 0; i < header.num_slots; i++) {
+        Data_Index_Record record = { 0 };
+        memcpy(&record, &slots[i], sizeof record);
+        if (!record.name[0]) continue;
+        num_records++;
+
+        // Record must be found by probing from its name's slot, without an empty slot in between
+        const size_t name_len = strnlen(record.name, sizeof record.name);
+        uint32_t slot = record.name_hash & (header.num_slots - 1);
+        while (slot != i && slots[slot].name[0]) slot = (slot + 1) & (header.num_slots - 1);
+
+        const uint64_t num_lbas = bytes_to_lbas(record.size);
+        if (name_len == sizeof record.name || slot != i ||
+            data_index_name_hash(record.name) != record.name_hash) {
+            fprintf(stderr, "Error: Data partition index record %u has a bad name or hash\n", i);
+            state->errors++;
+        } else if (record.lba < data_lba || record.lba + num_lbas > header.table_lba) {
+            fprintf(stderr, "Error: Data partition index record for '%s' at lbas %"PRIu64"-%"PRIu64" "
+                            "is outside the data partition\n", record.name, record.lba, record.lba + num_lbas);
+            state->errors++;
+        } else if (calculate_crc32(state->image + (record.lba * lba_size), record.size) != record.crc32) {
+            fprintf(stderr, "Error: Data partition index CRC32 of '%s' doesn't match its data\n", 
+                    record.name);
+            state->errors++;
+        }
+    }
 
-    // Fill out disk geometry (CHS values)
-    // Code Taken from Microsoft VHD documentation
-    uint32_t totalSectors;
-    uint16_t cylinders;
-    uint8_t heads, sectorsPerTrack;
-    uint32_t cylinderTimesHeads;
+    if (num_records != header.num_records) {
+        fprintf(stderr, "Error: Data partition index has %u records, but its header says %u\n", 
+                num_records, header.num_records);
+        state->errors++;
+    }
 
-    totalSectors = image_size_lbas;
-    //                  C      H     S
-    if (totalSectors > 65535 * 16 * 255)
-        totalSectors = 65535 * 16 * 255;
+    if (state->errors == errors) printf("DATA INDEX: OK, %u records in %u slots\n", num_records, header.num_slots);
+}
 
-    if (totalSectors >= 65535 * 16 * 63) {
-        sectorsPerTrack = 255;
-        heads = 16;
-        cylinderTimesHeads = totalSectors / sectorsPerTrack;
-    } else {
-        sectorsPerTrack = 17;
-        cylinderTimesHeads = totalSectors / sectorsPerTrack;
+// =============================
+// Verify an existing image; checks MBR, GPTs, ESP FAT32 metadata, all cluster
+//   chains, FILE.TXT and the data partition index, and prints ESP free space & 
+//   fragmentation
+// =============================
+bool verify_image(const char *image_name, uint32_t num_threads) {
+    Verify_State state = { 0 };
+    state.image = map_image(image_name, &state.file_size);
+    if (!state.image) {
+        fprintf(stderr, "Error: could not open file %s\n", image_name);
+        return false;
+    }
+    printf("VERIFYING IMAGE: %s\n", image_name);
+
+    state.image_size = verify_vhd_footer(&state);
+    if (verify_gpts(&state) && verify_esp_vbr(&state)) {
+        state.refs = calloc(state.max_cluster + 1, sizeof *state.refs);
+        state.reachable = calloc(state.max_cluster + 1, sizeof *state.reachable);
+
+        // Split FAT entries into a range per thread
+#if !defined(_WIN32)
+        if (num_threads == 0) num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (num_threads < 1) num_threads = 1;
+        if (num_threads > MAX_JOBS) num_threads = MAX_JOBS;
+        Verify_Range *ranges = calloc(num_threads, sizeof *ranges);
+
+        if (!state.refs || !state.reachable || !ranges) {
+            fprintf(stderr, "Error: Could not allocate memory to verify image\n");
+            state.errors++;
+        } else {
+            const uint32_t per_range = (state.fat_entries + num_threads - 1) / num_threads;
+            for (uint32_t i = 0; i < num_threads; i++) {
+                ranges[i].state = &state;
+                ranges[i].first = i * per_range;
+                ranges[i].last = i * per_range + per_range - 1;
+                if (ranges[i].last >= state.fat_entries) ranges[i].last = state.fat_entries - 1;
+                if (ranges[i].first > ranges[i].last) ranges[i].first = ranges[i].last + 1;
+            }
 
-        heads = (cylinderTimesHeads + 1023) / 1024;
+            run_verify_pass(ranges, num_threads, verify_fat_range);
+            verify_dir(&state, state.vbr->BPB_RootClus, 0, "/");
+            run_verify_pass(ranges, num_threads, verify_lost_range);
+
+            // Merge results of all ranges; free runs can span ranges
+            Verify_Range total = { 0 };
+            uint64_t free_run = 0;
+            for (uint32_t i = 0; i < num_threads; i++) {
+                const Verify_Range *range = &ranges[i];
+                total.fat_mismatches += range->fat_mismatches;
+                total.invalid_entries += range->invalid_entries;
+                total.bad_clusters += range->bad_clusters;
+                total.free_clusters += range->free_clusters;
+                total.chain_breaks += range->chain_breaks;
+                total.lost_clusters += range->lost_clusters;
+                total.cross_links += range->cross_links;
+
+                free_run += range->free_prefix;
+                if (free_run > total.max_free_run) total.max_free_run = free_run;
+                if (range->max_free_run > total.max_free_run) total.max_free_run = range->max_free_run;
+                if (!range->all_free) free_run = range->free_suffix;
+            }
 
-        if (heads < 4) heads = 4;
+            if (total.fat_mismatches) {
+                fprintf(stderr, "Error: %"PRIu64" FAT entries differ between FAT copies\n", 
+                        total.fat_mismatches);
+                state.errors++;
+            }
+            if (total.invalid_entries) {
+                fprintf(stderr, "Error: %"PRIu64" FAT entries point outside the ESP\n", 
+                        total.invalid_entries);
+                state.errors++;
+            }
+            if (total.cross_links) {
+                fprintf(stderr, "Error: %"PRIu64" clusters are cross-linked, in more than 1 chain\n", 
+                        total.cross_links);
+                state.errors++;
+            }
+            if (total.lost_clusters) {
+                fprintf(stderr, "Error: %"PRIu64" lost clusters are allocated but not in any file "
+                                "or directory\n", total.lost_clusters);
+                state.errors++;
+            }
+            if (state.fsinfo->FSI_Free_Count != 0xFFFFFFFF && 
+                state.fsinfo->FSI_Free_Count != total.free_clusters) {
+                fprintf(stderr, "Error: FSInfo free count is %u, but %"PRIu64" clusters are free\n", 
+                        state.fsinfo->FSI_Free_Count, total.free_clusters);
+                state.errors++;
+            }
 
-        if (cylinderTimesHeads >= (heads * 1024) || heads > 16) {
-            sectorsPerTrack = 31;
-            heads = 16;
-            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+            const uint32_t total_clusters = state.max_cluster - 1;
+            printf("ESP FILES: %"PRIu64" files (%"PRIu64" bytes) in %"PRIu64" directories\n"
+                   "ESP FREE SPACE: %"PRIu64" of %u clusters free (%.1f%%), %"PRIu64" bytes; "
+                   "largest free run %"PRIu64" clusters\n"
+                   "ESP FRAGMENTATION: %"PRIu64" of %"PRIu64" files fragmented, %.2f extents per "
+                   "file, %"PRIu64" FAT chain breaks, %"PRIu64" bad clusters\n",
+                   state.num_files, state.file_bytes, state.num_dirs,
+                   total.free_clusters, total_clusters, 100.0 * total.free_clusters / total_clusters,
+                   total.free_clusters * state.cluster_size, total.max_free_run,
+                   state.fragmented_files, state.num_files, 
+                   state.num_files ? (double)state.file_extents / state.num_files : 0.0,
+                   total.chain_breaks, total.bad_clusters);
+
+            verify_info_file(&state);
+            verify_data_index(&state);
         }
 
-        if (cylinderTimesHeads >= (heads * 1024)) {
-            sectorsPerTrack = 63;
-            heads = 16;
-            cylinderTimesHeads = totalSectors / sectorsPerTrack;
+        free(ranges);
+        free(state.refs);
+        free(state.reachable);
+    }
+
+    unmap_image((uint8_t *)state.image, state.file_size);
+
+    if (state.errors) printf("IMAGE HAS %"PRIu64" ERRORS\n", state.errors);
+    else printf("IMAGE OK\n");
+    return state.errors == 0;
+}
+
+// =============================
+// Get current time in seconds
+// =============================
+double get_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// =============================
+// Check that all CRC32 functions for this CPU agree with the byte at a time 
+//   version, including incremental updates, and time each one
+// =============================
+bool benchmark_crc32(void) {
+    Crc32_Function functions[4] = {
+        { "byte at a time", crc32_bytewise },
+        { "slicing-by-8", crc32_slice8 },
+    };
+    uint8_t num_functions = 2;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) 
+        functions[num_functions++] = (Crc32_Function){ "PCLMULQDQ", crc32_pclmul };
+#endif
+#if defined(__aarch64__) && defined(__linux__) && defined(__GNUC__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) 
+        functions[num_functions++] = (Crc32_Function){ "ARMv8 CRC32", crc32_armv8 };
+#endif
+
+    const uint64_t size = 64 * ALIGNMENT, passes = 4;
+    uint8_t *buf = malloc(size);
+    if (!buf) {
+        fprintf(stderr, "Error: Could not allocate memory for CRC32 benchmark\n");
+        return false;
+    }
+
+    // Same pseudo random data every run
+    guid_seed = 0;
+    for (uint64_t i = 0; i < size; i += sizeof(uint64_t)) {
+        const uint64_t value = next_seeded_random();
+        memcpy(buf + i, &value, sizeof value);
+    }
+
+    // Check every alignment & short length, then incremental updates of a large range
+    bool result = true;
+    for (uint8_t f = 1; f < num_functions; f++) {
+        for (uint32_t offset = 0; offset < 16; offset++) {
+            for (uint32_t len = 0; len < 1024; len++) {
+                if (functions[f].function(0xFFFFFFFF, buf + offset, len) != 
+                    crc32_bytewise(0xFFFFFFFF, buf + offset, len)) {
+                    fprintf(stderr, "Error: %s CRC32 is wrong for %u bytes at offset %u\n", 
+                            functions[f].name, len, offset);
+                    result = false;
+                }
+            }
         }
     }
-    cylinders = cylinderTimesHeads / heads;
 
-    // CHS values for disk geometry: Cylinders 2 bytes, heads 1 byte, sectorsPerTrack 1 byte
-    vhd.disk_geometry[0] = (cylinders >> 8) & 0xFF;
-    vhd.disk_geometry[1] = cylinders & 0xFF;
-    vhd.disk_geometry[2] = heads;
-    vhd.disk_geometry[3] = sectorsPerTrack;
+    crc32_impl = crc32_bytewise;
+    const uint32_t expected = calculate_crc32(buf, size);
+    init_crc32();
+    uint32_t crc = 0;
+    for (uint64_t pos = 0, len = 1; pos < size; pos += len, len = len * 3 + 7) {
+        if (len > size - pos) len = size - pos;
+        crc = update_crc32(crc, buf + pos, len);
+    }
+    if (crc != expected) {
+        fprintf(stderr, "Error: Incremental CRC32 does not match CRC32 of whole buffer\n");
+        result = false;
+    }
 
-    // Fill out checksum
-    // Code Taken from Microsoft VHD documentation
-    uint32_t checksum = 0;
-    uint8_t *vhd_p = (uint8_t *)&vhd;
-    for (uint32_t counter = 0; counter < sizeof vhd; counter++) 
-        checksum += vhd_p[counter];
+    // Ranges added last to first, as copied file data can be
+    Copy_Job job = { .size = size, .index_entry = 1 };
+    for (uint64_t end = size, len = 1; end > 0; end -= len, len = len * 3 + 7) {
+        if (len > end) len = end;
+        add_copy_job_crc32(&job, buf + end - len, end - len, len);
+    }
+    if (get_copy_job_crc32(&job) != expected) {
+        fprintf(stderr, "Error: CRC32 of ranges out of order does not match CRC32 of whole buffer\n");
+        result = false;
+    }
 
-    checksum = ~checksum;
+    printf("CRC32 of %"PRIu64"MiB x %"PRIu64"\n%-20s %-12s %s\n", 
+           size / ALIGNMENT, passes, "FUNCTION", "MiB/s", "SPEEDUP");
 
-    vhd.checksum[0] = (checksum >> 24) & 0xFF;
-    vhd.checksum[1] = (checksum >> 16) & 0xFF;
-    vhd.checksum[2] = (checksum >>  8) & 0xFF;
-    vhd.checksum[3] = checksum & 0xFF;
+    double base_rate = 0;
+    for (uint8_t f = 0; f < num_functions; f++) {
+        const double start = get_seconds();
+        for (uint64_t i = 0; i < passes; i++) 
+            crc = functions[f].function(0xFFFFFFFF, buf, size);
+        const double seconds = get_seconds() - start;
 
-    // Write footer to end of file
-    fseek(image, 0, SEEK_END); 
-    fwrite(&vhd, 1, sizeof vhd, image);
+        if ((crc ^ 0xFFFFFFFF) != expected) {
+            fprintf(stderr, "Error: %s CRC32 is wrong for the whole buffer\n", functions[f].name);
+            result = false;
+        }
+
+        const double rate = (size * passes / (double)ALIGNMENT) / (seconds > 0 ? seconds : 1e-9);
+        if (f == 0) base_rate = rate;
+        printf("%-20s %-12.0f %.1fx%s\n", functions[f].name, rate, rate / base_rate, 
+               functions[f].function == crc32_impl ? " (used)" : "");
+    }
+
+    free(buf);
+    return result;
 }
 
 // =============================
@@ -1321,6 +7170,8 @@ int main(int argc, char *argv[]) {
     Options options = get_opts(argc, argv);
     if (options.error) return EXIT_FAILURE;
 
+    init_crc32();
+
     // Set/evaluate values from options
     if (options.help) {
         // Print help/usage text
@@ -1332,6 +7183,9 @@ int main(int argc, char *argv[]) {
                 "                       a <FILE.TXT> file in directory '/EFI/BOOT/' in the \n"
                 "                       ESP. This INF file will hold info for each file added\n"
                 "                       ex: '-ad info.txt ../folderA/kernel.bin'.\n"
+                "                       The last lbas of the data partition hold a binary\n"
+                "                       index of the files, to find them by name with a hash\n"
+                "                       lookup; see data_index.h.\n"
                 "-ae --add-esp-files    Add local files to the generated EFI System Partition.\n"
                 "                       File paths must start under root '/' and end with a \n"
                 "                       slash '/', and all dir/file names are limited to FAT 8.3\n"
@@ -1339,23 +7193,155 @@ int main(int argc, char *argv[]) {
                 "                       the path, and the 2nd arg for the file to add to that\n"
                 "                       path. ex: '-ae /EFI/BOOT/ file1.txt' will add the local\n"
                 "                       file 'file1.txt' to the ESP under the path '/EFI/BOOT/'.\n"
-                "                       To add multiple files (up to 10), use multiple\n"
-                "                       <path> <file> args.\n"
+                "                       To add multiple files, use multiple <path> <file> args.\n"
                 "                       ex: '-ae /DIR1/ FILE1.TXT /DIR2/ FILE2.TXT'.\n"
+                "                       If the file is a directory, all files in it and its\n"
+                "                       subdirectories are added under the path, e.g.\n"
+                "                       '-ae /FW/ firmware/' mirrors 'firmware/' into '/FW/'.\n"
+                "-bc --benchmark-crc32  Check that the CRC32 functions for this CPU (slicing-by-8,\n"
+                "                       PCLMULQDQ, ARMv8) agree, time them against the byte at\n"
+                "                       a time version, and exit.\n"
+                "-c  --cache            Keep a build cache in this directory. If the options and\n"
+                "                       inputs are unchanged since the image was last built, it\n"
+                "                       is left as is; if the same inputs were built before, the\n"
+                "                       cached image is cloned into place on reflink capable\n"
+                "                       filesystems; if only files changed, just those files and\n"
+                "                       the metadata are written over the last image. Files are\n"
+                "                       known by size & change time. ex: '-c .write_gpt_cache'.\n"
+                "-cs --cluster-size     Set the size of ESP clusters in bytes, from 512 up to\n"
+                "                       32768, and at least the lba size. By default this is\n"
+                "                       chosen from the ESP size, e.g. 4096 for ESPs over 260MB.\n"
                 "-ds --data-size        Set the size of the Basic Data Partition in MiB; Minimum\n" 
                 "                       size is 1 MiB\n" 
+                "-dv --device           Write the image straight to a block device or file, e.g.\n"
+                "                       '-dv -i /dev/sdX', instead of building an image to dd.\n"
+                "                       Data is written with O_DIRECT in device sized blocks,\n"
+                "                       unused ranges are zeroed by the device or filesystem,\n"
+                "                       and written ranges are read back and checked. The lba\n"
+                "                       size is the device's logical block size unless -l is\n"
+                "                       given. Linux only; can't be used with -c/-pa/-rl/-sp/-u.\n"
                 "-es --esp-size         Set the size of the EFI System Partition in MiB\n"
                 "-h  --help             Print this help text\n"
                 "-i  --image-name       Set the image name. Default name is 'test.hdd'\n"
+                "-is --image-size       Set the size of the whole image in MiB, instead of just\n"
+                "                       fitting all partitions, e.g. to fill a disk with a\n"
+                "                       'size=fill' partition from -p.\n",
+                argv[0]);
+        fprintf(stderr,
+                "-j  --jobs             Copy file data with this many threads, default 1. Files\n"
+                "                       are still laid out in the order given, and the FAT and\n"
+                "                       directories are written once, so the image layout is\n"
+                "                       the same as with 1 job.\n"
+                "                       With 1 job on Linux, file reads & image writes are\n"
+                "                       queued through io_uring where available, after\n"
+                "                       -p partition files are shared or copied kernel-side\n"
+                "                       with copy_file_range() where the filesystem allows.\n"
+                "                       Data partition files are read through a buffer, to\n"
+                "                       get the CRC32s in the data partition index.\n"
                 "-l  --lba-size         Set the lba (sector) size in bytes; This is \n"
                 "                       experimental, as tools are lacking for proper testing.\n"
-                "                       Valid sizes: 512/1024/2048/4096\n" 
+                "                       Valid sizes: 512/1024/2048/4096. Without -es, the ESP\n"
+                "                       is the minimum size for the lba size, e.g. 257 MiB\n"
+                "                       for 4096.\n"
+                "-ls --list             List all files in an existing image instead of creating\n"
+                "                       one: every ESP file & directory with its size, and the\n"
+                "                       data partition files with their size and lba from\n"
+                "                       FILE.TXT. ex: '-ls -i test.hdd'.\n"
+                "-m  --manifest         Add files listed in a manifest file, 1 per line, with\n"
+                "                       no limit on the # of files. Lines are\n"
+                "                       'esp <path> <file or directory>' as with -ae, or\n"
+                "                       'data <file>' as with -ad. Lines starting with '#' are\n"
+                "                       comments. ESP files are only opened as they are added.\n"
+                "-n  --dry-run          Lay out all files and print the lba ranges of every\n"
+                "                       structure and file in the image, without writing it.\n"
+                "                       Fails if any file doesn't fit, as a normal build does\n"
+                "                       before writing anything.\n"
+                "-p  --partition        Add a partition after the data partition, from a spec of\n"
+                "                       comma separated key=value pairs:\n"
+                "                         type   linux (default), root-x86-64, root-arm64, home,\n"
+                "                                swap, lvm, raid, recovery, basic, esp, or a\n"
+                "                                type GUID\n"
+                "                         name   Partition name, up to 36 ASCII chars; default\n"
+                "                                is the type name\n"
+                "                         size   Size in MiB, or 'fill' for the rest of the\n"
+                "                                image (last partition only, needs -is)\n"
+                "                         align  Alignment of the start in MiB, default 1\n"
+                "                         attrs  GPT attributes joined by '+': required,\n"
+                "                                no-block-io, legacy-boot, grow-fs, read-only,\n"
+                "                                hidden, no-automount, or bit numbers\n"
+                "                         file   Raw file (e.g. a filesystem image) to copy to\n"
+                "                                the start of the partition; size defaults to\n"
+                "                                fit it\n"
+                "                       Partitions are laid out in the order given, up to 126.\n"
+                "                       ex: '-p type=root-x86-64,name=root-a,file=root.img'.\n"
+                "-pa --preallocate      Preallocate the ranges of the image file that hold data\n"
+                "                       on the host filesystem, to avoid fragmenting the image.\n"
+                "-q  --qcow2            Create a qcow2 image instead of a raw image, e.g. for\n"
+                "                       QEMU. Only the clusters holding data are allocated, so\n"
+                "                       the image size follows the files added instead of the\n"
+                "                       partition sizes. The image name will have a .qcow2\n"
+                "                       suffix. Can't be used with -c/-pa/-rl/-sp/-u.\n"
+                "-re --remove-esp-files Remove files or empty directories from the ESP of an\n"
+                "                       existing image, freeing their clusters. Only valid with\n"
+                "                       -u. ex: '-u -re /EFI/BOOT/OLD.EFI /EFI/OLDDIR'.\n");
+        fprintf(stderr,
+                "-rl --reflink          Clone files added to the data partition into the image\n"
+                "                       instead of copying them, sharing their data blocks when\n"
+                "                       the files and image are on the same btrfs/XFS/etc.\n"
+                "                       filesystem. Each file is aligned to the host filesystem\n"
+                "                       block size, and copied instead if it can't be cloned.\n"
+                "-rp --reproducible     Create a byte-identical image from the same inputs. GUIDs\n"
+                "                       are derived from a hash of the layout and all files\n"
+                "                       added (reading each file twice), ESP files are added in\n"
+                "                       path order, and timestamps are from SOURCE_DATE_EPOCH, or\n"
+                "                       01/01/1980 if it is not set.\n"
+                "-sd --seed             Derive GUIDs from this string instead of the files\n"
+                "                       added; implies -rp. ex: '-sd myos-1.0'.\n"
+                "-sp --sparse           Do not write zero filled regions of the image, leaving\n"
+                "                       them as holes in a sparse file. Holes in files added to\n"
+                "                       the data partition are also kept as holes.\n"
+                "-st --stream           Write the image front to back in a single pass, without\n"
+                "                       seeking, so it can go to a pipe or FIFO; use '-i -' to\n"
+                "                       write it to stdout, e.g. '-i - | zstd > test.hdd.zst'.\n"
+                "                       All metadata is built in memory first, and file data\n"
+                "                       is read as it is written. Can't be used with\n"
+                "                       -c/-pa/-rl/-sp/-u, and is always 1 job.\n"
+                "-u  --update           Update an existing image in place instead of creating a\n"
+                "                       new one. ESP files from -ae and BOOTX64.EFI are added,\n"
+                "                       or replaced if they have changed; nothing else in the\n"
+                "                       image is rewritten. Can't be used with -ad/-cs/-ds/-es/-l.\n"
                 "-v  --vhd              Create a fixed vhd footer and add it to the end of the\n" 
-                "                       disk image. The image name will have a .vhd suffix.\n",
-                argv[0]);
+                "                       disk image. The image name will have a .vhd suffix.\n"
+                "-vd --vhd-dynamic      Create a dynamic vhd instead of a raw image. Only 2 MiB\n"
+                "                       blocks holding non-zero data are allocated, so the\n"
+                "                       image size follows the files added instead of the\n"
+                "                       partition sizes. The image name will have a .vhd\n"
+                "                       suffix. Can't be used with -c/-pa/-rl/-sp/-u.\n"
+                "-vf --verify           Check an existing image instead of creating one: the\n"
+                "                       protective MBR, both GPT headers & tables and their CRCs,\n"
+                "                       that the FATs match, all ESP cluster chains for cross-\n"
+                "                       links, lost clusters and sizes, FSInfo, and the FILE.TXT\n"
+                "                       data partition records. FAT ranges are checked with -j\n"
+                "                       threads, by default 1 per CPU. Also prints ESP free space\n"
+                "                       and fragmentation. ex: '-vf -i test.hdd'.\n"
+                "-vx --vhdx             Create a dynamic vhdx instead of a raw image, with only\n"
+                "                       2 MiB blocks holding non-zero data allocated as with\n"
+                "                       -vd. LBA size can be 512 or 4096. The image name will\n"
+                "                       have a .vhdx suffix. Can't be used with\n"
+                "                       -c/-pa/-rl/-sp/-u.\n"
+                "-x  --extract          Extract files from an existing image to a local\n"
+                "                       directory instead of creating one, without mounting it.\n"
+                "                       Paths starting with '/' are ESP files or directories,\n"
+                "                       other names are data partition files. With no paths,\n"
+                "                       the ESP is extracted to <dir>/ESP/ and data partition\n"
+                "                       files to <dir>/DATA/. Use '-' as the directory to write\n"
+                "                       a single file to stdout.\n"
+                "                       ex: '-x out /EFI/BOOT/ kernel.bin', '-x - /EFI/BOOT/B.TXT'.\n");
         return EXIT_SUCCESS;
     }
 
+    if (options.benchmark_crc32) return benchmark_crc32() ? EXIT_SUCCESS : EXIT_FAILURE;
+
     // Using .hdd to ensure this also works by default in e.g. VirtualBox or other programs
     char *image_name = "test.hdd";  
 
@@ -1363,6 +7349,117 @@ int main(int argc, char *argv[]) {
 
     if (options.lba_size) lba_size = options.lba_size;
 
+    sparse = options.sparse;
+    // Image formats other than raw & fixed vhd, and images written straight to a 
+    //   device, are written from ranges saved in memory, as with streaming
+    streaming = options.stream || options.qcow2 || options.vhd_dynamic || options.vhdx || 
+                options.device || !strcmp(image_name, "-");   // "-" = stdout
+    preallocate = options.preallocate;
+    update = options.update;
+    dry_run = options.dry_run;
+    reproducible = options.reproducible;
+
+    // Use a fixed time for all timestamps if set, per reproducible-builds.org; 
+    //   reproducible images use the earliest FAT32 date otherwise
+    const char *epoch = getenv("SOURCE_DATE_EPOCH");
+    if (epoch && *epoch) {
+        char *end = NULL;
+        errno = 0;
+        const long long epoch_value = strtoll(epoch, &end, 10);
+        if (*end || errno == ERANGE || epoch_value < 0 || epoch_value > FAT32_LAST_TIME) {
+            fprintf(stderr, "Error: SOURCE_DATE_EPOCH must be a # of seconds since 1970-01-01\n");
+            return EXIT_FAILURE;
+        }
+        source_date_epoch = epoch_value;
+    } else if (reproducible) {
+        source_date_epoch = FAT32_EPOCH;
+    }
+
+    if (update && (options.num_data_files || options.data_size || options.esp_size || options.lba_size ||
+                   options.cluster_size || options.num_partitions || options.image_size)) {
+        fprintf(stderr, "Error: Can't change the image layout or data partition when updating "
+                        "an existing image\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.cache_dir && update) {
+        fprintf(stderr, "Error: The build cache can only be used when creating a new image\n");
+        return EXIT_FAILURE;
+    }
+
+    if (streaming && (update || options.cache_dir || options.sparse || options.preallocate || 
+                      options.reflink)) {
+        fprintf(stderr, "Error: A streamed, device, qcow2, dynamic vhd or vhdx image can't be "
+                        "used with -c/-pa/-rl/-sp/-u\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.device && (options.stream || options.vhd || options.vhd_dynamic || options.vhdx || 
+                           options.qcow2 || options.verify || options.list || options.extract_dir ||
+                           !strcmp(image_name, "-"))) {
+        fprintf(stderr, "Error: -dv can't be used with -ls/-q/-st/-v/-vd/-vf/-vx/-x, or with "
+                        "'-i -'\n");
+        return EXIT_FAILURE;
+    }
+
+    if (options.vhd + options.vhd_dynamic + options.vhdx + options.qcow2 > 1) {
+        fprintf(stderr, "Error: Only 1 of -q/-v/-vd/-vx can be used\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((options.qcow2 || options.vhd_dynamic || options.vhdx) && 
+        (options.verify || options.list || options.extract_dir)) {
+        fprintf(stderr, "Error: Only raw & fixed vhd images can be used with -ls/-vf/-x\n");
+        return EXIT_FAILURE;
+    }
+
+    // Keep stdout for a streamed image, and send all other output to stderr
+    int stdout_fd = -1;
+    if (streaming && !strcmp(image_name, "-")) {
+        fflush(stdout);
+#if defined(_WIN32)
+        stdout_fd = _dup(_fileno(stdout));
+        if (stdout_fd >= 0) _setmode(stdout_fd, _O_BINARY);
+        if (stdout_fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0) {
+#else
+        stdout_fd = dup(STDOUT_FILENO);
+        if (stdout_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+#endif
+            fprintf(stderr, "Error: Could not use stdout for the image\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Match the lba size to a device's logical block size, unless set; writes are
+    //   in physical blocks of up to 4KiB, and never smaller than an lba
+    uint64_t device_block_size = 0;
+    if (options.device) {
+        uint32_t logical = 0, physical = 0;
+        if (!get_device_block_sizes(image_name, &logical, &physical)) return EXIT_FAILURE;
+
+        if (logical && !options.lba_size) {
+            if (logical != 512 && logical != 1024 && logical != 2048 && logical != 4096) {
+                fprintf(stderr, "Error: Device block size %u is not a valid lba size\n", logical);
+                return EXIT_FAILURE;
+            }
+            lba_size = logical;
+        }
+
+        if (lba_size < logical) {
+            fprintf(stderr, "Error: LBA size must be at least the device block size %u\n", logical);
+            return EXIT_FAILURE;
+        }
+
+        device_block_size = physical > 4096 ? 4096 : physical;
+        if (device_block_size < lba_size) device_block_size = lba_size;
+    }
+
+    if (options.num_esp_remove_paths && !update) {
+        fprintf(stderr, "Error: Files can only be removed from the ESP when updating an existing "
+                        "image\n");
+        return EXIT_FAILURE;
+    }
+
     if (options.esp_size) {
         // Enforce minimum sizes for ESP according to LBA size
         if ((lba_size == 512  && options.esp_size < 33)  ||
@@ -1375,164 +7472,521 @@ int main(int argc, char *argv[]) {
             return EXIT_FAILURE;
         }
 
-        esp_size = options.esp_size * ALIGNMENT; 
+        esp_size = (uint64_t)options.esp_size * ALIGNMENT; 
+    } else {
+        // Default is the minimum size for the LBA size, e.g. from a 4Kn device with -dv
+        esp_size = ((32 * lba_size / 512) + 1) * ALIGNMENT;
     }
 
     // NOTE: Data partition will always be at least 1 MiB in size
-    if (options.data_size) data_size = options.data_size * ALIGNMENT;
+    if (options.data_size) data_size = (uint64_t)options.data_size * ALIGNMENT;
 
     // Set sizes & LBA values
     gpt_table_lbas = GPT_TABLE_SIZE / lba_size;
-
-    // Add extra padding for:
-    //   2 aligned partitions
-    //   2 GPT tables
-    //   MBR
-    //   GPT headers
-    const uint64_t padding = (ALIGNMENT*2 + (lba_size * ((gpt_table_lbas*2) + 1 + 2))); 
-    image_size = esp_size + data_size + padding; 
-    image_size_lbas = bytes_to_lbas(image_size);
     align_lba = ALIGNMENT / lba_size;
     esp_lba = align_lba;
     esp_size_lbas = bytes_to_lbas(esp_size);
     data_size_lbas = bytes_to_lbas(data_size);
     data_lba = next_aligned_lba(esp_lba + esp_size_lbas - 1);   // Use 0-based index size in lbas
 
-    if (options.vhd) {
+    // Partitions after the data partition; only the last can fill the image, 
+    //   which needs the image size
+    partitions = options.partitions;
+    num_partitions = options.num_partitions;
+    for (uint32_t i = 0; i < num_partitions; i++) {
+        if (partitions[i].fill && (i + 1 < num_partitions || !options.image_size)) {
+            fprintf(stderr, "Error: Only the last partition can fill the image, and only when "
+                            "the image size is set with -is\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.image_size) {
+        image_size = (uint64_t)options.image_size * ALIGNMENT;
+        image_size_lbas = bytes_to_lbas(image_size);
+    }
+
+    uint64_t end_lba = data_lba + data_size_lbas;
+    if (!layout_partitions(&end_lba)) return EXIT_FAILURE;
+
+    // Image holds all partitions, and by default extra padding for:
+    //   1 more alignment after the last partition
+    //   2 GPT tables
+    //   MBR
+    //   GPT headers
+    const uint64_t min_image_size = (end_lba * lba_size) + ALIGNMENT + 
+                                    (lba_size * ((gpt_table_lbas*2) + 1 + 2));
+    if (!options.image_size) {
+        image_size = min_image_size;
+        image_size_lbas = bytes_to_lbas(image_size);
+    } else if (end_lba > image_size_lbas - 1 - gpt_table_lbas) {
+        fprintf(stderr, "Error: Image size must be at least %"PRIu64" MiB to hold all "
+                        "partitions\n", (min_image_size + ALIGNMENT - 1) / ALIGNMENT);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t padding = image_size - esp_size - data_size;
+    for (uint32_t i = 0; i < num_partitions; i++) 
+        padding -= partitions[i].num_lbas * lba_size;
+
+    // Get ESP cluster size, this also sets the size of the FATs
+    if (!update) {
+        // FAT32 sector counts are 32 bits; the data partition has no such limit
+        if (esp_size_lbas > UINT32_MAX) {
+            fprintf(stderr, "Error: ESP can be at most %"PRIu64" MiB with %"PRIu64" byte LBAs "
+                            "for FAT32\n", (UINT32_MAX * lba_size) / ALIGNMENT, lba_size);
+            return EXIT_FAILURE;
+        }
+
+        if (options.cluster_size && options.cluster_size < lba_size) {
+            fprintf(stderr, "Error: Cluster size must be at least the LBA size\n");
+            return EXIT_FAILURE;
+        }
+
+        esp_sec_per_clus = get_esp_sectors_per_cluster(options.cluster_size);
+        if (!esp_sec_per_clus) {
+            fprintf(stderr, "Error: ESP would have too few or too many clusters for FAT32 with "
+                            "this cluster size; use a smaller cluster size or larger ESP\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.vhd || options.vhd_dynamic) {
         // Only allow lba_size = 512 for vhd,
         //   the spec says it only uses 512 byte disk sectors
         if (lba_size > 512) {
             fprintf(stderr, "Error: VHD only allows disk sector size (LBA) = 512 bytes\n");
             return EXIT_FAILURE;
         }
+    }
+
+    if (options.vhdx && lba_size != 512 && lba_size != 4096) {
+        fprintf(stderr, "Error: VHDX only allows disk sector size (LBA) = 512 or 4096 bytes\n");
+        return EXIT_FAILURE;
+    }
+
+    if (((options.vhd || options.vhd_dynamic) && image_size > VHD_MAX_SIZE) || 
+        (options.vhdx && image_size > VHDX_MAX_SIZE)) {
+        fprintf(stderr, "Error: Image is too large for %s, which is limited to %"PRIu64" GiB\n", 
+                options.vhdx ? "VHDX" : "VHD", 
+                (options.vhdx ? VHDX_MAX_SIZE : VHD_MAX_SIZE) / (1024 * 1024 * 1024));
+        return EXIT_FAILURE;
+    }
 
-        // Add VHD suffix to image name
-        char *buf = calloc(1, strlen(image_name) + 5);
+    if (options.vhd || options.vhd_dynamic || options.vhdx || options.qcow2) {
+        // Add VHD, VHDX or qcow2 suffix to image name, unless writing to stdout
+        const char *suffix = options.vhdx ? ".vhdx" : options.qcow2 ? ".qcow2" : ".vhd";
+        char *buf = calloc(1, strlen(image_name) + strlen(suffix) + 1);
         strcpy(buf, image_name);
 
         char *dot_pos = strrchr(buf, '.');
         if (!dot_pos) dot_pos = buf + strlen(buf); 
-        strcpy(dot_pos, ".vhd");
+        if (strcmp(buf, "-")) strcpy(dot_pos, suffix);
         image_name = buf;
     }
 
-    // Open image file
-    image = fopen(image_name, "wb+");
-    if (!image) {
-        fprintf(stderr, "Error: could not open file %s\n", image_name);
-        return EXIT_FAILURE;
-    }
-
-    // Print info on sizes and image for user
-    printf("IMAGE NAME: %s\n"
-           "LBA SIZE: %"PRIu64"\n"
-           "ESP SIZE: %"PRIu64"MiB\n"
-           "DATA SIZE: %"PRIu64"MiB\n"
-           "PADDING: %"PRIu64"MiB\n"
-           "IMAGE SIZE: %"PRIu64"MiB\n",
+    if (options.verify) return verify_image(image_name, options.jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-           image_name,
-           lba_size,
-           esp_size / ALIGNMENT,
-           data_size / ALIGNMENT,
-           padding / ALIGNMENT,
-           image_size / ALIGNMENT);
+    if (options.list || options.extract_dir) {
+        // Read partitions & ESP directories of an existing image, and list or extract its files
+        image = fopen(image_name, "rb");
+        if (!image) {
+            fprintf(stderr, "Error: could not open file %s\n", image_name);
+            return EXIT_FAILURE;
+        }
 
-    // Seed random number generation
-    srand(time(NULL));
+        bool result = read_gpts(image) && read_esp(image);
+        if (!result) fprintf(stderr, "Error: could not read existing image %s\n", image_name);
+        if (result && options.list) result = list_image(image);
+        if (result && options.extract_dir) 
+            result = extract_from_image(image, options.extract_dir, options.extract_paths, 
+                                        options.num_extract_paths);
 
-    // Write protective MBR
-    if (!write_mbr(image)) {
-        fprintf(stderr, "Error: could not write protective MBR for file %s\n", image_name);
         fclose(image);
-        return EXIT_FAILURE;
+        return result ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
-    // Write GPT headers & tables
-    if (!write_gpts(image)) {
-        fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", image_name);
-        fclose(image);
-        return EXIT_FAILURE;
+    if (update) {
+        // Open existing image file, and read its partitions & ESP metadata
+        image = fopen(image_name, dry_run ? "rb" : "rb+");
+        if (!image) {
+            fprintf(stderr, "Error: could not open file %s\n", image_name);
+            return EXIT_FAILURE;
+        }
+
+        if (!read_gpts(image) || !read_esp(image)) {
+            fprintf(stderr, "Error: could not read existing image %s\n", image_name);
+            fclose(image);
+            return EXIT_FAILURE;
+        }
+
+        printf("UPDATING IMAGE: %s\n"
+               "LBA SIZE: %"PRIu64"\n"
+               "ESP SIZE: %"PRIu64"MiB\n"
+               "ESP CLUSTER SIZE: %"PRIu64"\n",
+               image_name,
+               lba_size,
+               esp_size / ALIGNMENT,
+               esp.cluster_size);
+    } else {
+        // Get host filesystem block size for aligning cloned files, from the 
+        //   directory the image will be in
+        if (options.reflink) {
+#if defined(__linux__) && defined(FICLONERANGE)
+            char *image_dir = join_strings(image_name, "");
+            char *slash = image_dir ? strrchr(image_dir, '/') : NULL;
+            if (slash) slash[1] = '\0';
+
+            struct stat st;
+            if (image_dir && stat(slash ? image_dir : ".", &st) == 0 && st.st_blksize > 0) {
+                // Round up to a multiple of the lba size
+                host_block_size = (bytes_to_lbas(st.st_blksize) * lba_size);
+                reflink = true;
+            }
+            free(image_dir);
+#endif
+            if (!reflink) 
+                fprintf(stderr, "WARNING: Reflinks are not supported here, copying files instead\n");
+        }
+
+        // Print info on sizes and image for user
+        printf("IMAGE NAME: %s\n"
+               "LBA SIZE: %"PRIu64"\n"
+               "ESP SIZE: %"PRIu64"MiB\n"
+               "ESP CLUSTER SIZE: %"PRIu64"\n"
+               "DATA SIZE: %"PRIu64"MiB\n"
+               "PADDING: %"PRIu64"MiB\n"
+               "IMAGE SIZE: %"PRIu64"MiB\n",
+
+               image_name,
+               lba_size,
+               esp_size / ALIGNMENT,
+               esp_sec_per_clus * lba_size,
+               data_size / ALIGNMENT,
+               padding / ALIGNMENT,
+               image_size / ALIGNMENT);
+
+        for (uint32_t i = 0; i < num_partitions; i++) 
+            printf("PARTITION %u: '%s' %"PRIu64"MiB at LBA %"PRIu64"\n", i + 3, partitions[i].name, 
+                   (partitions[i].num_lbas * lba_size) / ALIGNMENT, partitions[i].lba);
+
+        // Seed random number generation
+        srand(time(NULL));
+
+        // Set up EFI System Partition w/FAT32 filesystem in memory
+        if (!new_esp()) {
+            fprintf(stderr, "Error: could not set up ESP for file %s\n", image_name);
+            return EXIT_FAILURE;
+        }
     }
 
-    // Write EFI System Partition w/FAT32 filesystem
-    if (!write_esp(image)) {
-        fprintf(stderr, "Error: could not write ESP for file %s\n", image_name);
-        fclose(image);
-        return EXIT_FAILURE;
+    // Build cache; names of all files given must be hashed before they are added
+    cache_dir = dry_run ? NULL : options.cache_dir;
+    const uint64_t options_hash = cache_dir ? get_options_hash(&options) : 0;
+
+    // Lay out all files first, without writing anything to the image; every 
+    //   file's clusters or data partition range is set here, and any file that 
+    //   doesn't fit stops the build before the image is written
+    bool planned = true;
+
+    if (options.num_esp_remove_paths > 0) {
+        // Remove files first, so their clusters can be reused by added files
+        for (uint32_t i = 0; i < options.num_esp_remove_paths; i++) {
+            if (!remove_path_from_esp(options.esp_remove_paths[i])) {
+                fprintf(stderr,
+                        "ERROR: Could not remove '%s' from ESP\n",
+                        options.esp_remove_paths[i]);
+                planned = false;
+            }
+            free(options.esp_remove_paths[i]);
+        }
+        free(options.esp_remove_paths);
     }
 
     // Check if "BOOTX64.EFI" file exists in current directory, if so automatically
     //   add it to the ESP
     fp = fopen("BOOTX64.EFI", "rb"); 
+    copy_source_path = "BOOTX64.EFI";
     if (fp) {
         char path[25] = { 0 };
         strcpy(path, "/EFI/BOOT/BOOTX64.EFI");
-        if (!add_path_to_esp(path, fp, image)) 
+        if (!add_path_to_esp(path, fp, image)) {
             fprintf(stderr, "Error: Could not add file '%s'\n", path);
+            planned = false;
+        }
 
         fclose(fp);
     }
 
-    if (options.num_esp_file_paths > 0) {
-        // Add file paths to EFI System Partition
-        for (uint32_t i = 0; i < options.num_esp_file_paths; i++) {
-            if (!add_path_to_esp(options.esp_file_paths[i], options.esp_files[i], image)) {
-                fprintf(stderr,
-                        "ERROR: Could not add '%s' to ESP\n",
-                        options.esp_file_paths[i]);
+    if (options.num_esp_files > 0) {
+        // Add files in batches by ESP directory, so each directory is looked up, 
+        //   allocated and filled in one go; files in a directory keep their order
+        qsort(options.esp_files, options.num_esp_files, sizeof *options.esp_files, compare_esp_files);
+
+        for (uint32_t i = 0; i < options.num_esp_files; ) {
+            // Count files added to this directory, including "." and "..", so large 
+            //   directories can be allocated up front instead of grown a few times
+            uint32_t batch_end = i + 1;
+            while (batch_end < options.num_esp_files && 
+                   !compare_esp_dirs(&options.esp_files[i], &options.esp_files[batch_end])) 
+                batch_end++;
+            esp_dir_hint = 2 + (batch_end - i);
+
+            // Add file paths to EFI System Partition, opening each file only as it is added
+            for (; i < batch_end; i++) {
+                Esp_File *esp_file = &options.esp_files[i];
+                copy_source_path = esp_file->file_path;
+                fp = fopen(esp_file->file_path, "rb");
+                if (!fp) {
+                    fprintf(stderr, "Error: Could not fopen file '%s'\n", esp_file->file_path);
+                    planned = false;
+                } else if (!add_path_to_esp(esp_file->esp_path, fp, image)) {
+                    fprintf(stderr,
+                            "ERROR: Could not add '%s' to ESP\n",
+                            esp_file->esp_path);
+                    planned = false;
+                }
+                if (fp) fclose(fp);
+                free(esp_file->esp_path);
             }
-            free(options.esp_file_paths[i]);
-            fclose(options.esp_files[i]);
         }
-        free(options.esp_file_paths);
-        free(options.esp_files);
+        esp_dir_hint = 0;
     }
 
-    if (options.num_data_files > 0) {
+    // Image is padded to the next 4KiB aligned size, unless its size was given; a
+    //   fixed VHD footer then goes after it
+    const uint64_t current_size = image_size_lbas * lba_size;
+    const uint64_t new_size = options.image_size ? current_size + (options.vhd ? sizeof(Vhd) : 0) : 
+                                                   current_size - (current_size % 4096) + 4096;
+
+    if (!update) {
         // Add file paths to Basic Data Partition
         for (uint32_t i = 0; i < options.num_data_files; i++) {
-            if (!add_file_to_data_partition(options.data_files[i], image)) {
+            if (!add_file_to_data_partition(options.data_files[i])) {
                 fprintf(stderr,
                         "ERROR: Could not add file '%s' to data partition\n",
                         options.data_files[i]);
+                planned = false;
             }
-            free(options.data_files[i]);
         }
-        free(options.data_files);
+        if (!layout_data_index()) planned = false;
+
+        // Add raw content files of partitions after the data partition
+        if (!add_partition_files()) planned = false;
+
+        // Add disk image info file to hold at minimum the size of this disk image;
+        //   this could be used in an EFI application later as part of an installer, for example
+        if (!add_disk_image_info_file(image, new_size)) {
+            fprintf(stderr, "Error: Could not add disk image info file to '%s'\n", image_name);
+            planned = false;
+        }
+    }
+
+    if (!planned) {
+        fprintf(stderr, "Error: Could not lay out all files, nothing was written to %s\n", 
+                image_name);
+        if (image) fclose(image);
+        return EXIT_FAILURE;
     }
 
-    // Pad file to next 4KiB aligned size
-    fseek(image, 0, SEEK_END);
-    uint64_t current_size = ftell(image);
-    uint64_t new_size = current_size - (current_size % 4096) + 4096;
-    uint8_t byte = 0;
+    if (dry_run) {
+        // Show where everything would go, and stop before writing anything
+        const bool result = print_plan();
+        if (image) fclose(image);
+        return result ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Skip building the image if it, or a cached image, was built from the same 
+    //   options and inputs; otherwise patch it in place if only files changed
+    Cache_State old_state = { 0 }, new_state = { 0 };
+    char *state_path = NULL;
+    bool patching = false;
+    if (cache_dir) {
+        // Cache directory may not exist yet; any other problem shows up when using it
+#if defined(_WIN32)
+        mkdir(cache_dir);
+#else
+        mkdir(cache_dir, 0755);
+#endif
+        state_path = get_cache_path(fnv1a_64(FNV_OFFSET_BASIS, image_name, strlen(image_name)), 
+                                    ".state");
+        if (!state_path || !get_cache_state(options_hash, &new_state)) {
+            fprintf(stderr, "Error: Could not get build cache state for %s\n", image_name);
+            return EXIT_FAILURE;
+        }
+
+        const bool have_state = read_cache_state(state_path, &old_state) && 
+                                old_state.image == get_file_fingerprint(image_name);
+        if (have_state && old_state.key == new_state.key) {
+            printf("Image %s is up to date\n", image_name);
+            return EXIT_SUCCESS;
+        }
+
+        char *cached_path = get_cache_path(new_state.key, ".img");
+        if (cached_path && clone_whole_file(cached_path, image_name)) {
+            new_state.image = get_file_fingerprint(image_name);
+            if (!write_cache_state(state_path, &new_state))
+                fprintf(stderr, "WARNING: Could not write build cache state %s\n", state_path);
+            printf("Image %s restored from build cache\n", image_name);
+            return EXIT_SUCCESS;
+        }
+        free(cached_path);
 
-    if (options.vhd) {
-        fseek(image, new_size - (sizeof(Vhd) + 1), SEEK_SET);
-        fwrite(&byte, 1, 1, image);
+        // Anything changing the layout means a full rebuild
+        patching = have_state && old_state.layout == new_state.layout;
+        if (have_state) get_cached_crc32s(&old_state, &new_state);
+    }
 
-        // Add a fixed Virtual Hard Disk footer to the disk image
-        add_fixed_vhd_footer(image);
-        printf("Added VHD footer\n");
+    if (reproducible && !update) {
+        // Seed GUIDs from the seed string, or from everything that goes in the image
+        if (options.seed) {
+            guid_seed = fnv1a_64(FNV_OFFSET_BASIS, options.seed, strlen(options.seed));
+        } else if (!get_content_seed(&guid_seed)) {
+            fprintf(stderr, "Error: Could not hash files for a reproducible image\n");
+            return EXIT_FAILURE;
+        }
+    }
 
-        // Image_name had .vhd concat-ed on in a separate buffer
-        free(image_name);   
+    bool result = true;
+    if (update) {
+        // Only changed files and ESP metadata are written back to an existing image; 
+        //   the data partition and image info file are left as is. File data goes
+        //   first, so the existing metadata stays valid until it is replaced
+        result = run_copy_jobs(image, image_name, options.jobs);
+        result = write_esp_metadata(image) && result;
+        if (!result) fprintf(stderr, "Error: could not write all changes to file %s\n", image_name);
     } else {
-        // No vhd footer
-        fseek(image, new_size - 1, SEEK_SET);
-        fwrite(&byte, 1, 1, image);
+        // Open image file; a patched image is written over, with unchanged files kept.
+        //   A streamed image is only written once, front to back, and can be a 
+        //   pipe or stdout. A device is only opened once everything is laid out
+        if (stdout_fd >= 0) {
+#if defined(_WIN32)
+            image = _fdopen(stdout_fd, "wb");
+#else
+            image = fdopen(stdout_fd, "wb");
+#endif
+        } else if (!options.device) {
+            image = fopen(image_name, streaming ? "wb" : patching ? "rb+" : "wb+");
+        }
+        if (!image && !options.device) {
+            fprintf(stderr, "Error: could not open file %s\n", image_name);
+            return EXIT_FAILURE;
+        }
+
+        if (patching && !patch_image(image, &old_state, &new_state)) {
+            fprintf(stderr, "Error: could not patch existing image %s\n", image_name);
+            if (image) fclose(image);
+            return EXIT_FAILURE;
+        }
+
+        // Write protective MBR
+        if (!write_mbr(image)) {
+            fprintf(stderr, "Error: could not write protective MBR for file %s\n", image_name);
+            if (image) fclose(image);
+            return EXIT_FAILURE;
+        }
+
+        // Write GPT headers & tables
+        if (!write_gpts(image)) {
+            fprintf(stderr, "Error: could not write GPT headers & tables for file %s\n", image_name);
+            if (image) fclose(image);
+            return EXIT_FAILURE;
+        }
+
+        // Write EFI System Partition w/FAT32 filesystem; VBRs, then staged FAT32 
+        //   metadata (FSInfo, FATs, directories), then all file data in increasing 
+        //   offset order
+        if (!write_esp(image) || !write_esp_metadata(image)) {
+            fprintf(stderr, "Error: could not write ESP for file %s\n", image_name);
+            if (image) fclose(image);
+            return EXIT_FAILURE;
+        }
+
+        // Streamed file data is written in order, so worker threads would not help
+        if (!run_copy_jobs(image, image_name, streaming ? 1 : options.jobs)) {
+            fprintf(stderr, "Error: Could not copy all files to '%s'\n", image_name);
+            result = false;
+        }
+
+        // Data partition index has the CRC32 of each file, got while it was copied
+        if (result && !write_data_index(image)) {
+            fprintf(stderr, "Error: could not write data partition index for file %s\n", image_name);
+            result = false;
+        }
+        if (result && cache_dir) add_cache_crc32s(&new_state);
+
+        // Pad file to next 4KiB aligned size
+        uint8_t byte = 0;
+
+        if (streaming) {
+            // Write out everything saved so far, with the padding and any VHD footer; 
+            //   qcow2, dynamic vhd and vhdx images only have the parts holding data, 
+            //   and only those parts of a device are written
+            if (options.vhd) add_fixed_vhd_footer(image, new_size - sizeof(Vhd));
+            if (result && !(options.qcow2       ? write_qcow2(image, new_size) : 
+                            options.vhd_dynamic ? write_dynamic_vhd(image, new_size) :
+                            options.vhdx        ? write_vhdx(image, new_size) :
+                            options.device      ? write_to_device(image_name, new_size, 
+                                                                  device_block_size) :
+                                                  write_stream(image, new_size, 0))) {
+                fprintf(stderr, "Error: could not write streamed image %s\n", image_name);
+                result = false;
+            }
+            if (options.vhd) printf("Added VHD footer\n");
+        } else if (options.vhd) {
+            if (sparse) {
+                set_image_size(image, new_size - sizeof(Vhd));
+            } else {
+                seek_to(image, new_size - (sizeof(Vhd) + 1));
+                fwrite(&byte, 1, 1, image);
+            }
+
+            // Add a fixed Virtual Hard Disk footer to the disk image
+            add_fixed_vhd_footer(image, new_size - sizeof(Vhd));
+            printf("Added VHD footer\n");
+        } else {
+            // No vhd footer
+            if (sparse) {
+                set_image_size(image, new_size);
+            } else {
+                seek_to(image, new_size - 1);
+                fwrite(&byte, 1, 1, image);
+            }
+        }
     }
 
-    // Add disk image info file to hold at minimum the size of this disk image;
-    //   this could be used in an EFI application later as part of an installer, for example
-    image_size = new_size; // Image size is used to write info file
-    if (!add_disk_image_info_file(image)) 
-        fprintf(stderr, "Error: Could not add disk image info file to '%s'\n", image_name);
+    for (uint32_t i = 0; i < options.num_esp_files; i++)
+        free(options.esp_files[i].file_path);
+    free(options.esp_files);
+    for (uint32_t i = 0; i < options.num_data_files; i++)
+        free(options.data_files[i]);
+    free(options.data_files);
+    for (uint32_t i = 0; i < options.num_partitions; i++)
+        free(options.partitions[i].file_path);
+    free(options.partitions);
+    free(data_index);
 
     // File cleanup
-    fclose(image);
+    if (image && fclose(image) != 0) result = false;
+
+    if (cache_dir && result) {
+        // Save what this image was built from, and keep a copy of it in the cache 
+        //   if it can be cloned without using more space
+        new_state.image = get_file_fingerprint(image_name);
+        if (!write_cache_state(state_path, &new_state))
+            fprintf(stderr, "WARNING: Could not write build cache state %s\n", state_path);
+
+        char *cached_path = get_cache_path(new_state.key, ".img");
+        if (cached_path) clone_whole_file(image_name, cached_path);
+        free(cached_path);
+    }
+    free(state_path);
+    free(old_state.extents);
+    free(new_state.extents);
+
+    // Image_name had .vhd/.vhdx/.qcow2 concat-ed on in a separate buffer
+    if (options.vhd || options.vhd_dynamic || options.vhdx || options.qcow2) free(image_name);
 
-    return EXIT_SUCCESS;
+    return result ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 